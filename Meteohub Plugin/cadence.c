@@ -0,0 +1,149 @@
+/*
+
+	cadence.c
+
+	adaptive poll interval per gauge. Gauges are polled often while snow depth is changing and less
+	often while it is stable or the battery is low, to save radio and sensor wake-ups on solar
+	powered gauges. Intervals are the floor times a power of 2 so the scheduler (sched.c) keeps
+	polls on interval boundaries since midnight, the same alignment meteohub sees with a fixed
+	SLEEP_SECONDS.
+
+*/
+
+#include "mhsdpi.h"
+
+// largest floor * 2^n not above the ceiling
+static uint32_t cadence_ceiling(const struct config_t *config)
+{
+	uint32_t interval = config->poll_min_seconds;
+
+	while(interval * 2 <= config->poll_max_seconds)
+		interval *= 2;
+
+	return interval;
+}
+
+void cadence_init(struct gauge_t *g)
+{
+	struct config_t *config = g->config;
+	struct cadence_t *c = &g->cadence;
+
+	memset(c, 0, sizeof(*c));
+	c->reported_ms = get_monotonic_ms();
+	c->interval = config->sleep_seconds;
+
+	if(config->poll_min_seconds == 0)
+		return;
+
+	c->interval = config->poll_min_seconds;
+	while(c->interval * 2 <= config->sleep_seconds && c->interval * 2 <= cadence_ceiling(config)) // start near SLEEP_SECONDS
+		c->interval *= 2;
+}
+
+// count the wake-ups saved against polling every sleep_seconds at a snow depth poll at wall clock second now,
+// negative while storms are polled faster
+void cadence_polled(struct gauge_t *g, int64_t now)
+{
+	struct cadence_t *c = &g->cadence;
+
+	if(c->last_poll > 0)
+		c->saved += ((now / g->config->sleep_seconds) - (c->last_poll / g->config->sleep_seconds)) - 1;
+	c->last_poll = now;
+}
+
+// least squares slope of the readings window in mm per hour, false when the readings span too short a time
+static boolean cadence_slope(struct gauge_t *g, double *slope)
+{
+	struct rollstat_t *r = &g->readings;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, x = 0, d = 0;
+	int64_t t0 = 0, span = 0;
+	int i = 0, pos = 0;
+
+	if(r->count < 2)
+		return false;
+
+	t0 = g->reading_times[r->head];
+	span = g->reading_times[(r->head + r->count - 1) % r->window] - t0;
+	if(span < 2 * (int64_t)g->config->poll_min_seconds) // seed readings are taken back to back, their noise is not a rate
+		return false;
+
+	for(i = 0; i < r->count; i++)
+	{
+		pos = (r->head + i) % r->window;
+		x = (g->reading_times[pos] - t0) / 3600.0;
+		sx += x;
+		sy += r->values[pos];
+		sxx += x * x;
+		sxy += x * r->values[pos];
+	}
+
+	if((d = (r->count * sxx) - (sx * sx)) <= 0)
+		return false;
+
+	*slope = ((r->count * sxy) - (sx * sy)) / d;
+	return true;
+}
+
+// pick the next poll interval from the poll cycle just emitted
+void cadence_update(struct gauge_t *g)
+{
+	struct config_t *config = g->config;
+	struct cadence_t *c = &g->cadence;
+	char message_buffer[256];
+	const char *reason = NULL;
+	uint32_t interval = c->interval;
+	double slope = 0, sd = 0;
+	boolean depth = (g->polled & METRICBIT(METRIC_DEPTH)) && g->snowdepth >= 0; // battery or charger only polls don't count as calm
+
+	if(g->polled & METRICBIT(METRIC_DEPTH))
+		c->polls++;
+	if(config->poll_min_seconds == 0)
+		return;
+
+	sd = rollstat_stdev(&g->readings);
+	c->low_battery = g->batteryVolts >= 0 && g->batteryVolts < config->poll_low_battery && g->chargerStatus == 0; // 0 = not charging
+
+	if(c->low_battery)
+	{
+		interval = cadence_ceiling(config);
+		reason = "battery low and not charging";
+	}
+	else if(depth && ((cadence_slope(g, &slope) && fabs(slope) > config->poll_slope_threshold) || sd > config->poll_stdev_threshold))
+	{
+		c->calm = 0;
+		interval = config->poll_min_seconds;
+		reason = "snow depth changing";
+	}
+	else if(depth && ++c->calm >= CADENCECALMPOLLS && interval < cadence_ceiling(config))
+	{
+		c->calm = 0;
+		interval *= 2;
+		reason = "snow depth stable";
+	}
+
+	if(interval != c->interval)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Poll interval %u -> %u seconds, %s (%.1f mm/h, sd %.1f mm), %ld wake-ups saved",
+			c->interval, interval, reason, slope, sd, c->saved);
+		gauge_log_level(g, LOGGER_DEBUG, message_buffer);
+		c->interval = interval;
+		sched_reschedule(g);
+	}
+
+	if(get_monotonic_ms() - c->reported_ms >= CADENCEREPORTSECONDS * 1000UL)
+		cadence_report(g);
+}
+
+// log the poll count and wake-ups saved against polling every sleep_seconds
+void cadence_report(struct gauge_t *g)
+{
+	char message_buffer[256];
+
+	if(g->config->poll_min_seconds == 0)
+		return;
+
+	g->cadence.reported_ms = get_monotonic_ms();
+	snprintf(message_buffer, sizeof(message_buffer), "Poll interval %u seconds, %lu polls, %ld wake-ups saved against polling every %u seconds",
+		g->cadence.interval, g->cadence.polls, g->cadence.saved, g->config->sleep_seconds);
+	gauge_log(g, message_buffer);
+}
@@ -65,9 +65,10 @@ int get_configuration(struct config_t *config, char *path)
 			continue;
 		}
 		
-		if ((strcmp(token,"DEVICE")==0) && (strlen(val) != 0))
+		if ((strcmp(token,"DEVICE")==0) && (strlen(val) != 0)) // one DEVICE line per gauge
 		{
-			strcpy(config->device,val);
+			if (config->num_devices < MAXGAUGES)
+				strcpy(config->device[config->num_devices++],val);
 			continue;
 		}
 
@@ -89,6 +90,131 @@ int get_configuration(struct config_t *config, char *path)
 			continue;
 		}
 		
+		if ((strcmp(token,"STORE_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->store_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"STORE_SEGMENT_RECORDS")==0) && (strlen(val) != 0))
+		{
+			config->store_segment_records = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"STORE_SEGMENTS")==0) && (strlen(val) != 0))
+		{
+			config->store_segments = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"STORE_SYNC_RECORDS")==0) && (strlen(val) != 0))
+		{
+			config->store_sync_records = (uint32_t)atol(val);
+			continue;
+		}
+
+		if ((strcmp(token,"CSV_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->csv_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"INFLUX_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->influx_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"JSONL_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->jsonl_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"SINK_BATCH")==0) && (strlen(val) != 0))
+		{
+			config->sink_batch = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"SINK_FLUSH_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->sink_flush_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"SINK_FSYNC")==0) && (strlen(val) != 0))
+		{
+			if ((config->sink_fsync = sink_fsync_policy(val)) < 0)
+			{
+				fprintf(stderr, "\nUnknown SINK_FSYNC %s, using none", val);
+				config->sink_fsync = SINK_FSYNC_NONE;
+			}
+			continue;
+		}
+		if ((strcmp(token,"LATEST_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->latest_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"LATEST_SOCKET")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->latest_socket,val);
+			continue;
+		}
+		if ((strcmp(token,"LOG_LEVEL")==0) && (strlen(val) != 0))
+		{
+			if ((config->log_level = logger_level(val)) < 0)
+			{
+				fprintf(stderr, "\nUnknown LOG_LEVEL %s, using info", val);
+				config->log_level = LOGGER_INFO;
+			}
+			continue;
+		}
+		if ((strcmp(token,"LOG_MAX_KB")==0) && (strlen(val) != 0))
+		{
+			config->log_max_kb = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"LOG_FILES")==0) && (strlen(val) != 0))
+		{
+			config->log_files = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"LOG_FLUSH_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->log_flush_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"LOG_DEDUP_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->log_dedup_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"LOG_RATE")==0) && (strlen(val) != 0))
+		{
+			config->log_rate = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"STATS_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->stats_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"STATS_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->stats_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"STATS_RECENT_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->stats_recent_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"TRACE_FILE_NAME")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->trace_file_name,val);
+			continue;
+		}
+		if ((strcmp(token,"TRACE_KB")==0) && (strlen(val) != 0))
+		{
+			config->trace_kb = (uint32_t)atol(val);
+			continue;
+		}
+
 		if ((strcmp(token,"SLEEP_SECONDS")==0) && (strlen(val) != 0))
 		{
 			config->sleep_seconds = (uint16_t)atoi(val);
@@ -104,6 +230,102 @@ int get_configuration(struct config_t *config, char *path)
 			config->retry_count = (uint16_t)atoi(val);
 			continue;
 		}
+		if ((strcmp(token,"REPLY_TIMEOUT")==0) && (strlen(val) != 0))
+		{
+			config->reply_timeout = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"PIPELINE_COMMANDS")==0) && (strlen(val) != 0))
+		{
+			config->pipeline_commands = (boolean)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"RESTART_TIMEOUT")==0) && (strlen(val) != 0))
+		{
+			config->restart_timeout = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"READINGS_WINDOW")==0) && (strlen(val) != 0))
+		{
+			config->readings_window = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"FILTERS")==0) && (strlen(val) != 0))
+		{
+			strncpy(config->filters, val, sizeof(config->filters) - 1);
+			config->filters[sizeof(config->filters) - 1] = '\0';
+			continue;
+		}
+		if ((strcmp(token,"FILTER_WINDOW")==0) && (strlen(val) != 0))
+		{
+			config->filter_window = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"HAMPEL_THRESHOLD")==0) && (strlen(val) != 0))
+		{
+			config->hampel_threshold = atof(val);
+			continue;
+		}
+		if ((strcmp(token,"KALMAN_Q")==0) && (strlen(val) != 0))
+		{
+			config->kalman_q = atof(val);
+			continue;
+		}
+		if ((strcmp(token,"KALMAN_R")==0) && (strlen(val) != 0))
+		{
+			config->kalman_r = atof(val);
+			continue;
+		}
+		if ((strcmp(token,"SNAPSHOT_MAX_AGE")==0) && (strlen(val) != 0))
+		{
+			config->snapshot_max_age = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"POLL_MIN_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->poll_min_seconds = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"POLL_MAX_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->poll_max_seconds = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"POLL_SLOPE_THRESHOLD")==0) && (strlen(val) != 0))
+		{
+			config->poll_slope_threshold = atof(val);
+			continue;
+		}
+		if ((strcmp(token,"POLL_STDEV_THRESHOLD")==0) && (strlen(val) != 0))
+		{
+			config->poll_stdev_threshold = atof(val);
+			continue;
+		}
+		if ((strcmp(token,"POLL_LOW_BATTERY")==0) && (strlen(val) != 0))
+		{
+			config->poll_low_battery = (uint16_t)atoi(val);
+			continue;
+		}
+		if ((strcmp(token,"BATTERY_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->battery_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"CHARGER_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->charger_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"RANGE_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->range_seconds = (uint32_t)atol(val);
+			continue;
+		}
+		if ((strcmp(token,"RSSI_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->rssi_seconds = (uint32_t)atol(val);
+			continue;
+		}
 	}
 
 	return (true);
@@ -0,0 +1,186 @@
+/*
+
+	evloop.c
+
+	minimal epoll() based event loop with timerfd helpers used to drive
+	many snow depth gauges from one plug-in process
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+// returns 0 on success, -1 on error
+int evloop_init(struct evloop_t *loop)
+{
+	int i = 0;
+
+	for(i = 0; i < EVLOOP_MAXSOURCES; i++)
+	{
+		loop->sources[i].fd = -1;
+		loop->sources[i].cb = NULL;
+		loop->sources[i].ctx = NULL;
+	}
+
+	loop->wakeups = 0;
+	loop->epfd = epoll_create(EVLOOP_MAXSOURCES);
+
+	return loop->epfd < 0 ? -1 : 0;
+}
+
+void evloop_close(struct evloop_t *loop)
+{
+	if(loop->epfd >= 0)
+		close(loop->epfd);
+	loop->epfd = -1;
+}
+
+// watch fd for events, cb is called with ctx when any of them are signaled. returns 0 on success, -1 on error
+int evloop_add(struct evloop_t *loop, int fd, uint32_t events, evloop_cb cb, void *ctx)
+{
+	struct epoll_event ev;
+	int i = 0;
+
+	for(i = 0; i < EVLOOP_MAXSOURCES; i++) // find a free slot
+		if(loop->sources[i].fd < 0 && loop->sources[i].cb == NULL)
+			break;
+
+	if(i == EVLOOP_MAXSOURCES)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &loop->sources[i];
+
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	loop->sources[i].fd = fd;
+	loop->sources[i].cb = cb;
+	loop->sources[i].ctx = ctx;
+
+	return 0;
+}
+
+// change the events watched for fd. returns 0 on success, -1 on error
+int evloop_mod(struct evloop_t *loop, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	int i = 0;
+
+	for(i = 0; i < EVLOOP_MAXSOURCES; i++)
+		if(loop->sources[i].fd == fd)
+			break;
+
+	if(i == EVLOOP_MAXSOURCES)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &loop->sources[i];
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// stop watching fd. returns 0 on success, -1 on error
+int evloop_del(struct evloop_t *loop, int fd)
+{
+	struct epoll_event ev; // pre 2.6.9 kernels require a non NULL event
+	int i = 0;
+
+	for(i = 0; i < EVLOOP_MAXSOURCES; i++)
+		if(loop->sources[i].fd == fd)
+			break;
+
+	if(i == EVLOOP_MAXSOURCES)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev); // fails harmlessly if fd was already closed
+
+	loop->sources[i].fd = -1; // slot is released after pending events have been dispatched
+	loop->sources[i].ctx = NULL;
+
+	return 0;
+}
+
+// wait up to timeout milliseconds for events and dispatch them. returns number of events dispatched, -1 on error
+int evloop_run_once(struct evloop_t *loop, int timeout)
+{
+	struct epoll_event events[EVLOOP_MAXEVENTS];
+	struct evsource_t *src;
+	int n = 0, i = 0;
+
+	n = epoll_wait(loop->epfd, events, EVLOOP_MAXEVENTS, timeout);
+	loop->wakeups++;
+	if(n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for(i = 0; i < n; i++)
+	{
+		src = (struct evsource_t *)events[i].data.ptr;
+		if(src->fd >= 0 && src->cb != NULL) // skip sources removed by an earlier callback
+			src->cb(src->fd, events[i].events, src->ctx);
+	}
+
+	for(i = 0; i < EVLOOP_MAXSOURCES; i++) // release slots of removed sources
+		if(loop->sources[i].fd < 0)
+			loop->sources[i].cb = NULL;
+
+	return n;
+}
+
+// returns a non-blocking CLOCK_MONOTONIC timerfd, -1 on error
+int evtimer_create(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// arm timer to expire once after ms milliseconds, 0 ms disarms the timer
+int evtimer_arm_ms(int fd, uint32_t ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+	return timerfd_settime(fd, 0, &its, NULL);
+}
+
+// arm timer to expire once at the absolute CLOCK_MONOTONIC time ms, so late re-arming does not add up to drift
+int evtimer_arm_at_ms(int fd, uint64_t ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if(ms == 0) // a zero time would disarm the timer
+		its.it_value.tv_nsec = 1;
+
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// acknowledge timer expiration, returns number of expirations
+uint64_t evtimer_ack(int fd)
+{
+	uint64_t expirations = 0;
+
+	if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		expirations = 0;
+
+	return expirations;
+}
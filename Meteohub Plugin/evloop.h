@@ -0,0 +1,55 @@
+/*
+
+	evloop.h
+
+*/
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// defines
+#define EVLOOP_MAXSOURCES 64 // max number of fds watched by one event loop
+#define EVLOOP_MAXEVENTS 16 // max number of events handled per call to epoll_wait()
+
+// typedefs
+typedef void (*evloop_cb)(int fd, uint32_t events, void *ctx);
+
+// structs
+struct evsource_t
+{
+	int fd;
+	evloop_cb cb;
+	void *ctx;
+};
+
+struct evloop_t
+{
+	int epfd;
+	struct evsource_t sources[EVLOOP_MAXSOURCES];
+	unsigned long wakeups;			// epoll_wait() calls
+};
+
+// returns 0 on success, -1 on error
+int evloop_init(struct evloop_t *loop);
+void evloop_close(struct evloop_t *loop);
+// watch fd for events, cb is called with ctx when any of them are signaled. returns 0 on success, -1 on error
+int evloop_add(struct evloop_t *loop, int fd, uint32_t events, evloop_cb cb, void *ctx);
+// change the events watched for fd. returns 0 on success, -1 on error
+int evloop_mod(struct evloop_t *loop, int fd, uint32_t events);
+// stop watching fd. returns 0 on success, -1 on error
+int evloop_del(struct evloop_t *loop, int fd);
+// wait up to timeout milliseconds for events and dispatch them. returns number of events dispatched, -1 on error
+int evloop_run_once(struct evloop_t *loop, int timeout);
+
+// returns a non-blocking CLOCK_MONOTONIC timerfd, -1 on error
+int evtimer_create(void);
+// arm timer to expire once after ms milliseconds, 0 ms disarms the timer
+int evtimer_arm_ms(int fd, uint32_t ms);
+// arm timer to expire once at the absolute CLOCK_MONOTONIC time ms, so late re-arming does not add up to drift
+int evtimer_arm_at_ms(int fd, uint64_t ms);
+// acknowledge timer expiration, returns number of expirations
+uint64_t evtimer_ack(int fd);
+
+#endif
@@ -1,6 +1,6 @@
 /*
 
-	fdget.h
+	fdget.c
 
 */
 
@@ -10,199 +10,187 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stropts.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "fdget.h"
 
-// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds
-int fdputc_poll(byte c, int fd, int timeout)
+// write all len bytes of buf to fd with as few write() calls as possible. when fd would block, waits up to timeout
+// milliseconds for it to become writable again. drain waits until a tty has transmitted everything.
+// returns bytes written, -1 on error or timeout with errno set
+ssize_t fdwrite_all(int fd, const void *buf, size_t len, int timeout, int drain, struct fdstats_t *stats)
 {
-#define NUMRETRYFDPUTC 6 // number of times to retry write
+#define NUMRETRYFDWRITE 5 // number of times to wait for a blocked fd before giving up
 
 	struct pollfd fds[1];
-	size_t i = 0;
-	int rc = 0, pr, total = 0, ec = 0, ic = 0;
-	size_t count = 1;
+	const char *p = (const char *)buf;
+	size_t total = 0;
+	ssize_t i = 0;
+	int pr = 0, ic = 0;
 
 	fds[0].events = POLLWRNORM;
 	fds[0].fd = fd;
 
-	while(total < count && ic < NUMRETRYFDPUTC) // iterative read with poll on each
+	while(total < len)
 	{
-		pr = poll(fds, 1, timeout);
+		i = write(fd, p + total, len - total); // whole remainder at once, the tty driver takes what it can
+		if(stats != NULL)
+			stats->tx_syscalls++;
 
-		if(pr > 0) // sucess
-		{
-			if(fds[0].revents & POLLWRNORM)
-			{
-				i = write(fd, &c, 1); // write only one char
-				total += i;
-				if(i == 1) // char was written
-					rc = total;
-				else
-				{
-					rc = EOF; // error
-					ic++; // inc iterations for retry logic
-					continue;
-				}
-			}
-			else
-				rc = fds[0].revents;
-		}
-		else if(pr == 0) // timeout
+		if(i > 0)
 		{
-			rc = pr;
-			ic++; // inc iterations for retry logic
+			total += i;
+			if(stats != NULL)
+				stats->tx_bytes += i;
 			continue;
 		}
-		else if(pr < 0) // error
-		{
-			rc = -1;
-			ic++; // inc iterations for retry logic
-			ec = errno;
+
+		if(i < 0 && errno == EINTR)
 			continue;
+
+		if(i < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		if(ic++ == NUMRETRYFDWRITE) // output buffer stays full
+		{
+			errno = ETIMEDOUT;
+			return -1;
 		}
+
+		pr = poll(fds, 1, timeout); // wait for room in the output buffer
+		if(stats != NULL)
+			stats->tx_syscalls++;
+		if(pr < 0 && errno != EINTR)
+			return -1;
 	}
 
-	if(ec != 0)
-		rc = ec; // return errno on error
-	else
-		fsync(fd);
+	if(drain)
+	{
+		tcdrain(fd);
+		if(stats != NULL)
+			stats->tx_syscalls++;
+	}
 
-	return rc;
+	return total;
+}
+
+// returns total number of bytes sucessfully written from c to fd using timeout milliseconds, errno on error
+int fdputc_poll(byte c, int fd, int timeout)
+{
+	return fdwrite_all(fd, &c, 1, timeout, 0, NULL) < 0 ? errno : 1;
 }
 
-// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds
+// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds, errno on error
 int fdputs_poll(const char *s, int fd, int timeout)
 {
-#define NUMTOWRITEFDPUTS 1 // number of bytes to output per call to write()
-#define NUMRETRYFDPUTS 5 // number of times to retry output
+	ssize_t rc = fdwrite_all(fd, s, strlen(s), timeout, 0, NULL);
 
-	struct pollfd fds[1];
-	size_t i = 0;
-	int rc = 0, pr, total = 0, ec = 0, ic = 0;
-	char buf[NUMTOWRITEFDPUTS + 1]; // add one for trailing NUL char
-	size_t count = 0;
+	return rc < 0 ? errno : (int)rc;
+}
 
-	fds[0].events = POLLWRNORM;
-	fds[0].fd = fd;
-	count = strlen(s);
+void fdring_init(struct fdring_t *r)
+{
+	r->head = 0;
+	r->tail = 0;
+	r->scanned = 0;
+}
 
-	while(total < count && ic < NUMRETRYFDPUTS) // iterative read with poll on each
-	{
+// discard all buffered data
+void fdring_clear(struct fdring_t *r)
+{
+	r->head = r->tail;
+	r->scanned = r->tail;
+}
 
-		pr = poll(fds, sizeof(fds) / sizeof(fds[0]), timeout);
+// read as much as fd has available into the ring with one read. returns bytes read, 0 on EOF, -1 on error (errno EAGAIN when no data)
+ssize_t fdring_fill(struct fdring_t *r, int fd, struct fdstats_t *stats)
+{
+	struct iovec iov[2];
+	size_t space = FDRING_SIZE - (r->tail - r->head);
+	size_t t = r->tail & FDRING_MASK;
+	int n = 1;
+	ssize_t rc = 0;
 
-		if(pr > 0) // sucess
-		{
-			if(fds[0].revents & POLLWRNORM)
-			{
-				strncpy(buf, &s[total], NUMTOWRITEFDPUTS); // extract one chunk
-				i = write(fd, buf, NUMTOWRITEFDPUTS); // write one chunk
-				total += i;
-				if(i == NUMTOWRITEFDPUTS) // string was written
-					rc = total;
-				else
-				{
-					rc = EOF; // error
-					ic++; // inc iterations for retry logic
-					continue;
-				}
-			}
-			else
-				rc = fds[0].revents;
-		}
-		else if(pr == 0) // timeout
-		{
-			rc = pr;
-			ic++; // inc iterations for retry logic
-			continue;
-		}
-		else if(pr < 0) // error
-		{
-			rc = -1;
-			ic++; // inc iterations for retry logic
-			ec = errno;
-			continue;
-		}
+	if(space == 0) // caller has to take the (garbage) line out first
+	{
+		errno = ENOBUFS;
+		return -1;
 	}
 
-	if(ec != 0)
-		rc = ec; // return errno on error
-	else
-		fsync(fd);
+	iov[0].iov_base = &r->buf[t];
+	iov[0].iov_len = (t + space > FDRING_SIZE) ? FDRING_SIZE - t : space;
+	if(iov[0].iov_len < space) // free space wraps around the end of buf
+	{
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = space - iov[0].iov_len;
+		n = 2;
+	}
+
+	rc = readv(fd, iov, n);
+	if(rc > 0)
+		r->tail += rc;
+
+	if(stats != NULL)
+	{
+		stats->rx_syscalls++;
+		if(rc > 0)
+			stats->rx_bytes += rc;
+	}
 
 	return rc;
 }
 
-// returns total number of bytes sucessfully read into *s from fd using timeout milliseconds
-int fdgets_poll(char *s, size_t count, int fd, int timeout)
+// copy len bytes of data that did not come straight from an fd into the ring. returns bytes copied, less than len when full
+size_t fdring_put(struct fdring_t *r, const char *data, size_t len)
 {
+	size_t space = FDRING_SIZE - (r->tail - r->head);
+	size_t t = r->tail & FDRING_MASK;
+	size_t first = 0;
 
-#define NUMTOREADFDGETS 1 // should always be kept at 1! number of bytes to input per call to read()
-#define NUMRETRYFDGETS 5 // number of times to retry input to get count bytes
+	if(len > space)
+		len = space;
 
-	struct pollfd fds[1];
-	size_t i = 0;
-	int rc = 0, pr, total = 0, ec = 0, ic = 0;
-	byte buf[NUMTOREADFDGETS];
+	first = (t + len > FDRING_SIZE) ? FDRING_SIZE - t : len;
+	memcpy(&r->buf[t], data, first);
+	memcpy(r->buf, data + first, len - first);
+	r->tail += len;
 
-	fds[0].events = POLLRDNORM;
-	fds[0].fd = fd;
+	return len;
+}
 
-	while(total < count && ic < NUMRETRYFDGETS) // iterative read with poll on each
-	{
-		pr = poll(fds, sizeof(fds) / sizeof(fds[0]), timeout);
+// returns a view of the next complete line including its newline and sets *len, NULL when no complete line is buffered.
+// a full ring without a newline is returned as one line without a newline. the view is valid until the next fdring call
+const char *fdring_getline(struct fdring_t *r, size_t *len)
+{
+	size_t pos = 0, chunk = 0, start = r->head & FDRING_MASK;
+	const char *nl = NULL;
+	const char *line = NULL;
 
-		if(pr > 0) // sucess
-		{
-			if(fds[0].revents & POLLRDNORM)
-			{
-				i = read(fd, buf, NUMTOREADFDGETS); // read one chunk
-				total += i;
-				if(i == NUMTOREADFDGETS)
-				{
-					strncat(s, buf, NUMTOREADFDGETS);
-					if(s[strlen(s) - 1] == '\n') // found newline [only can work properly if reading 1 char at a  time]
-						break; // done reading, exit
-				}
-				else
-				{
-					rc = EOF;
-					ic++; // inc iterations for retry logic
-					continue;
-				}
-
-			}
-			else
-				rc = fds[0].revents;
-		}
-		else if(pr == 0) // timeout
-		{
-			rc = pr;
-			ic++; // inc iterations for retry logic
-			continue;
-		}
-		else if(pr < 0) // error
-		{
-			rc = -1;
-			ic++; // inc iterations for retry logic
-			ec = errno;
-			continue;
-		}
+	while(nl == NULL && r->scanned < r->tail) // each byte is searched once no matter how many calls it takes to complete a line
+	{
+		pos = r->scanned & FDRING_MASK;
+		chunk = r->tail - r->scanned;
+		if(pos + chunk > FDRING_SIZE)
+			chunk = FDRING_SIZE - pos;
 
+		nl = memchr(&r->buf[pos], '\n', chunk);
+		r->scanned += nl != NULL ? (size_t)(nl - &r->buf[pos]) + 1 : chunk;
 	}
 
-	rc = strlen(s);
+	if(nl == NULL && r->tail - r->head < FDRING_SIZE) // partial line, wait for more data
+		return NULL;
 
-	if(rc <= 0)
+	*len = r->scanned - r->head;
+	if(start + *len <= FDRING_SIZE)
+		line = &r->buf[start]; // common case, no copy
+	else
 	{
-		s = NULL;
-		if(ec != 0)
-			rc = ec; // return errno on error
+		memcpy(r->scratch, &r->buf[start], FDRING_SIZE - start);
+		memcpy(&r->scratch[FDRING_SIZE - start], r->buf, *len - (FDRING_SIZE - start));
+		line = r->scratch;
 	}
+	r->head = r->scanned;
 
-	return rc;
+	return line;
 }
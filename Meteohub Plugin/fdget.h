@@ -4,8 +4,13 @@
 
 */
 
+#include <stddef.h>
+#include <sys/types.h>
+
 // defines
 #define NUL '\0'
+#define FDRING_SIZE 512 // receive ring buffer size, must be a power of 2 and longer than the longest line
+#define FDRING_MASK (FDRING_SIZE - 1)
 #ifndef POLLRDNORM 
 #define	POLLRDNORM	0x0040		/* non-OOB/URG data available */
 #endif
@@ -16,9 +21,41 @@
 // typedefs
 typedef char byte;
 
-// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds
+// I/O counters, syscalls are what costs on the MIPS routers
+struct fdstats_t
+{
+	unsigned long tx_bytes;
+	unsigned long tx_syscalls;	// write(), poll() and tcdrain() calls
+	unsigned long rx_bytes;
+	unsigned long rx_syscalls;	// read() calls
+};
+
+// receive ring buffer that frames lines, bytes after a newline are kept for the next line
+struct fdring_t
+{
+	char buf[FDRING_SIZE];
+	size_t head;				// start of the next line, free running counters masked on use
+	size_t tail;				// end of received data
+	size_t scanned;				// data up to here has been searched for a newline
+	char scratch[FDRING_SIZE];	// lines that wrap around the end of buf are copied here
+};
+
+// write all len bytes of buf to fd with as few write() calls as possible. when fd would block, waits up to timeout
+// milliseconds for it to become writable again. drain waits until a tty has transmitted everything.
+// returns bytes written, -1 on error or timeout with errno set. stats may be NULL
+ssize_t fdwrite_all(int fd, const void *buf, size_t len, int timeout, int drain, struct fdstats_t *stats);
+// returns total number of bytes sucessfully written from c to fd using timeout milliseconds, errno on error
 int fdputc_poll(byte c, int fd, int timeout);
-// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds
+// returns total number of bytes sucessfully written from *s to fd using timeout milliseconds, errno on error
 int fdputs_poll(const char *s, int fd, int timeout);
-// returns total number of bytes sucessfully read into *s from fd using timeout milliseconds
-int fdgets_poll(char *s, size_t count, int fd, int timeout);
+
+void fdring_init(struct fdring_t *r);
+// discard all buffered data
+void fdring_clear(struct fdring_t *r);
+// read as much as fd has available into the ring with one read. returns bytes read, 0 on EOF, -1 on error (errno EAGAIN when no data)
+ssize_t fdring_fill(struct fdring_t *r, int fd, struct fdstats_t *stats);
+// copy len bytes of data that did not come straight from an fd into the ring. returns bytes copied, less than len when full
+size_t fdring_put(struct fdring_t *r, const char *data, size_t len);
+// returns a view of the next complete line including its newline and sets *len, NULL when no complete line is buffered.
+// a full ring without a newline is returned as one line without a newline. the view is valid until the next fdring call
+const char *fdring_getline(struct fdring_t *r, size_t *len);
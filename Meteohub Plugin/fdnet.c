@@ -0,0 +1,310 @@
+/*
+
+	fdnet.c
+
+	serial-over-IP transports: raw TCP and RFC 2217 (telnet COM port control) so gauges behind
+	serial bridges on remote masts are polled like gauges on local tty devices
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "fdnet.h"
+
+// telnet receive states
+#define TELNET_DATA 0
+#define TELNET_GOT_IAC 1
+#define TELNET_GOT_VERB 2
+#define TELNET_IN_SB 3
+#define TELNET_IN_SB_IAC 4
+
+// returns FDNET_TCP or FDNET_RFC2217 and fills host and port for network urls, 0 for anything else (a local device path)
+int fdnet_scheme(const char *url, char *host, size_t hostlen, char *port, size_t portlen)
+{
+	const char *p = NULL, *colon = NULL;
+	int kind = 0;
+
+	if(strncmp(url, "tcp://", 6) == 0)
+	{
+		kind = FDNET_TCP;
+		p = url + 6;
+	}
+	else if(strncmp(url, "rfc2217://", 10) == 0)
+	{
+		kind = FDNET_RFC2217;
+		p = url + 10;
+	}
+	else
+		return 0;
+
+	if((colon = strrchr(p, ':')) == NULL || colon == p || colon[1] == '\0' || (size_t)(colon - p) >= hostlen || strlen(colon + 1) >= portlen)
+		return -1;
+
+	if(*p == '[' && colon[-1] == ']') // [v6 address]:port
+	{
+		memcpy(host, p + 1, colon - p - 2);
+		host[colon - p - 2] = '\0';
+	}
+	else
+	{
+		memcpy(host, p, colon - p);
+		host[colon - p] = '\0';
+	}
+	strcpy(port, colon + 1);
+
+	return kind;
+}
+
+// start a non-blocking connect to host:port. returns the socket, -1 on error. completion is signaled by the socket becoming writable
+int fdnet_connect(const char *host, const char *port)
+{
+	struct addrinfo hints, *res = NULL, *ai = NULL;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo(host, port, &hints, &res) != 0) // blocking lookup, gauges are usually configured by address
+	{
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	for(ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+// listen on the Unix stream socket path, a stale socket file left by a previous run is replaced. returns the non-blocking socket, -1 on error
+int fdnet_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = -1, err = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+// result of a non-blocking connect once the socket is writable, 0 when connected, the errno value otherwise
+int fdnet_connect_result(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		return errno;
+
+	return err;
+}
+
+// enable TCP keepalive so a dead bridge or mast link is noticed without traffic. returns 0 on success, -1 on error
+int fdnet_keepalive(int fd, int idle, int interval, int count)
+{
+	int on = 1;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0)
+		return -1;
+#ifdef TCP_KEEPIDLE
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // commands are tiny and latency matters more than packet count
+
+	return 0;
+}
+
+void telnet_init(struct telnet_t *t)
+{
+	t->state = TELNET_DATA;
+	t->verb = 0;
+	t->commands = 0;
+}
+
+// queue a 3 byte option reply if there is room
+static void telnet_reply(uint8_t *reply, size_t *replylen, uint8_t verb, uint8_t option)
+{
+	if(*replylen + 3 > TELNET_MAXREPLY)
+		return;
+
+	reply[(*replylen)++] = TELNET_IAC;
+	reply[(*replylen)++] = verb;
+	reply[(*replylen)++] = option;
+}
+
+// strip telnet commands from len bytes of buf in place, returns the number of data bytes left.
+// answers to option requests are appended to reply (TELNET_MAXREPLY bytes) and *replylen is set
+size_t telnet_filter(struct telnet_t *t, uint8_t *buf, size_t len, uint8_t *reply, size_t *replylen)
+{
+	size_t i = 0, n = 0;
+	uint8_t c = 0;
+
+	*replylen = 0;
+
+	for(i = 0; i < len; i++)
+	{
+		c = buf[i];
+		switch(t->state)
+		{
+			case TELNET_DATA:
+				if(c == TELNET_IAC)
+					t->state = TELNET_GOT_IAC;
+				else
+					buf[n++] = c;
+				break;
+
+			case TELNET_GOT_IAC:
+				if(c == TELNET_IAC) // escaped 0xff data byte
+				{
+					buf[n++] = c;
+					t->state = TELNET_DATA;
+				}
+				else if(c >= TELNET_WILL && c <= TELNET_DONT)
+				{
+					t->verb = c;
+					t->state = TELNET_GOT_VERB;
+				}
+				else if(c == TELNET_SB)
+					t->state = TELNET_IN_SB;
+				else // NOP, GA and other single byte commands
+				{
+					t->commands++;
+					t->state = TELNET_DATA;
+				}
+				break;
+
+			case TELNET_GOT_VERB: // options we asked for are acknowledged silently, others are refused
+				t->commands++;
+				if(t->verb == TELNET_DO && c != TELNET_BINARY && c != TELNET_COMPORT)
+					telnet_reply(reply, replylen, TELNET_WONT, c);
+				else if(t->verb == TELNET_WILL && c != TELNET_BINARY && c != TELNET_SGA && c != TELNET_COMPORT)
+					telnet_reply(reply, replylen, TELNET_DONT, c);
+				t->state = TELNET_DATA;
+				break;
+
+			case TELNET_IN_SB: // COM port option notifications and replies to our settings, not needed
+				if(c == TELNET_IAC)
+					t->state = TELNET_IN_SB_IAC;
+				break;
+
+			case TELNET_IN_SB_IAC:
+				if(c == TELNET_SE)
+				{
+					t->commands++;
+					t->state = TELNET_DATA;
+				}
+				else
+					t->state = TELNET_IN_SB;
+				break;
+		}
+	}
+
+	return n;
+}
+
+// copy len bytes of data into out doubling IAC bytes, out has to hold 2 * len bytes. returns bytes stored
+size_t telnet_escape(uint8_t *out, const uint8_t *data, size_t len)
+{
+	size_t i = 0, n = 0;
+
+	for(i = 0; i < len; i++)
+	{
+		out[n++] = data[i];
+		if(data[i] == TELNET_IAC)
+			out[n++] = TELNET_IAC;
+	}
+
+	return n;
+}
+
+// append one COM port option subnegotiation with a value of size bytes
+static size_t rfc2217_sb(uint8_t *out, uint8_t command, uint32_t value, int size)
+{
+	size_t n = 0;
+	int i = 0;
+
+	out[n++] = TELNET_IAC;
+	out[n++] = TELNET_SB;
+	out[n++] = TELNET_COMPORT;
+	out[n++] = command;
+	for(i = size - 1; i >= 0; i--) // network byte order
+	{
+		out[n] = (value >> (i * 8)) & 0xff;
+		if(out[n++] == TELNET_IAC)
+			out[n++] = TELNET_IAC;
+	}
+	out[n++] = TELNET_IAC;
+	out[n++] = TELNET_SE;
+
+	return n;
+}
+
+// build the RFC 2217 client option negotiation and serial port settings (baud, 8N1, no flow control). returns bytes stored
+size_t rfc2217_setup(uint8_t *out, uint32_t baud)
+{
+	const uint8_t negotiate[] =
+	{
+		TELNET_IAC, TELNET_WILL, TELNET_BINARY,
+		TELNET_IAC, TELNET_DO, TELNET_BINARY,
+		TELNET_IAC, TELNET_DO, TELNET_SGA,
+		TELNET_IAC, TELNET_WILL, TELNET_COMPORT
+	};
+	size_t n = sizeof(negotiate);
+
+	memcpy(out, negotiate, n);
+	n += rfc2217_sb(&out[n], RFC2217_SET_BAUDRATE, baud, 4);
+	n += rfc2217_sb(&out[n], RFC2217_SET_DATASIZE, 8, 1);
+	n += rfc2217_sb(&out[n], RFC2217_SET_PARITY, 1, 1); // none
+	n += rfc2217_sb(&out[n], RFC2217_SET_STOPSIZE, 1, 1); // 1 stop bit
+	n += rfc2217_sb(&out[n], RFC2217_SET_CONTROL, 1, 1); // no flow control
+
+	return n;
+}
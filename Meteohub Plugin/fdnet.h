@@ -0,0 +1,72 @@
+/*
+
+	fdnet.h
+
+	serial-over-IP transports: raw TCP and RFC 2217 (telnet COM port control)
+
+*/
+#ifndef FDNET_H
+#define FDNET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define FDNET_TCP 1			// tcp://host:port, bytes pass through unchanged
+#define FDNET_RFC2217 2		// rfc2217://host:port, telnet with COM port control
+
+#define FDNET_KEEPIDLE 60	// seconds idle before the first keepalive probe
+#define FDNET_KEEPINTVL 10	// seconds between keepalive probes
+#define FDNET_KEEPCNT 3		// unanswered probes before the connection is dropped
+
+// telnet commands and options
+#define TELNET_SE 240
+#define TELNET_SB 250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO 253
+#define TELNET_DONT 254
+#define TELNET_IAC 255
+#define TELNET_BINARY 0
+#define TELNET_SGA 3
+#define TELNET_COMPORT 44
+
+// RFC 2217 COM port option client commands
+#define RFC2217_SET_BAUDRATE 1
+#define RFC2217_SET_DATASIZE 2
+#define RFC2217_SET_PARITY 3
+#define RFC2217_SET_STOPSIZE 4
+#define RFC2217_SET_CONTROL 5
+
+#define TELNET_MAXREPLY 64 // worst case option replies produced by one telnet_filter() call are queued up to this size
+
+// structs
+// receive side telnet state, commands may be split across reads
+struct telnet_t
+{
+	int state;
+	uint8_t verb;				// WILL, WONT, DO or DONT being parsed
+	unsigned long commands;		// telnet commands stripped from the data
+};
+
+// returns FDNET_TCP or FDNET_RFC2217 and fills host and port for network urls, 0 for anything else (a local device path)
+int fdnet_scheme(const char *url, char *host, size_t hostlen, char *port, size_t portlen);
+// start a non-blocking connect to host:port. returns the socket, -1 on error. completion is signaled by the socket becoming writable
+int fdnet_connect(const char *host, const char *port);
+// listen on the Unix stream socket path, a stale socket file left by a previous run is replaced. returns the non-blocking socket, -1 on error
+int fdnet_listen_unix(const char *path);
+// result of a non-blocking connect once the socket is writable, 0 when connected, the errno value otherwise
+int fdnet_connect_result(int fd);
+// enable TCP keepalive so a dead bridge or mast link is noticed without traffic. returns 0 on success, -1 on error
+int fdnet_keepalive(int fd, int idle, int interval, int count);
+
+void telnet_init(struct telnet_t *t);
+// strip telnet commands from len bytes of buf in place, returns the number of data bytes left.
+// answers to option requests are appended to reply (TELNET_MAXREPLY bytes) and *replylen is set
+size_t telnet_filter(struct telnet_t *t, uint8_t *buf, size_t len, uint8_t *reply, size_t *replylen);
+// copy len bytes of data into out doubling IAC bytes, out has to hold 2 * len bytes. returns bytes stored
+size_t telnet_escape(uint8_t *out, const uint8_t *data, size_t len);
+// build the RFC 2217 client option negotiation and serial port settings (baud, 8N1, no flow control). returns bytes stored
+size_t rfc2217_setup(uint8_t *out, uint32_t baud);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+
+	filter.c
+
+	chain of snow depth outlier filter stages, each stage decides from its own state so an
+	outlier costs no extra sensor readings
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "filter.h"
+
+static const char *filter_names[] = {"stdev", "median", "hampel", "kalman"};
+
+const char *filter_name(enum filter_kind_t kind)
+{
+	return filter_names[kind];
+}
+
+// set up the chain from a comma separated list of stage names (stdev, median, hampel, kalman),
+// an empty list or "none" disables filtering. returns 0 on success, -1 on an unknown stage name
+int filter_init(struct filter_chain_t *c, const char *list, const struct filter_params_t *params, const struct rollstat_t *stats)
+{
+	char names[128];
+	char *name = NULL, *save = NULL;
+	int kind = 0;
+
+	memset(c, 0, sizeof(*c));
+	c->params = *params;
+	c->stats = stats;
+	if(c->params.window < 1)
+		c->params.window = 1;
+	if(c->params.window > FILTER_MAXWINDOW)
+		c->params.window = FILTER_MAXWINDOW;
+
+	strncpy(names, list, sizeof(names) - 1);
+	names[sizeof(names) - 1] = '\0';
+
+	for(name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+	{
+		if(strcmp(name, "none") == 0)
+			continue;
+
+		for(kind = 0; kind <= FILTER_KALMAN; kind++)
+			if(strcmp(name, filter_names[kind]) == 0)
+				break;
+
+		if(kind > FILTER_KALMAN || c->num_stages == FILTER_MAXSTAGES)
+			return -1;
+
+		c->stages[c->num_stages++].kind = (enum filter_kind_t)kind;
+	}
+
+	return 0;
+}
+
+// median of n values, sorts them in place
+static double median(int *v, int n)
+{
+	int i = 0, j = 0, t = 0;
+
+	for(i = 1; i < n; i++) // insertion sort, windows are small
+	{
+		t = v[i];
+		for(j = i; j > 0 && v[j - 1] > t; j--)
+			v[j] = v[j - 1];
+		v[j] = t;
+	}
+
+	return (n % 2) ? v[n / 2] : (v[(n / 2) - 1] + v[n / 2]) / 2.0;
+}
+
+// add value to the stages input ring
+static void stage_remember(struct filter_stage_t *s, int window, int value)
+{
+	if(s->count < window)
+		s->samples[(s->head + s->count++) % window] = value;
+	else
+	{
+		s->samples[s->head] = value;
+		s->head = (s->head + 1) % window;
+	}
+}
+
+// restart the stage from value, used when the depth has moved to a new level
+static void stage_reseed(struct filter_chain_t *c, struct filter_stage_t *s, int value, uint64_t now_ms)
+{
+	s->consecutive = 0;
+	s->count = 0;
+	s->head = 0;
+	stage_remember(s, c->params.window, value);
+	s->x = value;
+	s->p = c->params.kalman_r;
+	s->last_ms = now_ms;
+}
+
+// returns true when the stage rejects value and sets *out to its replacement
+static int stage_run(struct filter_chain_t *c, struct filter_stage_t *s, int value, uint64_t now_ms, int *out)
+{
+	const struct filter_params_t *pm = &c->params;
+	int sorted[FILTER_MAXWINDOW];
+	double m = 0, sd = 0, mad = 0, dt = 0, innovation = 0, gain = 0;
+	int i = 0;
+
+	*out = value;
+
+	switch(s->kind)
+	{
+		case FILTER_STDEV:
+			if(c->stats == NULL || c->stats->count < 2)
+				return 0;
+			m = rollstat_mean(c->stats);
+			sd = rollstat_stdev(c->stats);
+			if(sd < 1) // flat window, allow 1 mm so sensor resolution noise is not rejected
+				sd = 1;
+			if(fabs(value - m) <= pm->stdev_k * sd)
+				return 0;
+			*out = (int)(m + 0.5);
+			return 1;
+
+		case FILTER_MEDIAN: // a smoother, every reading is replaced by the window median and none is counted as a rejection
+			stage_remember(s, pm->window, value);
+			memcpy(sorted, s->samples, sizeof(int) * s->count);
+			*out = (int)(median(sorted, s->count) + 0.5);
+			return 0;
+
+		case FILTER_HAMPEL:
+			stage_remember(s, pm->window, value);
+			if(s->count < 3)
+				return 0;
+			memcpy(sorted, s->samples, sizeof(int) * s->count);
+			m = median(sorted, s->count);
+			for(i = 0; i < s->count; i++)
+				sorted[i] = (int)(fabs(s->samples[i] - m) + 0.5);
+			mad = FILTER_MAD_SCALE * median(sorted, s->count);
+			if(mad < 1) // flat window, allow 1 mm so sensor resolution noise is not rejected
+				mad = 1;
+			if(fabs(value - m) <= pm->hampel_t * mad)
+				return 0;
+			*out = (int)(m + 0.5);
+			return 1;
+
+		case FILTER_KALMAN:
+			if(s->last_ms == 0)
+			{
+				s->x = value;
+				s->p = pm->kalman_r;
+				s->last_ms = now_ms;
+				return 0;
+			}
+			dt = (now_ms - s->last_ms) / 3600000.0;
+			s->last_ms = now_ms;
+			s->p += pm->kalman_q * dt; // predict, depth can have changed more the longer since the last sample
+			innovation = value - s->x;
+			if(fabs(innovation) > FILTER_KALMAN_GATE * sqrt(s->p + pm->kalman_r))
+			{
+				*out = (int)(s->x + 0.5); // keep the prediction
+				return 1;
+			}
+			gain = s->p / (s->p + pm->kalman_r);
+			s->x += gain * innovation;
+			s->p *= 1 - gain;
+			*out = (int)(s->x + 0.5);
+			return 0;
+	}
+
+	return 0;
+}
+
+// run value through all stages at now_ms (CLOCK_MONOTONIC), returns the filtered value.
+// *rejected_by is set to the index of the last stage that replaced the value, -1 when none did
+int filter_run(struct filter_chain_t *c, int value, uint64_t now_ms, int *rejected_by)
+{
+	struct filter_stage_t *s = NULL;
+	int shifted = 0; // a stage took a new level, the stages after it start over from it
+	int out = 0;
+	int i = 0;
+
+	*rejected_by = -1;
+
+	for(i = 0; i < c->num_stages; i++)
+	{
+		s = &c->stages[i];
+		s->inputs++;
+
+		if(shifted)
+		{
+			stage_reseed(c, s, value, now_ms);
+			continue;
+		}
+
+		if(!stage_run(c, s, value, now_ms, &out))
+		{
+			s->consecutive = 0;
+			value = out;
+			continue;
+		}
+
+		if(++s->consecutive > FILTER_MAXREJECTS) // persistent new level (snowfall, gauge moved), take it
+		{
+			stage_reseed(c, s, value, now_ms);
+			shifted = 1;
+			continue;
+		}
+
+		s->rejects++;
+		*rejected_by = i;
+		value = out;
+	}
+
+	return value;
+}
+
+// writes "name rejects/inputs (rate%)" for every stage into buf
+void filter_report(const struct filter_chain_t *c, char *buf, size_t len)
+{
+	const struct filter_stage_t *s = NULL;
+	size_t n = 0;
+	int i = 0;
+
+	buf[0] = '\0';
+	for(i = 0; i < c->num_stages && n < len; i++)
+	{
+		s = &c->stages[i];
+		n += snprintf(&buf[n], len - n, "%s%s %lu/%lu (%.1f%%)", i > 0 ? ", " : "", filter_names[s->kind], s->rejects, s->inputs,
+			s->inputs > 0 ? (100.0 * s->rejects) / s->inputs : 0.0);
+	}
+}
@@ -0,0 +1,74 @@
+/*
+
+	filter.h
+
+	chain of snow depth outlier filter stages, each stage decides from its own state
+
+*/
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rollstat.h"
+
+// defines
+#define FILTER_MAXSTAGES 4
+#define FILTER_MAXWINDOW 31 // max samples in the median and Hampel windows
+#define FILTER_MAXREJECTS 3 // consecutive rejections after which a stage accepts the new level (e.g. a real snowfall or the gauge was moved)
+#define FILTER_KALMAN_GATE 3.0 // innovations beyond this many standard deviations are rejected
+#define FILTER_MAD_SCALE 1.4826 // scales the median absolute deviation to a standard deviation for normal data
+
+// typedefs
+enum filter_kind_t
+{
+	FILTER_STDEV,	// reject samples more than k standard deviations away from the readings window mean, use the mean
+	FILTER_MEDIAN,	// replace each sample with the median of the last window samples, smooths and never rejects
+	FILTER_HAMPEL,	// reject samples more than t scaled MADs away from the window median, use the median
+	FILTER_KALMAN	// scalar Kalman filter, snow depth is a random walk whose variance grows with time (snowfall, settling)
+};
+
+// structs
+struct filter_params_t
+{
+	int window;				// median and Hampel window
+	double stdev_k;			// stdev stage threshold in standard deviations
+	double hampel_t;		// Hampel threshold in scaled MADs
+	double kalman_q;		// process noise, mm^2 per hour
+	double kalman_r;		// measurement noise, mm^2
+};
+
+struct filter_stage_t
+{
+	enum filter_kind_t kind;
+	unsigned long inputs;
+	unsigned long rejects;		// samples the stage replaced
+	int consecutive;			// rejections in a row
+	int samples[FILTER_MAXWINDOW]; // median and Hampel input ring
+	int count;
+	int head;
+	double x;					// Kalman estimate
+	double p;					// Kalman estimate variance
+	uint64_t last_ms;			// Kalman time of the last sample
+};
+
+struct filter_chain_t
+{
+	struct filter_stage_t stages[FILTER_MAXSTAGES];
+	int num_stages;
+	struct filter_params_t params;
+	const struct rollstat_t *stats; // readings window used by the stdev stage
+};
+
+// set up the chain from a comma separated list of stage names (stdev, median, hampel, kalman),
+// an empty list or "none" disables filtering. returns 0 on success, -1 on an unknown stage name
+int filter_init(struct filter_chain_t *c, const char *list, const struct filter_params_t *params, const struct rollstat_t *stats);
+// run value through all stages at now_ms (CLOCK_MONOTONIC), returns the filtered value.
+// *rejected_by is set to the index of the last stage that replaced the value, -1 when none did
+int filter_run(struct filter_chain_t *c, int value, uint64_t now_ms, int *rejected_by);
+const char *filter_name(enum filter_kind_t kind);
+// writes "name rejects/inputs (rate%)" for every stage into buf
+void filter_report(const struct filter_chain_t *c, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,1206 @@
+/*
+
+	gauge.c
+
+	non-blocking state machine that polls one snow depth gauge. Each gauge owns a timerfd and is
+	reached through a link (link.c), all gauges are driven from the one event loop in main() so
+	a slow or dead gauge does not delay the others.
+
+*/
+
+#include "mhsdpi.h"
+
+static void gauge_next(struct gauge_t *g);
+static void gauge_complete(struct gauge_t *g);
+static void txn_begin(struct gauge_t *g, const char *cmds, int attempts, int arg);
+static void txn_send(struct gauge_t *g);
+static void gauge_emit(struct gauge_t *g);
+static void gauge_queue_initial(struct gauge_t *g);
+static void gauge_supervise(struct gauge_t *g, int good, int expected);
+static void gauge_on_timer(int fd, uint32_t events, void *ctx);
+static void gauge_probe_ready(struct gauge_t *g);
+static void gauge_open_store(struct gauge_t *g);
+static void gauge_close_store(struct gauge_t *g);
+static void gauge_save_snapshot(struct gauge_t *g);
+static void gauge_open_rollups(struct gauge_t *g, const char *base);
+
+// command letter sent to the sensor for each metric
+static const char metric_commands[NUMMETRICS] = {CMD_GET_DEPTH, CMD_GET_VOLTAGE, CMD_GET_CHARGER_STATUS, CMD_GET_RANGE, CMD_GET_RSSI};
+
+// bucket seconds of each rollup file, in the order of g->rollups
+static const uint32_t rollup_resolutions[NUMROLLUPS] = {ROLLUP_HOUR, ROLLUP_DAY};
+
+// command letter sent to the sensor for each kind of job
+static char job_command(enum gauge_job_kind_t kind)
+{
+	switch(kind)
+	{
+		case JOB_RESTART: return CMD_RESTART;
+		case JOB_ABOUT: return CMD_GET_ABOUT;
+		case JOB_GET_DATUM: return CMD_GET_CALIBRATION;
+		case JOB_SET_DATUM: return CMD_SET_CALIBRATE;
+		case JOB_SET_MANUAL_DATUM: return CMD_SET_MANUAL_CALIBRATE;
+		case JOB_INITIAL_DEPTH: return CMD_GET_DEPTH;
+		default: return NUL;
+	}
+}
+
+// returns 0 on success, -1 when the readings file name is too long, the readings window can't be allocated or the filter list is bad
+int gauge_init(struct gauge_t *g, int id, char *device, struct config_t *config, char *myname, struct evloop_t *loop)
+{
+	struct filter_params_t params;
+
+	memset(g, 0, sizeof(*g));
+	g->id = id;
+	g->device = device;
+	g->timerfd = -1;
+	g->config = config;
+	g->myname = myname;
+	g->loop = loop;
+	g->pipeline = config->pipeline_commands;
+	g->state = GAUGE_CLOSED;
+	g->snowdepth = -1;
+	g->batteryVolts = -1;
+	g->chargerStatus = -1;
+
+	if(id == 0) // first gauge keeps the configured file name, others get the gauge number appended
+		strcpy(g->readings_file_name, config->readings_file_name);
+	else if(snprintf(g->readings_file_name, sizeof(g->readings_file_name), "%s.%d", config->readings_file_name, id) >= (int)sizeof(g->readings_file_name))
+	{
+		gauge_log(g, "READINGS_FILE_NAME too long");
+		return -1;
+	}
+
+	if(rollstat_init(&g->readings, config->readings_window) < 0 || (g->reading_times = (int64_t *)calloc(config->readings_window, sizeof(int64_t))) == NULL)
+	{
+		gauge_log(g, "Can't allocate readings window");
+		return -1;
+	}
+
+	params.window = config->filter_window;
+	params.stdev_k = config->stdev_filter;
+	params.hampel_t = config->hampel_threshold;
+	params.kalman_q = config->kalman_q;
+	params.kalman_r = config->kalman_r;
+	if(filter_init(&g->filters, config->filters, &params, &g->readings) < 0)
+	{
+		gauge_log(g, "Bad FILTERS list, use up to 4 of stdev, median, hampel, kalman");
+		return -1;
+	}
+
+	cadence_init(g);
+
+	if(sched_lookahead_init(g) < 0)
+	{
+		gauge_log(g, "Can't allocate emit jitter window");
+		return -1;
+	}
+
+	gauge_open_store(g);
+
+	return 0;
+}
+
+// open the history store of the gauge, a gauge without history still polls
+static void gauge_open_store(struct gauge_t *g)
+{
+	struct config_t *config = g->config;
+	char message_buffer[FILENAME_MAX + 128];
+	char base[FILENAME_MAX];
+
+	if(strcmp(config->store_file_name, "none") == 0)
+		return;
+
+	if(g->id == 0) // named like the readings file
+		strcpy(base, config->store_file_name);
+	else if(snprintf(base, sizeof(base), "%s.%d", config->store_file_name, g->id) >= (int)sizeof(base))
+	{
+		gauge_log(g, "STORE_FILE_NAME too long, not keeping history");
+		return;
+	}
+
+	if(tsstore_open(&g->store, base, config->store_segment_records, config->store_segments, config->store_sync_records) < 0)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Can't open history store %s: %s, not keeping history", base, strerror(errno));
+		gauge_log(g, message_buffer);
+		return;
+	}
+	g->storing = true;
+
+	if(g->store.dropped > 0)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "History store %s: dropped %lu torn records after segment %u record %u",
+			base, g->store.dropped, g->store.segment, g->store.count);
+		gauge_log_level(g, LOGGER_WARNING, message_buffer);
+	}
+
+	gauge_open_rollups(g, base);
+}
+
+// history records passed to the rollups while catching up
+static int gauge_rollup_records(const struct tsstore_record_t *records, size_t n, void *ctx)
+{
+	struct gauge_t *g = (struct gauge_t *)ctx;
+	int i = 0;
+
+	for(i = 0; i < NUMROLLUPS; i++)
+		rollup_add_records(&g->rollups[i], records, n);
+
+	return 0;
+}
+
+// open the rollup files of the history store and catch up with the history written since their last bucket,
+// which rebuilds the open hour and day and any buckets missed while the plug-in was down
+static void gauge_open_rollups(struct gauge_t *g, const char *base)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	char name[FILENAME_MAX];
+	int64_t resume = INT64_MAX;
+	unsigned long written = 0;
+	long records = 0;
+	int i = 0;
+
+	for(i = 0; i < NUMROLLUPS; i++)
+	{
+		if(rollup_file_name(name, sizeof(name), base, rollup_resolutions[i]) < 0 || rollup_open(&g->rollups[i], name, rollup_resolutions[i]) < 0)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "Can't open rollup file %s: %s, rollups are rebuilt at every start", name, strerror(errno));
+			gauge_log(g, message_buffer);
+		}
+		if(g->rollups[i].resume < resume)
+			resume = g->rollups[i].resume;
+	}
+
+	if((records = tsstore_scan_blocks(base, resume, INT64_MAX, gauge_rollup_records, g)) < 0)
+		return;
+
+	for(i = 0; i < NUMROLLUPS; i++)
+		written += g->rollups[i].written;
+	if(written > 0)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Rollups caught up: %lu buckets from %ld history records", written, records);
+		gauge_log(g, message_buffer);
+	}
+}
+
+// append the poll cycle just emitted to the history store, r is set to its record
+static void gauge_store(struct gauge_t *g, struct tsstore_record_t *r, int raw, int filtered, int smoothed)
+{
+	char message_buffer[256];
+	int i = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->time = g->lookahead.emit_at > 0 ? g->lookahead.emit_at : get_wall_ms();
+	r->raw = raw;
+	r->filtered = filtered;
+	r->smoothed = smoothed;
+	r->volts = g->batteryVolts;
+	r->charger = g->chargerStatus;
+	r->retries = g->retries > 255 ? 255 : g->retries;
+	r->error = g->rc;
+	r->gauge = g->id;
+	r->metrics = g->polled;
+
+	if(!g->storing)
+		return;
+
+	if(r->time < g->store.last_time) // the clock was set back, keep the cycle at the last stored time until it catches up
+	{
+		if(!g->clock_behind)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "Wall clock set back %ld ms, storing poll cycles at the last stored time until it catches up",
+				(long)(g->store.last_time - r->time));
+			gauge_log_level(g, LOGGER_WARNING, message_buffer);
+		}
+		g->clock_behind = true;
+		r->time = g->store.last_time;
+	}
+	else
+		g->clock_behind = false;
+
+	if(tsstore_append(&g->store, r) < 0)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Can't append to history store: %s%s", strerror(errno),
+			g->store.map == NULL ? ", not keeping history" : "");
+		gauge_log(g, message_buffer);
+		if(g->store.map == NULL) // the next segment couldn't be created
+			gauge_close_store(g);
+		return;
+	}
+
+	for(i = 0; i < NUMROLLUPS; i++)
+		if(rollup_add(&g->rollups[i], r->time, r->filtered) < 0)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "Can't write rollup bucket: %s", strerror(errno));
+			gauge_log(g, message_buffer);
+		}
+}
+
+// save the readings so a restart resumes from them, write back and close the history store
+void gauge_close(struct gauge_t *g)
+{
+	if(g->initialized && g->readings.count > 0)
+		gauge_save_snapshot(g);
+
+	gauge_close_store(g);
+}
+
+// write back and close the history store
+static void gauge_close_store(struct gauge_t *g)
+{
+	int i = 0;
+
+	if(g->storing)
+	{
+		tsstore_close(&g->store);
+		for(i = 0; i < NUMROLLUPS; i++) // the open buckets are rebuilt from the history at the next start
+			rollup_close(&g->rollups[i]);
+	}
+	g->storing = false;
+}
+
+// log the rejection rate of each filter stage
+void gauge_filter_report(struct gauge_t *g)
+{
+	char message_buffer[256];
+	char report[200];
+
+	if(g->filters.num_stages == 0)
+		return;
+
+	filter_report(&g->filters, report, sizeof(report));
+	snprintf(message_buffer, sizeof(message_buffer), "Filter rejections: %s", report);
+	gauge_log(g, message_buffer);
+}
+
+// add a snow depth reading to the readings window, stamped with the wall clock time
+static void gauge_push_reading(struct gauge_t *g, int value)
+{
+	rollstat_push(&g->readings, value);
+	g->reading_times[(g->readings.head + g->readings.count - 1) % g->readings.window] = time(NULL);
+}
+
+// save the readings window oldest first, the filter state and the datum to the gauges readings file
+static void gauge_save_snapshot(struct gauge_t *g)
+{
+	static uint8_t buf[sizeof(struct gauge_snapshot_t) + (MAXREADINGSWINDOW * sizeof(struct gauge_snapshot_sample_t))];
+	struct gauge_snapshot_t *snap = (struct gauge_snapshot_t *)buf;
+	struct gauge_snapshot_sample_t *samples = (struct gauge_snapshot_sample_t *)&buf[sizeof(*snap)];
+	struct rollstat_t *r = &g->readings;
+	char message_buffer[256 + FILENAME_MAX];
+	int i = 0, pos = 0;
+
+	memset(snap, 0, sizeof(*snap));
+	strncpy(snap->device, g->device, sizeof(snap->device) - 1);
+	snap->datum = g->datum;
+	snap->count = r->count;
+	snap->filter_window = g->filters.params.window;
+	snap->num_stages = g->filters.num_stages;
+	memcpy(snap->stages, g->filters.stages, sizeof(snap->stages));
+	snap->saved_ms = get_monotonic_ms();
+
+	for(i = 0; i < r->count; i++)
+	{
+		pos = (r->head + i) % r->window;
+		samples[i].time = g->reading_times[pos];
+		samples[i].value = r->values[pos];
+	}
+
+	if(snapshot_write(g->readings_file_name, SNAPSHOTVERSION, buf, sizeof(*snap) + (r->count * sizeof(*samples))) < 0)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Can't save readings to %s: %s", g->readings_file_name, strerror(errno));
+		gauge_log(g, message_buffer);
+	}
+}
+
+// SNAPSHOT_MAX_AGE, by default twice the longest interval the gauge can be polled at, so a restart
+// after a calm spell at POLL_MAX_SECONDS still resumes
+static uint32_t gauge_snapshot_max_age(const struct gauge_t *g)
+{
+	const struct config_t *config = g->config;
+	uint32_t longest = config->sleep_seconds;
+
+	if(config->snapshot_max_age > 0)
+		return config->snapshot_max_age;
+
+	if(config->poll_min_seconds > 0 && config->poll_max_seconds > longest)
+		longest = config->poll_max_seconds;
+
+	return 2 * longest;
+}
+
+// restore the readings window, filter state and datum from the gauges readings file when it was
+// saved for this gauge less than SNAPSHOT_MAX_AGE ago. returns true when the gauge resumed from it
+static boolean gauge_load_snapshot(struct gauge_t *g)
+{
+	static uint8_t buf[sizeof(struct gauge_snapshot_t) + (MAXREADINGSWINDOW * sizeof(struct gauge_snapshot_sample_t))];
+	struct gauge_snapshot_t *snap = (struct gauge_snapshot_t *)buf;
+	struct gauge_snapshot_sample_t *samples = (struct gauge_snapshot_sample_t *)&buf[sizeof(*snap)];
+	struct filter_stage_t *s = NULL;
+	char message_buffer[256];
+	uint32_t max_age = gauge_snapshot_max_age(g);
+	uint64_t now_ms = get_monotonic_ms(), age_ms = 0, since = 0;
+	int64_t saved = 0, age = 0;
+	size_t len = 0;
+	int rc = 0, i = 0;
+
+	switch(rc = snapshot_read(g->readings_file_name, SNAPSHOTVERSION, buf, sizeof(buf), &len, &saved))
+	{
+		case SNAPSHOT_OK:
+			break;
+		case SNAPSHOT_MISSING:
+			return false;
+		default:
+			gauge_log_level(g, LOGGER_WARNING, rc == SNAPSHOT_VERSION ? "Readings file is from another version, taking new readings" : "Readings file is corrupt, taking new readings");
+			return false;
+	}
+
+	snap->device[sizeof(snap->device) - 1] = '\0';
+	if(len < sizeof(*snap) || snap->count < 1 || len != sizeof(*snap) + (snap->count * sizeof(*samples)))
+	{
+		gauge_log_level(g, LOGGER_WARNING, "Readings file is corrupt, taking new readings");
+		return false;
+	}
+	if(strcmp(snap->device, g->device) != 0)
+	{
+		gauge_log_level(g, LOGGER_WARNING, "Readings file was saved for another device, taking new readings");
+		return false;
+	}
+
+	age = (int64_t)time(NULL) - saved;
+	if(age < 0 || age > max_age)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Readings file is %lld seconds old, taking new readings", (long long)age);
+		gauge_log(g, message_buffer);
+		return false;
+	}
+
+	rollstat_clear(&g->readings);
+	for(i = 0; i < snap->count; i++) // a smaller READINGS_WINDOW keeps the newest readings
+	{
+		rollstat_push(&g->readings, samples[i].value);
+		g->reading_times[(g->readings.head + g->readings.count - 1) % g->readings.window] = samples[i].time;
+	}
+	g->datum = snap->datum;
+
+	if(snap->num_stages == g->filters.num_stages && snap->filter_window == g->filters.params.window) // filter state only carries over to the same filters
+	{
+		for(i = 0; i < snap->num_stages && snap->stages[i].kind == g->filters.stages[i].kind; i++)
+			;
+		if(i == snap->num_stages)
+		{
+			age_ms = (uint64_t)age * 1000;
+			for(i = 0; i < snap->num_stages; i++)
+			{
+				s = &g->filters.stages[i];
+				*s = snap->stages[i];
+				if(s->last_ms == 0) // Kalman stage not started
+					continue;
+				since = snap->saved_ms > s->last_ms ? snap->saved_ms - s->last_ms : 0; // sample times move to this boot's monotonic clock
+				s->last_ms = now_ms > age_ms + since ? now_ms - age_ms - since : 1;
+			}
+		}
+	}
+
+	snprintf(message_buffer, sizeof(message_buffer), "Resumed from readings file saved %lld seconds ago: %d readings, datum %d", (long long)age, g->readings.count, g->datum);
+	gauge_log(g, message_buffer);
+
+	return true;
+}
+
+// create the gauge timer and open its link if that is not open yet, the gauge becomes idle
+// once the link is up. returns 0 on success
+int gauge_open(struct gauge_t *g)
+{
+	if(g->timerfd < 0)
+	{
+		if((g->timerfd = evtimer_create()) < 0 || evloop_add(g->loop, g->timerfd, EPOLLIN, gauge_on_timer, g) < 0)
+		{
+			gauge_log(g, "Error creating gauge timer");
+			return -1;
+		}
+	}
+
+	return link_open(g->link);
+}
+
+// add a job to the end of the gauges job queue
+void gauge_queue(struct gauge_t *g, enum gauge_job_kind_t kind, int arg)
+{
+	struct gauge_job_t *job;
+
+	if(g->job_count == MAXJOBS)
+	{
+		gauge_log_level(g, LOGGER_WARNING, "Job queue full, command dropped");
+		return;
+	}
+
+	job = &g->jobs[(g->job_head + g->job_count) % MAXJOBS];
+	job->kind = kind;
+	job->arg = arg;
+	g->job_count++;
+}
+
+// start working the job queue if the gauge is idle and its link is connected
+void gauge_start(struct gauge_t *g)
+{
+	if(g->state == GAUGE_IDLE && g->link->ready)
+		gauge_next(g);
+}
+
+// queue sensor restart, firmware version, datum and initial readings jobs run once at plug-in startup
+void gauge_queue_startup(struct gauge_t *g)
+{
+	struct config_t *config = g->config;
+
+	// restart remote sensor if called for
+	if(config->restart_remote_sensor)
+	{
+		gauge_queue(g, JOB_RESTART, 0);
+		gauge_queue(g, JOB_WAIT_READY, config->restart_timeout); // wait for sensor to reboot and be ready to accept input
+	}
+
+	// log sensor firmware version
+	if(config->write_log)
+		gauge_queue(g, JOB_ABOUT, 0);
+
+	if(config->set_manual_datum && !config->set_auto_datum)
+		gauge_queue(g, JOB_SET_MANUAL_DATUM, config->manual_datum);
+
+	if(config->set_auto_datum && !config->set_manual_datum)
+		gauge_queue(g, JOB_SET_DATUM, 0);
+
+	// resume from the last saved readings when the datum stays as it was, readings depend on it
+	if(!config->set_auto_datum && !config->set_manual_datum && gauge_load_snapshot(g))
+	{
+		g->initialized = true;
+		return;
+	}
+
+	if(!config->set_auto_datum && !config->set_manual_datum)
+		gauge_queue(g, JOB_GET_DATUM, 0);
+
+	gauge_queue_initial(g);
+}
+
+// queue one poll cycle taking the readings in the METRICBIT() mask metrics, emitted at wall clock ms boundary.
+// returns false when the gauge is still busy or its link is down
+boolean gauge_poll(struct gauge_t *g, int metrics, int64_t boundary)
+{
+	if(gauge_busy(g) || !g->initialized)
+		return false;
+
+	g->rc = 0;
+	g->retries = 0;
+
+	if(g->state == GAUGE_CLOSED) // link manager is reopening the device
+		return false;
+
+	g->polled = metrics; // readings not taken keep their last value, the cadence uses the last battery state
+	g->lookahead.emit_at = boundary;
+	g->lookahead.started = get_monotonic_ms();
+	g->lookahead.latency = 0;
+
+	gauge_queue(g, JOB_POLL, metrics); // read snow depth, battery volts, LiPo charger status... via xBee Explorer on USB
+	gauge_queue(g, JOB_EMIT, 0);
+	gauge_start(g);
+
+	return true;
+}
+
+// true while the gauge has queued or in progress jobs
+boolean gauge_busy(const struct gauge_t *g)
+{
+	return g->job_count > 0 || g->state == GAUGE_PAUSE || g->state == GAUGE_READ;
+}
+
+// write message prefixed with the gauges device name to the log at the level of its wording (logger_classify())
+void gauge_log(struct gauge_t *g, char *message)
+{
+	gauge_log_level(g, logger_classify(message), message);
+}
+
+// write message prefixed with the gauges device name to the log at LOGGER_* level
+void gauge_log_level(struct gauge_t *g, int level, char *message)
+{
+	char buf[FDRING_SIZE + FILENAME_MAX];
+
+	snprintf(buf, sizeof(buf), "%s: %s", g->device, message);
+	if(g->config->write_log)
+		writelog_level(g->config->log_file_name, g->myname, level, buf);
+	else
+		fprintf(stderr, "%s.\n", buf);
+
+	if(g->link != NULL) // the bytes that led up to an error are in the serial trace
+	{
+		link_trace_note(g->link, g->link_index, message);
+		if(level == LOGGER_ERROR)
+			link_trace_dump(g->link, message, false);
+	}
+}
+
+// parse a "%c%04.4d" formatted sensor reply of len bytes to command cmd, returns true when valid
+int parse_reply(const char *buf, size_t len, char cmd, int *value)
+{
+	const char *end = buf + len;
+	int sign = 1;
+	int n = 0;
+	int digits = 0;
+
+	if(len == 0 || buf[0] != cmd)
+		return false;
+	buf++;
+
+	if(buf < end && *buf == '-')
+	{
+		sign = -1;
+		buf++;
+	}
+
+	for(; buf < end && *buf >= '0' && *buf <= '9'; buf++, digits++)
+		n = (n * 10) + (*buf - '0');
+
+	if(digits == 0)
+		return false;
+
+	*value = sign * n;
+	return true;
+}
+
+// start the job at the head of the queue
+static void gauge_next(struct gauge_t *g)
+{
+	struct gauge_job_t *job;
+	int attempts = g->config->retry_count + 1;
+
+	while(g->job_count > 0 && g->jobs[g->job_head].kind == JOB_EMIT) // emit steps don't talk to the sensor
+	{
+		int64_t hold = g->lookahead.emit_at - get_wall_ms();
+
+		if(hold > 0) // readings taken ahead of their boundary are held until it
+		{
+			g->state = GAUGE_PAUSE;
+			evtimer_arm_ms(g->timerfd, (uint32_t)hold);
+			return;
+		}
+		job = &g->jobs[g->job_head];
+		g->job_head = (g->job_head + 1) % MAXJOBS;
+		g->job_count--;
+		gauge_emit(g);
+	}
+
+	if(!g->link->ready) // link lost, the job starts over once it is back
+	{
+		g->state = GAUGE_CLOSED;
+		return;
+	}
+
+	if(g->job_count == 0)
+	{
+		g->state = GAUGE_IDLE;
+		return;
+	}
+
+	job = &g->jobs[g->job_head];
+
+	if(job->kind == JOB_PAUSE)
+	{
+		g->state = GAUGE_PAUSE;
+		evtimer_arm_ms(g->timerfd, job->arg * 1000);
+		return;
+	}
+
+	if(job->kind == JOB_WAIT_READY) // watch for the boot banner, first A probe goes out after one interval
+	{
+		g->lines = 0;
+		g->job_started = get_monotonic_ms();
+		g->state = GAUGE_READ;
+		evtimer_arm_ms(g->timerfd, READYPROBEINTERVAL);
+		return;
+	}
+
+	if(job->kind == JOB_ABOUT || job->kind == JOB_SET_MANUAL_DATUM || job->kind == JOB_RESTART)
+		attempts = 1;
+
+	if(job->kind == JOB_GET_DATUM && g->health == HEALTH_RECONNECT) // link is back up
+		g->health = HEALTH_REPROBE;
+
+	if(job->kind == JOB_POLL)
+	{
+		char cmds[NUMMETRICS + 1];
+		int m = 0, n = 0;
+
+		for(m = 0; m < NUMMETRICS; m++)
+			if(job->arg & METRICBIT(m))
+				cmds[n++] = metric_commands[m];
+		cmds[n] = NUL;
+		txn_begin(g, cmds, attempts, 0);
+	}
+	else
+	{
+		char cmds[2] = {job_command(job->kind), NUL};
+		txn_begin(g, cmds, attempts, job->arg);
+	}
+}
+
+// milliseconds allowed from sending command cmd until its reply is complete
+static uint32_t reply_deadline(struct gauge_t *g, char cmd)
+{
+	if(g->config->reply_timeout > 0)
+		return g->config->reply_timeout * 1000;
+
+	if(cmd == CMD_GET_DEPTH || cmd == CMD_GET_RANGE) // both range the target
+		return GETDEPTHDEADLINE;
+
+	return REPLYDEADLINE;
+}
+
+// start a transaction of the commands in cmds, each one is tried up to attempts times
+static void txn_begin(struct gauge_t *g, const char *cmds, int attempts, int arg)
+{
+	struct gauge_txn_t *txn = &g->txn;
+	int i = 0;
+
+	memset(txn, 0, sizeof(*txn));
+	strncpy(txn->cmds, cmds, MAXTXNCMDS);
+	for(i = 0; txn->cmds[i] != NUL; i++)
+	{
+		txn->state[i] = TXN_PENDING;
+		txn->values[i] = -1;
+		txn->attempts[i] = attempts;
+	}
+	txn->arg = arg;
+
+	txn_send(g);
+}
+
+// send all pending commands of the transaction in one write, or just the first one when not pipelining
+static void txn_send(struct gauge_t *g)
+{
+	struct gauge_txn_t *txn = &g->txn;
+	char command_buffer[(MAXTXNCMDS * 6) + 1];
+	size_t len = 0;
+	uint32_t deadline = 0;
+	uint64_t now = get_monotonic_ms();
+	int i = 0;
+
+	memset(command_buffer, NUL, sizeof(command_buffer));
+	g->lines = 0;
+	txn->sent = 0;
+	txn->replies = 0;
+
+	for(i = 0; txn->cmds[i] != NUL && (g->pipeline || txn->sent == 0); i++)
+	{
+		if(txn->state[i] != TXN_PENDING)
+			continue;
+
+		if(txn->cmds[i] == CMD_SET_MANUAL_CALIBRATE)
+			len += sprintf(&command_buffer[len], "%c%04d\n", CMD_SET_MANUAL_CALIBRATE, txn->arg);
+		else
+			command_buffer[len++] = txn->cmds[i];
+
+		txn->state[i] = TXN_SENT;
+		txn->sent++;
+		txn->tries[i]++;
+		txn->sent_ms[i] = now;
+		stats_command(g, i, STATS_SENT, 0);
+		if(reply_deadline(g, txn->cmds[i]) > deadline)
+			deadline = reply_deadline(g, txn->cmds[i]);
+	}
+
+	if(link_write(g->link, g, command_buffer, len, txn->cmds[0] == CMD_RESTART) < 0) // whole batch in one write
+		gauge_log(g, "Error writing command to tty device");
+
+	if(txn->cmds[0] == CMD_RESTART) // no reply, sensor reboots, drained so the command is out before the restart pause starts
+	{
+		txn->state[0] = TXN_DONE;
+		txn->values[0] = 0;
+		gauge_complete(g);
+		return;
+	}
+
+	g->state = GAUGE_READ;
+	evtimer_arm_ms(g->timerfd, deadline); // replies are handled as soon as they arrive, this is only the upper bound
+}
+
+// record the reply to command i of the transaction, failed commands are queued for resend while attempts are left
+static void txn_reply(struct gauge_t *g, int i, boolean ok, int value)
+{
+	struct gauge_txn_t *txn = &g->txn;
+
+	txn->values[i] = value;
+	if(ok && value >= 0)
+	{
+		txn->state[i] = TXN_DONE;
+		stats_command(g, i, STATS_DONE, value);
+	}
+	else if(--txn->attempts[i] > 0)
+	{
+		txn->state[i] = TXN_PENDING;
+		g->retries++;
+		stats_command(g, i, STATS_RETRY, value);
+	}
+	else
+	{
+		txn->state[i] = TXN_FAILED;
+		stats_command(g, i, STATS_FAILED, value);
+	}
+}
+
+// wait for outstanding replies, send the next batch or complete the transaction
+static void txn_advance(struct gauge_t *g)
+{
+	struct gauge_txn_t *txn = &g->txn;
+	boolean pending = false;
+	int i = 0;
+
+	for(i = 0; txn->cmds[i] != NUL; i++)
+	{
+		if(txn->state[i] == TXN_SENT)
+		{
+			evtimer_arm_ms(g->timerfd, REPLYGAP); // gauge is awake, the rest of the batch follows right away
+			return;
+		}
+		if(txn->state[i] == TXN_PENDING)
+			pending = true;
+	}
+
+	if(pending)
+		txn_send(g);
+	else
+		gauge_complete(g);
+}
+
+// reply deadline expired, count outstanding commands as failed attempts
+static void txn_timeout(struct gauge_t *g)
+{
+	struct gauge_txn_t *txn = &g->txn;
+	int i = 0;
+
+	if(g->pipeline && txn->sent > 1 && txn->replies > 0) // gauge answered the first command and dropped the rest
+	{
+		g->pipeline = false;
+		gauge_log_level(g, LOGGER_WARNING, "Gauge drops pipelined commands, sending one command at a time");
+	}
+
+	for(i = 0; txn->cmds[i] != NUL; i++)
+		if(txn->state[i] == TXN_SENT)
+		{
+			stats_command(g, i, STATS_TIMEOUT, 0);
+			txn_reply(g, i, false, -1);
+		}
+
+	txn_advance(g);
+}
+
+// index of the sent command a reply line belongs to, -1 if none
+static int txn_find(struct gauge_t *g, char cmd)
+{
+	int i = 0;
+
+	for(i = 0; g->txn.cmds[i] != NUL; i++)
+		if(g->txn.cmds[i] == cmd && g->txn.state[i] == TXN_SENT)
+			return i;
+
+	return -1;
+}
+
+// reply value of command cmd in the finished transaction, < 0 when it failed
+static int txn_value(struct gauge_t *g, char cmd)
+{
+	int i = 0;
+
+	for(i = 0; g->txn.cmds[i] != NUL; i++)
+		if(g->txn.cmds[i] == cmd)
+			return g->txn.state[i] == TXN_DONE ? g->txn.values[i] : (g->txn.values[i] < 0 ? g->txn.values[i] : -1);
+
+	return -1;
+}
+
+// current job is done, its results are in the transaction
+static void gauge_complete(struct gauge_t *g)
+{
+	struct gauge_job_t *job = &g->jobs[g->job_head];
+	char message_buffer[256];
+	int value = txn_value(g, g->txn.cmds[0]);
+	int stage = -1; // filter stage that rejected a seed reading
+	int i = 0;
+	boolean done = true;
+
+	evtimer_arm_ms(g->timerfd, 0);
+
+	switch(job->kind)
+	{
+		case JOB_RESTART:
+			gauge_log(g, "Issued remote restart of sensor command");
+			break;
+
+		case JOB_WAIT_READY:
+			if(g->lines > 0)
+				sprintf(message_buffer, "Sensor ready after %.1f seconds", (get_monotonic_ms() - g->job_started) / 1000.0);
+			else
+				sprintf(message_buffer, "Sensor did not answer within %d seconds after restart, carrying on", job->arg);
+			gauge_log(g, message_buffer);
+			break;
+
+		case JOB_GET_DATUM:
+			if(g->health == HEALTH_REPROBE) // readings window and datum are kept, only check the gauge answers
+			{
+				if(value >= 0)
+				{
+					if(value != g->datum)
+					{
+						sprintf(message_buffer, "Datum changed from %d to %d while the gauge was unreachable", g->datum, value);
+						gauge_log(g, message_buffer);
+						g->datum = value;
+					}
+					g->health = HEALTH_OK;
+					g->failures = 0;
+					gauge_log(g, "Gauge answered re-probe, resuming polling with saved readings");
+				}
+				else
+					gauge_log_level(g, LOGGER_WARNING, "Gauge did not answer re-probe");
+			}
+			else if(value >= 0)
+			{
+				g->datum = value;
+				sprintf(message_buffer, "Datum value: %d", g->datum); // log sensor datum value
+				gauge_log(g, message_buffer);
+			}
+			else
+				gauge_log(g, "Error getting datum value from sensor");
+			break;
+
+		case JOB_SET_DATUM:
+			g->datum = value;
+			sprintf(message_buffer, "Auto sensor datum set to: %d", g->datum);
+			gauge_log(g, message_buffer);
+			break;
+
+		case JOB_SET_MANUAL_DATUM:
+			if(value == job->arg)
+			{
+				g->datum = value;
+				sprintf(message_buffer, "Set sensor datum to: %d", value);
+			}
+			else
+				sprintf(message_buffer, "Set sensor datum failed");
+			gauge_log(g, message_buffer);
+			break;
+
+		case JOB_INITIAL_DEPTH: // seed the readings window with current sensor readings, it fills up to READINGS_WINDOW as polls come in
+			if(job->arg == 0)
+				rollstat_clear(&g->readings);
+
+			if(value >= 0 && value != g->datum) // don't use error values, seed readings warm up the filters and a spike among them is caught
+				gauge_push_reading(g, filter_run(&g->filters, value, get_monotonic_ms(), &stage));
+			else if(g->readings.count > 0) // backfill sensor reading errors with average of prior readings
+				gauge_push_reading(g, (int)(rollstat_mean(&g->readings) + 0.5));
+			else // error
+				g->initial_ok = false;
+
+			if(++job->arg < MAXREADINGS && job->arg < g->readings.window) // stay at the head of the queue for the next reading
+				done = false;
+			else
+			{
+				if(!g->initial_ok)
+					gauge_log(g, "Error getting initial sensor values");
+				else
+					gauge_save_snapshot(g);
+				g->initialized = true;
+			}
+			break;
+
+		case JOB_POLL: // partial success is fine, each failed value is reported by the emit step
+			for(i = 0; g->txn.cmds[i] != NUL && g->txn.state[i] == TXN_DONE; i++)
+				;
+			g->stats.cycle_ms = (uint32_t)(get_monotonic_ms() - g->lookahead.started);
+			if(g->txn.cmds[i] == NUL) // only complete acquisitions count towards the lookahead
+				g->lookahead.latency = g->stats.cycle_ms;
+			if(job->arg & METRICBIT(METRIC_DEPTH))
+				g->snowdepth = txn_value(g, CMD_GET_DEPTH);
+			if(job->arg & METRICBIT(METRIC_VOLTAGE))
+				g->batteryVolts = txn_value(g, CMD_GET_VOLTAGE);
+			if(job->arg & METRICBIT(METRIC_CHARGER))
+				g->chargerStatus = txn_value(g, CMD_GET_CHARGER_STATUS);
+			if(job->arg & METRICBIT(METRIC_RANGE))
+				g->range = txn_value(g, CMD_GET_RANGE);
+			if(job->arg & METRICBIT(METRIC_RSSI))
+				g->rssi = txn_value(g, CMD_GET_RSSI);
+			break;
+
+		default:
+			break;
+	}
+
+	if(done)
+	{
+		g->job_head = (g->job_head + 1) % MAXJOBS;
+		g->job_count--;
+		gauge_next(g);
+	}
+	else
+		txn_begin(g, "D", g->config->retry_count + 1, 0);
+}
+
+// queue the jobs that (re)fill the readings array with current sensor readings
+static void gauge_queue_initial(struct gauge_t *g)
+{
+	g->initial_ok = true;
+	gauge_queue(g, JOB_INITIAL_DEPTH, 0);
+}
+
+// output one reading to meteohub as dataN, scaled. returns 1 when the reading is good, else logs it and sets the gauges rc
+static int gauge_emit_value(struct gauge_t *g, uint32_t mh_data_id, int value, int scale, const char *name, int rc)
+{
+	char message_buffer[256];
+
+	if(value >= 0)
+	{
+		fprintf(stdout, "data%d %d\n", mh_data_id, value * scale);
+		return 1;
+	}
+
+	sprintf(message_buffer,"Error reading raw %s: %d", name, value);
+	gauge_log(g, message_buffer);
+	g->rc = rc;
+	return 0;
+}
+
+// filter and smooth the readings of one poll cycle and output them to meteohub
+static void gauge_emit(struct gauge_t *g)
+{
+	const char mh_data_fmt[] = "data%d %d\n";
+	char message_buffer[256];
+	struct tsstore_record_t r;
+	uint32_t mh_data_id = g->id * DATAIDSPERGAUGE;
+	uint32_t mh_extra_id = EXTRADATAIDS + (g->id * 2); // range and RSSI
+	int snowdepth_sma = TSSTORE_NOVALUE; // filtered Simple Moving Average snow depth
+	int raw = g->snowdepth;
+	int filtered = TSSTORE_NOVALUE;
+	int stage = -1; // filter stage that rejected the reading
+	int good = 0; // readings the gauge answered with
+	int expected = 0;
+	int m = 0;
+
+	for(m = 0; m < NUMMETRICS; m++)
+		if(g->polled & METRICBIT(m))
+			expected++;
+
+	if(g->polled & METRICBIT(METRIC_DEPTH))
+	{
+		if(g->snowdepth >= 0)
+		{
+			if(g->snowdepth == g->datum) // nothing in range of the sensor
+				g->snowdepth = (int)(rollstat_mean(&g->readings) + 0.5);
+
+			filtered = filter_run(&g->filters, g->snowdepth, get_monotonic_ms(), &stage);
+			if(stage >= 0)
+			{
+				sprintf(message_buffer,"Snow depth: %d rejected by %s filter, using %d", g->snowdepth, filter_name(g->filters.stages[stage].kind), filtered);
+				gauge_log(g, message_buffer);
+			}
+			g->snowdepth = filtered;
+
+			gauge_push_reading(g, g->snowdepth); // smooth the sensor readings
+			snowdepth_sma = (int)(rollstat_mean(&g->readings) + 0.5);
+
+			gauge_save_snapshot(g);
+
+			fprintf(stdout, mh_data_fmt, mh_data_id, snowdepth_sma * 100);
+			good++;
+		}
+		else
+		{
+			sprintf(message_buffer,"Error reading raw snow depth: %d", g->snowdepth);
+			gauge_log(g, message_buffer);
+			g->rc = -2;
+		}
+	}
+
+	if(g->polled & METRICBIT(METRIC_VOLTAGE))
+		good += gauge_emit_value(g, mh_data_id + 1, g->batteryVolts, 1, "battery volts", -3); // battery voltage is already *100 comming from sensor
+	if(g->polled & METRICBIT(METRIC_CHARGER))
+		good += gauge_emit_value(g, mh_data_id + 2, g->chargerStatus, 100, "charger status", -4);
+	if(g->polled & METRICBIT(METRIC_RANGE))
+		good += gauge_emit_value(g, mh_extra_id, g->range, 100, "range", -5);
+	if(g->polled & METRICBIT(METRIC_RSSI))
+		good += gauge_emit_value(g, mh_extra_id + 1, g->rssi, 1, "RSSI", -6); // RSSI percent is already *100 comming from sensor
+
+	fflush(stdout);
+
+#ifdef DEBUG
+	link_log_io();
+#endif
+
+	if((g->polled & METRICBIT(METRIC_DEPTH)) && ++g->cycles % FILTERREPORTCYCLES == 0)
+	{
+		gauge_filter_report(g);
+		sched_report(g);
+	}
+
+	gauge_store(g, &r, raw, filtered, snowdepth_sma);
+	sched_acquired(g);
+	cadence_update(g);
+	gauge_supervise(g, good, expected);
+	outputs_write(g, &r); // after supervise, the latest readings carry the gauge's new health
+	stats_polled(g);
+}
+
+// move the gauge between health states after a poll cycle with good readings out of expected.
+// a gauge that stops answering gets its link reopened and is re-probed, its readings window and datum are kept
+static void gauge_supervise(struct gauge_t *g, int good, int expected)
+{
+	struct link_t *link = g->link;
+	int i = 0;
+
+	if(good == expected)
+	{
+		if(g->health != HEALTH_OK)
+			gauge_log(g, "Gauge recovered");
+		g->health = HEALTH_OK;
+		g->failures = 0;
+		return;
+	}
+
+	if(good > 0)
+	{
+		if(g->health == HEALTH_OK)
+			gauge_log_level(g, LOGGER_WARNING, "Gauge degraded, some readings failed");
+		g->health = HEALTH_DEGRADED;
+		g->failures = 0;
+		return;
+	}
+
+	if(++g->failures % SUPERVISORRECONNECT != 0)
+		return;
+
+	gauge_log_level(g, LOGGER_WARNING, "Gauge is not answering, reconnecting and re-probing");
+	g->health = HEALTH_RECONNECT;
+	gauge_queue(g, JOB_GET_DATUM, 0);
+
+	for(i = 0; i < link->num_gauges; i++) // gauges sharing a coordinator XBee that still answer keep the link up
+		if(link->gauges[i]->health == HEALTH_OK || link->gauges[i]->health == HEALTH_DEGRADED)
+			return;
+
+	link_lost(link, "No gauge on this link is answering");
+}
+
+// handle one line of sensor output
+static void gauge_line(struct gauge_t *g, const char *line, size_t len)
+{
+	struct gauge_job_t *job = &g->jobs[g->job_head];
+	char buf[FDRING_SIZE + 1];
+	int value = -1;
+	int i = 0;
+	boolean ok = false;
+
+#ifdef DEBUG
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%c - 0x%x\n", line[i], line[i]);
+#endif
+
+	if(job->kind == JOB_WAIT_READY) // boot banner or about text, ready once the sensor goes quiet
+	{
+		g->lines++;
+		evtimer_arm_ms(g->timerfd, READYSETTLE);
+		return;
+	}
+
+	if(job->kind == JOB_ABOUT) // 7 lines of firmware version and sensor info
+	{
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) // get rid of CR-LF at end of string
+			len--;
+		if(len > 0)
+		{
+			memcpy(buf, line, len);
+			buf[len] = NUL;
+			gauge_log(g, buf);
+		}
+		if(++g->lines == 7)
+			gauge_complete(g);
+		else
+			evtimer_arm_ms(g->timerfd, TTYREADWINDOW); // sensor info lines follow right away when the sensor is present
+		return;
+	}
+
+	if((i = txn_find(g, line[0])) >= 0) // lines that don't answer a sent command are skipped
+	{
+		g->txn.replies++;
+		ok = parse_reply(line, len, g->txn.cmds[i], &value);
+		stats_command(g, i, ok ? STATS_REPLY : STATS_BADREPLY, value);
+		txn_reply(g, i, ok, value);
+		txn_advance(g);
+	}
+}
+
+// handle sensor output the link has put into the receive ring
+void gauge_input(struct gauge_t *g)
+{
+	const char *line;
+	size_t len = 0;
+
+	if(g->state != GAUGE_READ) // unsolicited output, e.g. boot messages
+	{
+		fdring_clear(&g->rx);
+		return;
+	}
+
+	// a line can complete the transaction and start the next one, leftover lines are replies to that one
+	while(g->state == GAUGE_READ && (line = fdring_getline(&g->rx, &len)) != NULL)
+		gauge_line(g, line, len);
+}
+
+// probe interval or settle time of a restarting sensor has expired
+static void gauge_probe_ready(struct gauge_t *g)
+{
+	struct gauge_job_t *job = &g->jobs[g->job_head];
+	const char probe[] = {CMD_GET_ABOUT};
+	uint64_t elapsed = get_monotonic_ms() - g->job_started;
+
+	if(g->lines > 0 || elapsed >= (uint64_t)job->arg * 1000) // answered and quiet again, or out of time
+	{
+		gauge_complete(g);
+		return;
+	}
+
+	if(link_write(g->link, g, probe, sizeof(probe), false) < 0)
+		gauge_log(g, "Error writing command to tty device");
+
+	if(elapsed + READYPROBEINTERVAL > (uint64_t)job->arg * 1000) // last probe, wait only until the upper bound
+		evtimer_arm_ms(g->timerfd, (job->arg * 1000) - elapsed + 1);
+	else
+		evtimer_arm_ms(g->timerfd, READYPROBEINTERVAL);
+}
+
+// pause or reply deadline has expired
+static void gauge_on_timer(int fd, uint32_t events, void *ctx)
+{
+	struct gauge_t *g = (struct gauge_t *)ctx;
+
+	evtimer_ack(fd);
+
+	switch(g->state)
+	{
+		case GAUGE_PAUSE:
+			if(g->jobs[g->job_head].kind == JOB_PAUSE) // a held emit step stays queued
+			{
+				g->job_head = (g->job_head + 1) % MAXJOBS;
+				g->job_count--;
+			}
+			gauge_next(g);
+			break;
+
+		case GAUGE_READ:
+			if(g->jobs[g->job_head].kind == JOB_WAIT_READY)
+				gauge_probe_ready(g);
+			else if(g->jobs[g->job_head].kind == JOB_ABOUT) // fewer lines than expected is not an error
+				gauge_complete(g);
+			else
+				txn_timeout(g);
+			break;
+
+		default:
+			break;
+	}
+}
@@ -0,0 +1,582 @@
+/*
+
+	gaugesim.c
+
+	snow depth gauge simulator for testing and benchmarking the plug-in in transparent mode without a
+	Teensy, sensor or XBees. Creates a pty, links it to a device name and answers the commands of
+	processCommand() in Maxbotix_TTL.ino with the same "%c%04.4d\n" replies and error codes:
+
+	  A  about line, then the sensor's 6 boot lines when the sensor answers
+	  B  no reply, the gauge restarts and prints the about line when it is back
+	  C  ranges and stores the datum, no reply when ranging fails (the firmware stores the error code,
+	     reads back something else and prints nothing)
+	  D  datum - range, 0 when the range is beyond the datum, or the ranging error code
+	  G  stored datum
+	  I  firmware build information
+	  N  XBee RSSI, percent * 100
+	  R  range or error code: -1000 no data, -2000 no target, -3000 too close, -5000 no sensor
+	  S  Sxxxx sets the datum to xxxx (read until CR, 5 bytes or 1 s like readBytesUntil), -4000 when not 4 digits
+	  T  charger status: 2 done, 1 charging, 0 not charging
+	  V  battery volts * 100
+	  ?  command list
+
+	Like the firmware it handles one command at a time and discards whatever arrived while it was busy
+	(Uart2.clear()), unless -p is given. Ranging commands take as long as the firmware's 500 ms auto range
+	delay and 9 sensor readings.
+
+	The snow depth follows a curve file of "seconds depth_mm" lines (# starts a comment): depths are
+	interpolated linearly between points, a negative depth is a ranging error code held until the next
+	point. Times count from the start of the simulator, the last point is held after the end. Noise is
+	added to depths, the range is the mounting height (-G) minus the depth, clamped the way the sensor
+	reports no target (>= 5000 mm) and too close (<= 500 mm).
+
+	usage: gaugesim [-l link_name] [-d depth_mm | -c curve_file] [-k speed] [-n noise_mm] [-G datum_mm]
+	                [-V volts] [-T status] [-N rssi] [-a reply_ms] [-r range_ms] [-b restart_ms] [-j jitter_ms]
+	                [-w wake_ms] [-x loss_pct] [-g garbage_pct] [-f up_s:down_s] [-s seed] [-p] [-v]
+	  -l link_name    name of the symlink to the pty slave, default /tmp/ttyGauge
+	  -d depth_mm     constant snow depth, negative for a ranging error code (e.g. -5000 dead sensor), default 800
+	  -c curve_file   snow depth curve
+	  -k speed        run the curve speed times faster, default 1
+	  -n noise_mm     depths vary up to +- noise_mm, default 3
+	  -G datum_mm     mounting height and initial stored datum, default 5000
+	  -V volts        battery volts * 100, default 412
+	  -T status       charger status, default 1
+	  -N rssi         RSSI percent, default 55
+	  -a reply_ms     reply delay of commands that don't range, default 20
+	  -r range_ms     reply delay of C, D and R, default 1800
+	  -b restart_ms   time the gauge is gone after B, default 2500
+	  -j jitter_ms    up to jitter_ms random delay added to every reply, default 0
+	  -w wake_ms      extra delay of the first command after 1 s without commands, as when waking the
+	                  Teensy and XBee from sleep, default 0
+	  -x loss_pct     percent of bytes lost in each direction, default 0
+	  -g garbage_pct  percent of replies with 1 to 8 random bytes inserted, default 0
+	  -f up_s:down_s  flapping USB device: the pty is removed after up_s seconds and comes back after down_s
+	  -s seed         random seed, default 1
+	  -p              keep commands that arrive while busy instead of discarding them
+	  -v              log commands and replies to stderr
+
+	counters go to stderr on SIGINT or SIGTERM
+
+*/
+
+#define _GNU_SOURCE // posix_openpt(), ptsname(), cfmakeraw()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <termios.h>
+
+#define MAXPOINTS 1024
+#define MAXINPUT 4096
+#define MAXREPLY 2048
+#define SIMSLEEPMS 1000 // idle time after which the gauge is asleep and pays the wake delay
+#define ARGTIMEOUTMS 1000 // Stream timeout of readBytesUntil() for the S argument
+#define RANGE_MIN 500
+#define RANGE_NO_TARGET 5000
+
+// errors, as in Maxbotix_TTL.ino
+#define ERR_NO_DATA   -1000
+#define ERR_NO_TARGET -2000
+#define ERR_TOO_CLOSE -3000
+#define ERR_BAD_DATUM -4000
+#define ERR_NO_SENSOR -5000
+
+static const char output_format[] = "%c%.4d\n"; // prints what the firmware's "%c%04.4d\n" does, 0 is ignored with a precision
+
+#define ABOUT "Trimble Ultrasonic Wireless Snow Depth Gauge - Ver 2D-1.7a 03/16/17\n"
+
+struct point_t
+{
+	double t;						// seconds since start
+	int depth;						// mm, < 0 error code
+};
+
+enum sim_state_t
+{
+	SIM_IDLE,						// waiting for a command
+	SIM_ARG,						// reading the S argument
+	SIM_BUSY,						// working on a command, reply due at due_ms
+	SIM_RESTART,					// rebooting after B, about line due at due_ms
+	SIM_UNPLUGGED					// pty removed by -f
+};
+
+// settings
+static const char *link_name = "/tmp/ttyGauge";
+static struct point_t curve[MAXPOINTS];
+static int num_points = 0;
+static double speed = 1;
+static int noise = 3;
+static int mount = 5000;
+static int volts = 412;
+static int charger = 1;
+static int rssi = 55;
+static int reply_ms = 20;
+static int range_ms = 1800;
+static int restart_ms = 2500;
+static int jitter_ms = 0;
+static int wake_ms = 0;
+static double loss_pct = 0;
+static double garbage_pct = 0;
+static double up_s = 0, down_s = 0;
+static int pipeline = 0;
+static int verbose = 0;
+
+// state
+static int master = -1, slave = -1;
+static enum sim_state_t state = SIM_IDLE;
+static int64_t started_ms = 0;
+static int64_t due_ms = 0;				// reply, argument timeout, restart end or flap change
+static int64_t flap_ms = 0;				// next unplug or plug in, 0 = not flapping
+static int64_t last_ms = 0;				// last command finished
+static int datum = 0;					// stored in EEPROM
+static char input[MAXINPUT];
+static size_t input_len = 0;
+static char arg[5];
+static size_t arg_len = 0;
+static char reply[MAXREPLY];
+static char command = 0;
+static volatile sig_atomic_t quit = 0;
+
+// counters
+static unsigned long commands = 0, replies = 0, discarded = 0, lost_in = 0, lost_out = 0, garbled = 0, unplugs = 0;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+// true with probability pct percent
+static int chance(double pct)
+{
+	return pct > 0 && rand() < (pct / 100.0) * ((double)RAND_MAX + 1);
+}
+
+// read the curve file, returns 0 on success, -1 on error
+static int load_curve(const char *file_name)
+{
+	char line[256];
+	FILE *f = NULL;
+	double t = 0;
+	int depth = 0, n = 0;
+
+	if((f = fopen(file_name, "r")) == NULL)
+	{
+		fprintf(stderr, "can't open %s: %s\n", file_name, strerror(errno));
+		return -1;
+	}
+
+	num_points = 0;
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		n++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if(strspn(line, " \t") == strlen(line))
+			continue;
+		if(sscanf(line, "%lf %d", &t, &depth) != 2 || (num_points > 0 && t < curve[num_points - 1].t) || num_points == MAXPOINTS)
+		{
+			fprintf(stderr, "%s:%d: expected \"seconds depth_mm\" with seconds not going back\n", file_name, n);
+			fclose(f);
+			return -1;
+		}
+		curve[num_points].t = t;
+		curve[num_points].depth = depth;
+		num_points++;
+	}
+	fclose(f);
+
+	if(num_points == 0)
+	{
+		fprintf(stderr, "%s has no points\n", file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+// snow depth of the curve now, with noise, < 0 for a ranging error
+static int curve_depth(void)
+{
+	double t = (now_ms() - started_ms) * speed / 1000.0;
+	int i = 0, depth = curve[0].depth;
+
+	for(i = 0; i < num_points && curve[i].t <= t; i++)
+		depth = curve[i].depth;
+
+	if(i > 0 && i < num_points && curve[i - 1].depth >= 0 && curve[i].depth >= 0 && curve[i].t > curve[i - 1].t)
+		depth = curve[i - 1].depth + (int)((curve[i].depth - curve[i - 1].depth) * (t - curve[i - 1].t) / (curve[i].t - curve[i - 1].t));
+
+	if(depth >= 0 && noise > 0 && (depth += (rand() % (2 * noise + 1)) - noise) < 0)
+		depth = 0;
+
+	return depth;
+}
+
+// getRange(): distance to the snow in mm or an error code
+static int get_range(void)
+{
+	int depth = curve_depth();
+	int range = 0;
+
+	if(depth < 0)
+		return depth;
+
+	range = mount - depth;
+	if(range >= RANGE_NO_TARGET)
+		return ERR_NO_TARGET;
+	if(range <= RANGE_MIN)
+		return ERR_TOO_CLOSE;
+
+	return range;
+}
+
+// processCommand(): reply text of command c and its delay in ms
+static int process_command(char c, char *out, size_t len)
+{
+	int range = 0, stored = 0;
+
+	out[0] = '\0';
+	switch(c)
+	{
+		case 'A':
+			snprintf(out, len, "%s", ABOUT);
+			if(get_range() != ERR_NO_SENSOR) // sensor boot lines
+				snprintf(out + strlen(out), len - strlen(out), "HRXL-MaxSonar-WRS\nPN:MB7354\nCopyright 2011-2013\nMaxBotix Inc.\nRoHS 1.6b 0813\nTempI\n");
+			return 200 + reply_ms;
+		case 'B':
+			return restart_ms;
+		case 'C':
+			range = get_range();
+			stored = range & 0xffff; // 16 bits in EEPROM, an error code doesn't read back
+			datum = stored;
+			if(datum == range)
+				snprintf(out, len, output_format, 'C', datum);
+			return range_ms;
+		case 'D':
+			range = get_range();
+			snprintf(out, len, output_format, 'D', range < 0 ? range : (range < datum ? datum - range : 0));
+			return range_ms;
+		case 'G':
+			snprintf(out, len, output_format, 'G', datum);
+			return reply_ms;
+		case 'I':
+			snprintf(out, len, "Built: Mar 16 2017 21:04:17, from file: Maxbotix_TTL.ino using Arduino: 106 (simulated)\n");
+			return reply_ms;
+		case 'N':
+			snprintf(out, len, output_format, 'N', rssi * 100);
+			return reply_ms;
+		case 'R':
+			snprintf(out, len, output_format, 'R', get_range());
+			return range_ms;
+		case 'S':
+			if(arg_len >= 4 && arg[0] >= '0' && arg[0] <= '9' && arg[1] >= '0' && arg[1] <= '9' && arg[2] >= '0' && arg[2] <= '9' && arg[3] >= '0' && arg[3] <= '9')
+			{
+				datum = (arg[0] - '0') * 1000 + (arg[1] - '0') * 100 + (arg[2] - '0') * 10 + (arg[3] - '0');
+				snprintf(out, len, output_format, 'S', datum);
+			}
+			else
+				snprintf(out, len, output_format, 'S', ERR_BAD_DATUM);
+			return reply_ms;
+		case 'T':
+			snprintf(out, len, output_format, 'T', charger);
+			return reply_ms;
+		case 'V':
+			snprintf(out, len, output_format, 'V', volts);
+			return reply_ms;
+		case '?':
+			snprintf(out, len, "Available Commands:\n  A - Get About version information\n  B - ReBoot Teensy CPU and XBee Radio\n"
+				"  C - Calibrate snow depth sensor at current distance\n  D - Get calibrated snow Depth (mm)\n"
+				"  G - Get saved calibration value (mm)\n  I - Get firware build Information\n"
+				"  N - Get XBee RSSI signal strength value (%%)\n  R - Get snow depth sensor Range (mm)\n"
+				"  Sxxxx - Set manual calibration distance xxxx (mm)\n  T - Get battery charger sTatus:\n"
+				"    2: Done Charging, 1: Charging, 0: Not Charging\n  V - Get battery Voltage (100x)\n  ? - List available commands\n");
+			return 50 + reply_ms;
+		default:
+			return 0;
+	}
+}
+
+// write text to the pty, losing and inserting bytes as configured
+static void send_reply(const char *text)
+{
+	char out[MAXREPLY + 8];
+	size_t len = strlen(text), n = 0, i = 0, at = len;
+	int garbage = 0;
+
+	if(len == 0)
+		return;
+
+	if(chance(garbage_pct))
+	{
+		garbage = 1 + (rand() % 8);
+		at = rand() % (len + 1);
+		garbled++;
+	}
+
+	for(i = 0; i <= len; i++)
+	{
+		for(; i == at && garbage > 0; garbage--)
+			out[n++] = (char)(rand() % 256);
+		if(i == len)
+			break;
+		if(chance(loss_pct))
+			lost_out++;
+		else
+			out[n++] = text[i];
+	}
+
+	if(verbose)
+		fprintf(stderr, "%.3f reply %.*s", (now_ms() - started_ms) / 1000.0, (int)len, text);
+	if(master >= 0 && n > 0 && write(master, out, n) != (ssize_t)n)
+		perror("write");
+	replies++;
+}
+
+// start working on command c, the reply is sent when it is due
+static void start_command(char c, int64_t now)
+{
+	int delay = process_command(c, reply, sizeof(reply));
+
+	if(verbose)
+		fprintf(stderr, "%.3f command %c%.*s\n", (now - started_ms) / 1000.0, c, c == 'S' ? (int)arg_len : 0, arg);
+
+	if(wake_ms > 0 && now - last_ms >= SIMSLEEPMS)
+		delay += wake_ms;
+	if(jitter_ms > 0)
+		delay += rand() % (jitter_ms + 1);
+
+	commands++;
+	command = c;
+	due_ms = now + delay;
+	state = c == 'B' ? SIM_RESTART : SIM_BUSY;
+}
+
+// take commands from the received bytes while the gauge is idle
+static void run_input(int64_t now)
+{
+	size_t used = 0;
+
+	while(used < input_len && (state == SIM_IDLE || state == SIM_ARG))
+	{
+		char c = input[used++];
+
+		if(state == SIM_ARG)
+		{
+			if(c != '\r')
+				arg[arg_len++] = c;
+			if(c == '\r' || arg_len == sizeof(arg))
+				start_command('S', now);
+		}
+		else if(c == 'S')
+		{
+			arg_len = 0;
+			state = SIM_ARG;
+			due_ms = now + ARGTIMEOUTMS;
+		}
+		else
+			start_command(c, now);
+	}
+
+	memmove(input, &input[used], input_len - used);
+	input_len -= used;
+}
+
+// create the pty and link it, returns 0 on success, -1 on error
+static int plug_in(void)
+{
+	struct termios tio;
+
+	if((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+	{
+		perror("posix_openpt");
+		return -1;
+	}
+
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY); // kept open so the master does not see a hang-up between plug-in runs
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	unlink(link_name);
+	if(symlink(ptsname(master), link_name) < 0)
+	{
+		perror("symlink");
+		return -1;
+	}
+
+	return 0;
+}
+
+// remove the link and the pty, the plug-in sees a hang-up
+static void unplug(void)
+{
+	unlink(link_name);
+	close(slave);
+	close(master);
+	master = slave = -1;
+	input_len = 0;
+	unplugs++;
+}
+
+// time of the next thing to do, -1 when waiting for input
+static int next_timeout(int64_t now)
+{
+	int64_t next = -1;
+
+	if(state != SIM_IDLE && state != SIM_UNPLUGGED)
+		next = due_ms;
+	if(flap_ms != 0 && (next < 0 || flap_ms < next))
+		next = flap_ms;
+
+	if(next < 0)
+		return -1;
+	return next > now ? (int)(next - now) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *usage = "usage: %s [-l link_name] [-d depth_mm | -c curve_file] [-k speed] [-n noise_mm] [-G datum_mm] [-V volts] [-T status]\n"
+		"       [-N rssi] [-a reply_ms] [-r range_ms] [-b restart_ms] [-j jitter_ms] [-w wake_ms] [-x loss_pct] [-g garbage_pct]\n"
+		"       [-f up_s:down_s] [-s seed] [-p] [-v]\n";
+	struct sigaction sa;
+	struct pollfd pfd;
+	char buf[512];
+	int64_t now = 0;
+	ssize_t n = 0, i = 0;
+	int opt = 0;
+
+	curve[0].depth = 800;
+	num_points = 1;
+	srand(1);
+
+	while((opt = getopt(argc, argv, "l:d:c:k:n:G:V:T:N:a:r:b:j:w:x:g:f:s:pv")) != -1)
+	{
+		switch(opt)
+		{
+			case 'l': link_name = optarg; break;
+			case 'd': curve[0].depth = atoi(optarg); num_points = 1; break;
+			case 'c':
+				if(load_curve(optarg) < 0)
+					return 1;
+				break;
+			case 'k': speed = atof(optarg); break;
+			case 'n': noise = atoi(optarg); break;
+			case 'G': mount = atoi(optarg); break;
+			case 'V': volts = atoi(optarg); break;
+			case 'T': charger = atoi(optarg); break;
+			case 'N': rssi = atoi(optarg); break;
+			case 'a': reply_ms = atoi(optarg); break;
+			case 'r': range_ms = atoi(optarg); break;
+			case 'b': restart_ms = atoi(optarg); break;
+			case 'j': jitter_ms = atoi(optarg); break;
+			case 'w': wake_ms = atoi(optarg); break;
+			case 'x': loss_pct = atof(optarg); break;
+			case 'g': garbage_pct = atof(optarg); break;
+			case 'f':
+				if(sscanf(optarg, "%lf:%lf", &up_s, &down_s) != 2 || up_s <= 0 || down_s <= 0)
+				{
+					fprintf(stderr, "bad flap times %s, use up_s:down_s\n", optarg);
+					return 1;
+				}
+				break;
+			case 's': srand((unsigned)atol(optarg)); break;
+			case 'p': pipeline = 1; break;
+			case 'v': verbose = 1; break;
+			default:
+				fprintf(stderr, usage, argv[0]);
+				return 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal; // no SA_RESTART, poll() returns
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	datum = mount;
+	started_ms = last_ms = now_ms();
+	if(up_s > 0)
+		flap_ms = started_ms + (int64_t)(up_s * 1000);
+
+	if(plug_in() < 0)
+		return 1;
+	fprintf(stderr, "%s -> %s, simulated gauge\n", link_name, ptsname(master));
+
+	while(!quit)
+	{
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		if(poll(&pfd, master >= 0 ? 1 : 0, next_timeout(now_ms())) > 0 && (n = read(master, buf, sizeof(buf))) > 0)
+		{
+			for(i = 0; i < n; i++)
+			{
+				if(chance(loss_pct))
+					lost_in++;
+				else if(state == SIM_RESTART) // nothing is listening while it reboots
+					discarded++;
+				else if(input_len < sizeof(input))
+					input[input_len++] = buf[i];
+			}
+		}
+		now = now_ms();
+
+		if(flap_ms != 0 && now >= flap_ms)
+		{
+			if(master >= 0)
+			{
+				unplug();
+				state = SIM_UNPLUGGED;
+				flap_ms = now + (int64_t)(down_s * 1000);
+			}
+			else if(plug_in() == 0)
+			{
+				state = SIM_IDLE;
+				last_ms = now;
+				flap_ms = now + (int64_t)(up_s * 1000);
+			}
+			else
+				return 1;
+			if(verbose)
+				fprintf(stderr, "%.3f %s\n", (now - started_ms) / 1000.0, master >= 0 ? "plugged in" : "unplugged");
+		}
+
+		if(state == SIM_ARG && now >= due_ms) // readBytesUntil() timed out
+			start_command('S', now);
+
+		if((state == SIM_BUSY || state == SIM_RESTART) && now >= due_ms)
+		{
+			if(!pipeline) // Uart2.clear() before the reply and after the command
+			{
+				discarded += input_len;
+				input_len = 0;
+			}
+			send_reply(state == SIM_RESTART ? ABOUT : reply); // setup() prints the about line, the datum survives in EEPROM
+			state = SIM_IDLE;
+			last_ms = now;
+		}
+
+		if(state == SIM_IDLE || state == SIM_ARG)
+			run_input(now);
+	}
+
+	fprintf(stderr, "gaugesim: %lu commands, %lu replies, %lu bytes discarded while busy, %lu bytes lost in, %lu lost out, %lu replies garbled, %lu unplugs\n",
+		commands, replies, discarded, lost_in, lost_out, garbled, unplugs);
+
+	if(master >= 0)
+		unplug();
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+
+	latest.c
+
+	latest readings of every gauge in a shared memory file guarded by per gauge sequence locks
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "latest.h"
+
+static const char *latest_names[LATEST_READINGS] = {"depth", "volts", "charger", "range", "rssi"};
+static const char *health_names[] = {"ok", "degraded", "reconnecting", "reprobing"};
+
+// create or reset the shared memory file for num_gauges gauges and map it. returns the mapping, NULL on error (errno set)
+struct latest_t *latest_create(const char *filename, int num_gauges, int64_t started)
+{
+	struct latest_t *shm = NULL;
+	int fd = -1, err = 0;
+
+	if((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return NULL;
+
+	if(ftruncate(fd, sizeof(struct latest_t)) < 0 ||
+		(shm = (struct latest_t *)mmap(NULL, sizeof(struct latest_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	close(fd);
+
+	shm->magic = 0; // readers attached to a previous run see no gauges while it is reset
+	__sync_synchronize();
+	memset(&shm->gauges, 0, sizeof(shm->gauges));
+	shm->version = LATEST_VERSION;
+	shm->gauge_size = sizeof(struct latest_gauge_t);
+	shm->num_gauges = num_gauges > LATEST_MAXGAUGES ? LATEST_MAXGAUGES : num_gauges;
+	shm->pid = getpid();
+	shm->started = started;
+	__sync_synchronize();
+	shm->magic = LATEST_MAGIC;
+
+	return shm;
+}
+
+// map the shared memory file read-only. returns the mapping, NULL on error (errno set)
+const struct latest_t *latest_attach(const char *filename)
+{
+	const struct latest_t *shm = NULL;
+	int fd = -1;
+
+	if((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	shm = (const struct latest_t *)mmap(NULL, sizeof(struct latest_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+		return NULL;
+
+	if(shm->magic != LATEST_MAGIC || shm->version != LATEST_VERSION || shm->gauge_size != sizeof(struct latest_gauge_t))
+	{
+		munmap((void *)shm, sizeof(struct latest_t));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return shm;
+}
+
+void latest_detach(const struct latest_t *shm)
+{
+	munmap((void *)shm, sizeof(struct latest_t));
+}
+
+// publish gauge n, seq is managed here
+void latest_publish(struct latest_t *shm, int n, const struct latest_gauge_t *g)
+{
+	struct latest_gauge_t *dst = &shm->gauges[n];
+	uint32_t seq = dst->seq;
+
+	dst->seq = seq + 1; // odd, readers retry
+	__sync_synchronize();
+	memcpy((char *)dst + sizeof(dst->seq), (const char *)g + sizeof(g->seq), sizeof(*g) - sizeof(g->seq));
+	__sync_synchronize();
+	dst->seq = seq + 2;
+}
+
+// consistent copy of gauge n. returns 0 on success, -1 when the writer never finished an update
+int latest_read(const struct latest_t *shm, int n, struct latest_gauge_t *g)
+{
+	const volatile uint32_t *seq = &shm->gauges[n].seq;
+	uint32_t before = 0, stuck = 0;
+	int attempts = 0;
+
+	while(attempts < LATEST_MAXRETRIES)
+	{
+		if((before = *seq) & 1) // update in progress, only a sequence that stays odd counts against the writer
+		{
+			attempts = before == stuck ? attempts + 1 : 0;
+			stuck = before;
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		memcpy(g, &shm->gauges[n], sizeof(*g));
+		__sync_synchronize();
+		if(*seq == before)
+			return 0;
+	}
+
+	return -1;
+}
+
+// format gauge n as one "key=value ..." line with reading ages at wall clock ms now. returns its length
+size_t latest_format(const struct latest_gauge_t *g, int n, int64_t now, char *buf, size_t len)
+{
+	size_t used = 0;
+	int i = 0, added = 0;
+
+	added = snprintf(buf, len, "gauge=%d device=%s health=%s", n, g->device, g->health < 4 ? health_names[g->health] : "unknown");
+	used = added < 0 ? 0 : ((size_t)added < len ? (size_t)added : len - 1);
+
+	for(i = 0; i < LATEST_READINGS && used < len; i++)
+	{
+		if(g->readings[i].time == 0) // never taken, e.g. range and RSSI when not polled
+			continue;
+		added = snprintf(&buf[used], len - used, " %s=%d %s_age=%.1f%s", latest_names[i], g->readings[i].value, latest_names[i],
+			(now - g->readings[i].time) / 1000.0, g->readings[i].last < 0 ? " stale" : "");
+		used = added < 0 ? used : (used + added < len ? used + added : len - 1);
+	}
+
+	if(used < len)
+	{
+		added = snprintf(&buf[used], len - used, " raw=%d filtered=%d retries=%d error=%d polls=%u\n", g->raw, g->filtered, g->retries, g->error, g->polls);
+		used = added < 0 ? used : (used + added < len ? used + added : len - 1);
+	}
+
+	return used;
+}
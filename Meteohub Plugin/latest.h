@@ -0,0 +1,79 @@
+/*
+
+	latest.h
+
+	latest readings of every gauge published by the plug-in for local readers, so nobody has to
+	send commands to a gauge by hand over its tty device. The plug-in writes them to a shared memory
+	file (a tmpfs file mapped MAP_SHARED), each gauge guarded by a sequence lock: the writer makes
+	the sequence odd, updates the gauge and makes it even again, readers copy the gauge and retry
+	when the sequence was odd or changed meanwhile. Readers never block the plug-in.
+
+*/
+#ifndef LATEST_H
+#define LATEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define LATEST_MAGIC 0x544C534D // "MSLT" little endian
+#define LATEST_VERSION 1
+#define LATEST_MAXGAUGES 16
+#define LATEST_MAXRETRIES 1000 // reader attempts before giving up on a writer that died mid update
+
+// readings, same order as the plug-in's metrics
+#define LATEST_DEPTH 0		// smoothed snow depth as output to meteohub, mm
+#define LATEST_VOLTS 1		// battery volts * 100
+#define LATEST_CHARGER 2	// 0 = not charging, 1 = charging, 2 = done
+#define LATEST_RANGE 3		// sensor range, mm
+#define LATEST_RSSI 4		// XBee RSSI percent * 100
+#define LATEST_READINGS 5
+
+// structs
+struct latest_reading_t
+{
+	int32_t value;			// last good value
+	int32_t last;			// result of the last attempt, < 0 when it failed
+	int64_t time;			// wall clock ms of the last good value, 0 = none yet
+};
+
+struct latest_gauge_t
+{
+	uint32_t seq;			// odd while the writer is updating the gauge
+	uint32_t health;		// 0 = ok, 1 = degraded, 2 = reconnecting, 3 = re-probing
+	char device[128];
+	struct latest_reading_t readings[LATEST_READINGS];
+	int32_t raw;			// last snow depth reading before filtering, mm
+	int32_t filtered;		// after the outlier filters, mm
+	int32_t retries;		// commands resent in the last poll cycle
+	int32_t error;			// result of the last poll cycle, 0 = ok
+	uint32_t polls;			// poll cycles since the plug-in started
+	uint32_t reserved;
+	int64_t updated;		// wall clock ms of the last poll cycle
+};
+
+// layout of the shared memory file
+struct latest_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t gauge_size;
+	uint32_t num_gauges;
+	int32_t pid;			// of the plug-in
+	int64_t started;		// wall clock ms the plug-in started
+	struct latest_gauge_t gauges[LATEST_MAXGAUGES];
+};
+
+// create or reset the shared memory file for num_gauges gauges and map it. returns the mapping, NULL on error (errno set)
+struct latest_t *latest_create(const char *filename, int num_gauges, int64_t started);
+// map the shared memory file read-only. returns the mapping, NULL on error (errno set)
+const struct latest_t *latest_attach(const char *filename);
+void latest_detach(const struct latest_t *shm);
+// publish gauge n, seq is managed here
+void latest_publish(struct latest_t *shm, int n, const struct latest_gauge_t *g);
+// consistent copy of gauge n. returns 0 on success, -1 when the writer never finished an update
+int latest_read(const struct latest_t *shm, int n, struct latest_gauge_t *g);
+// format gauge n as one "key=value ..." line with reading ages at wall clock ms now. returns its length
+size_t latest_format(const struct latest_gauge_t *g, int n, int64_t now, char *buf, size_t len);
+
+#endif
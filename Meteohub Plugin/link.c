@@ -0,0 +1,683 @@
+/*
+
+	link.c
+
+	a link is one tty device with the host side XBee, or a TCP connection to a serial bridge
+	that has the XBee on its serial port. In transparent mode it carries the commands and
+	replies of one gauge. In XBee API mode the host XBee is a coordinator and one link carries
+	any number of gauges, each addressed by its XBee address.
+
+*/
+
+#include "mhsdpi.h"
+
+static struct link_t links[MAXGAUGES];
+static int num_links = 0;
+
+static void link_on_read(int fd, uint32_t events, void *ctx);
+static void link_on_timer(int fd, uint32_t events, void *ctx);
+static void link_on_watch(int fd, uint32_t events, void *ctx);
+
+// write message prefixed with the links device name to the log
+static void link_log(struct link_t *link, char *message)
+{
+	char buf[256 + FILENAME_MAX];
+
+	link_trace_note(link, TRACE_NOCHANNEL, message);
+
+	snprintf(buf, sizeof(buf), "%s: %s", link->device, message);
+	if(link->config->write_log)
+		writelog(link->config->log_file_name, link->myname, buf);
+	else
+		fprintf(stderr, "%s.\n", buf);
+}
+
+// attach gauge to the link for its DEVICE value, "tty_device" for transparent mode or
+// "tty_device@xbee_address" for API mode. tty_device can also be tcp://host:port or
+// rfc2217://host:port for serial bridges. returns 0 on success, -1 on configuration errors
+int link_attach(struct gauge_t *g)
+{
+	char path[FILENAME_MAX];
+	char *at = NULL;
+	enum link_mode_t mode = LINK_TRANSPARENT;
+	struct link_t *link = NULL;
+	int i = 0;
+
+	strncpy(path, g->device, sizeof(path) - 1);
+	path[sizeof(path) - 1] = NUL;
+
+	if((at = strrchr(path, '@')) != NULL)
+	{
+		*at = NUL;
+		if(xbee_parse_addr(at + 1, &g->addr) < 0)
+		{
+			gauge_log(g, "Bad XBee address, use up to 4 hex digits for 16-bit or 16 hex digits for 64-bit addresses");
+			return -1;
+		}
+		mode = LINK_XBEE_API;
+	}
+
+	for(i = 0; i < num_links; i++)
+		if(strcmp(links[i].device, path) == 0)
+			link = &links[i];
+
+	if(link != NULL)
+	{
+		if(mode != LINK_XBEE_API || link->mode != LINK_XBEE_API)
+		{
+			gauge_log(g, "Device is used by more than one gauge, add an XBee address to each one to use API mode");
+			return -1;
+		}
+		for(i = 0; i < link->num_gauges; i++)
+		{
+			if(xbee_addr_equal(&link->gauges[i]->addr, &g->addr))
+			{
+				gauge_log(g, "XBee address is used by more than one gauge");
+				return -1;
+			}
+		}
+	}
+	else
+	{
+		link = &links[num_links++];
+		memset(link, 0, sizeof(*link));
+		strcpy(link->device, path);
+		link->mode = mode;
+		link->ttyfile = -1;
+		link->timerfd = -1;
+		link->watchfd = -1;
+		if((link->transport = fdnet_scheme(path, link->host, sizeof(link->host), link->port, sizeof(link->port))) < 0)
+		{
+			gauge_log(g, "Bad serial bridge url, use tcp://host:port or rfc2217://host:port");
+			return -1;
+		}
+		link->config = g->config;
+		link->myname = g->myname;
+		link->loop = g->loop;
+		if(strcmp(g->config->trace_file_name, "none") != 0 && trace_init(&link->trace, (size_t)g->config->trace_kb * 1024) < 0)
+			link_log(link, "Can't allocate the serial trace ring, recording is off");
+	}
+
+	g->link_index = link->num_gauges;
+	link->gauges[link->num_gauges++] = g;
+	g->link = link;
+
+	return 0;
+}
+
+// device or bridge is up, reset the backoff and start the gauges
+static void link_up(struct link_t *link)
+{
+	int i = 0;
+
+	link->ready = true;
+	link->backoff = LINKBACKOFFMIN;
+
+	for(i = 0; i < link->num_gauges; i++)
+	{
+		fdring_init(&link->gauges[i]->rx);
+		link->gauges[i]->state = GAUGE_IDLE;
+		gauge_start(link->gauges[i]); // interrupted jobs start over
+	}
+}
+
+// close the tty device or connection, queued jobs of the gauges wait for the link to come back
+static void link_down(struct link_t *link)
+{
+	int i = 0;
+
+	if(link->ttyfile >= 0)
+	{
+		evloop_del(link->loop, link->ttyfile);
+		if(link->transport == 0)
+			tcsetattr(link->ttyfile, TCSANOW, &link->oldsettings); // put old tty port setting back, fails harmlessly when the device is gone
+		close(link->ttyfile);
+	}
+	if(link->timerfd >= 0)
+		evtimer_arm_ms(link->timerfd, 0);
+	link->ttyfile = -1;
+	link->ready = false;
+
+	for(i = 0; i < link->num_gauges; i++)
+	{
+		if(link->gauges[i]->timerfd >= 0)
+			evtimer_arm_ms(link->gauges[i]->timerfd, 0);
+		link->gauges[i]->state = GAUGE_CLOSED;
+	}
+}
+
+// schedule the next open attempt, the delay doubles after every failed attempt
+static void link_retry(struct link_t *link)
+{
+	char message_buffer[256];
+
+	sprintf(message_buffer, "Retrying in %d seconds", link->backoff / 1000);
+	link_log(link, message_buffer);
+
+	evtimer_arm_ms(link->timerfd, link->backoff);
+	link->backoff *= 2;
+	if(link->backoff > LINKBACKOFFMAX)
+		link->backoff = LINKBACKOFFMAX;
+}
+
+// device disappeared, hung up or the bridge dropped the connection. reconnect with backoff
+void link_lost(struct link_t *link, char *message)
+{
+	link_log(link, message);
+	link_trace_dump(link, message, false);
+	link_down(link);
+	link_retry(link);
+}
+
+// start connecting to a serial bridge, gauges start once the connection is up. returns 0 on success, > 0 to retry
+static int link_connect(struct link_t *link)
+{
+	char message_buffer[256];
+
+	if((link->ttyfile = fdnet_connect(link->host, link->port)) < 0)
+	{
+		sprintf(message_buffer, "Error connecting to serial bridge: %s", strerror(errno));
+		link_log(link, message_buffer);
+		return 1;
+	}
+
+	fdnet_keepalive(link->ttyfile, FDNET_KEEPIDLE, FDNET_KEEPINTVL, FDNET_KEEPCNT);
+	telnet_init(&link->telnet);
+	xbee_parser_init(&link->parser);
+
+	if(evloop_add(link->loop, link->ttyfile, EPOLLIN | EPOLLOUT, link_on_read, link) < 0) // writable once connected
+	{
+		link_log(link, "Error adding serial bridge to event loop");
+		close(link->ttyfile);
+		link->ttyfile = -1;
+		return -1;
+	}
+	evtimer_arm_ms(link->timerfd, CONNECTDEADLINE);
+
+	return 0;
+}
+
+// non-blocking connect has finished, start the gauges when it succeeded
+static void link_connected(struct link_t *link)
+{
+	char message_buffer[256];
+	uint8_t setup[128];
+	int err = 0;
+
+	evtimer_arm_ms(link->timerfd, 0);
+
+	if((err = fdnet_connect_result(link->ttyfile)) != 0)
+	{
+		sprintf(message_buffer, "Error connecting to serial bridge: %s", strerror(err));
+		link_lost(link, message_buffer);
+		return;
+	}
+
+	evloop_mod(link->loop, link->ttyfile, EPOLLIN);
+
+	if(link->transport == FDNET_RFC2217)
+		trace_add(&link->trace, TRACE_TX, TRACE_NOCHANNEL, setup, rfc2217_setup(setup, TTYBAUDRATE), trace_now_us());
+	if(link->transport == FDNET_RFC2217 && fdwrite_all(link->ttyfile, setup, rfc2217_setup(setup, TTYBAUDRATE), TTYWRITETIMEOUT, false, &link->io) < 0)
+	{
+		link_lost(link, "Error sending serial port settings to serial bridge");
+		return;
+	}
+
+	link_log(link, "Connected to serial bridge");
+	link_up(link);
+}
+
+// open and setup the tty device. returns 0 on success, > 0 to retry, -1 on errors retrying won't fix
+static int link_open_tty(struct link_t *link)
+{
+	char message_buffer[256];
+	int set_tty_error_code = 0;
+
+	link->ttyfile = open(link->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(link->ttyfile < 0 || !isatty(link->ttyfile))
+	{
+		if(link->ttyfile < 0 && errno == ENOENT)
+			link_log(link, "Device not present"); // log lines already start with the device name
+		else
+			link_log(link, "Not a tty");
+		if(link->ttyfile >= 0)
+			close(link->ttyfile);
+		link->ttyfile = -1;
+		return 1;
+	}
+
+	tcgetattr(link->ttyfile, &link->oldsettings); // save old tty settings
+
+	// set tty port
+	if((set_tty_error_code = set_tty_port(link->ttyfile, link->device, link->myname, link->config->log_file_name, link->config->write_log)))
+	{
+		sprintf(message_buffer, "Error setting serial port: %d", set_tty_error_code);
+		link_log(link, message_buffer);
+		close(link->ttyfile);
+		link->ttyfile = -1;
+		return 2;
+	}
+
+	tcflush(link->ttyfile, TCIOFLUSH);
+	xbee_parser_init(&link->parser);
+
+	if(evloop_add(link->loop, link->ttyfile, EPOLLIN, link_on_read, link) < 0)
+	{
+		link_log(link, "Error adding tty device to event loop");
+		close(link->ttyfile);
+		link->ttyfile = -1;
+		return -1;
+	}
+
+	link_up(link);
+
+	return 0;
+}
+
+// one open or connect attempt, schedules the next one when it fails
+static void link_reopen(struct link_t *link)
+{
+	int rc = 0;
+
+	if(link->ttyfile >= 0) // already open or connecting
+		return;
+
+	rc = link->transport != 0 ? link_connect(link) : link_open_tty(link);
+	if(rc != 0)
+		link_retry(link);
+}
+
+// watch the directory of a tty device for its node to be removed and created again,
+// e.g. when the USB XBee adapter is unplugged or re-enumerated
+static int link_watch(struct link_t *link)
+{
+	char dir[FILENAME_MAX];
+	char *slash = NULL;
+
+	strcpy(dir, link->device);
+	if((slash = strrchr(dir, '/')) == NULL)
+		strcpy(dir, ".");
+	else if(slash == dir)
+		dir[1] = NUL;
+	else
+		*slash = NUL;
+
+	if((link->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+
+	if(inotify_add_watch(link->watchfd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0 || evloop_add(link->loop, link->watchfd, EPOLLIN, link_on_watch, link) < 0)
+	{
+		close(link->watchfd);
+		link->watchfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+// open the tty device or connect to the serial bridge and keep it open. when that fails or the link
+// is lost later on it is retried with exponential backoff. returns 0 on success or when a retry is
+// scheduled, -1 on errors
+int link_open(struct link_t *link)
+{
+	int rc = 0;
+
+	if(link->timerfd >= 0) // opened for an earlier gauge on the same link
+		return 0;
+
+	if((link->timerfd = evtimer_create()) < 0 || evloop_add(link->loop, link->timerfd, EPOLLIN, link_on_timer, link) < 0)
+	{
+		link_log(link, "Error creating link timer");
+		return -1;
+	}
+	link->backoff = LINKBACKOFFMIN;
+
+	if(link->transport == 0 && link_watch(link) < 0) // reopening still works, just on the backoff timer alone
+		link_log(link, "Error watching for device hotplug");
+
+	if((rc = link->transport != 0 ? link_connect(link) : link_open_tty(link)) < 0)
+		return -1;
+	if(rc > 0)
+		link_retry(link);
+
+	return 0;
+}
+
+// put old tty port settings back and close tty device or connection, all gauges on the link are stopped
+void link_close(struct link_t *link)
+{
+	link_down(link);
+
+	if(link->watchfd >= 0)
+	{
+		evloop_del(link->loop, link->watchfd);
+		close(link->watchfd);
+	}
+	link->watchfd = -1;
+}
+
+// close all links
+void link_close_all(void)
+{
+	int i = 0;
+
+	for(i = 0; i < num_links; i++)
+	{
+		link_close(&links[i]);
+		trace_free(&links[i].trace);
+	}
+}
+
+// write len bytes from gauge g to its sensor, in API mode wrapped in one TX request frame.
+// drain waits until a tty has transmitted everything. returns len, -1 on error
+ssize_t link_write(struct link_t *link, struct gauge_t *g, const char *buf, size_t len, boolean drain)
+{
+	uint8_t frame[XBEE_MAXENCODED];
+	uint8_t escaped[2 * XBEE_MAXENCODED];
+	const uint8_t *out = (const uint8_t *)buf;
+	size_t n = len;
+
+	if(link->ttyfile < 0 || !link->ready)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if(link->mode == LINK_XBEE_API)
+	{
+		if(++link->frame_id == 0) // frame id 0 would suppress the TX status
+			link->frame_id = 1;
+
+		if((n = xbee_encode_tx(frame, link->frame_id, &g->addr, (const uint8_t *)buf, len)) == 0)
+		{
+			errno = EMSGSIZE;
+			return -1;
+		}
+		link->frame_gauge[link->frame_id] = g;
+		out = frame;
+	}
+
+	if(link->transport == FDNET_RFC2217)
+	{
+		if(n > XBEE_MAXENCODED)
+		{
+			errno = EMSGSIZE;
+			return -1;
+		}
+		n = telnet_escape(escaped, out, n);
+		out = escaped;
+	}
+
+	trace_add(&link->trace, TRACE_TX, g->link_index, out, n, trace_now_us());
+
+	if(fdwrite_all(link->ttyfile, out, n, TTYWRITETIMEOUT, drain && link->transport == 0, &link->io) < 0)
+		return -1;
+
+	return len;
+}
+
+// record a text note in the serial trace of link, channel is the gauge index or TRACE_NOCHANNEL
+void link_trace_note(struct link_t *link, int channel, const char *message)
+{
+	trace_add(&link->trace, TRACE_NOTE, channel, message, strlen(message), trace_now_us());
+}
+
+// dump the serial trace of link to TRACE_FILE_NAME.N for reason. errors dump at most every TRACEDUMPSECONDS so an
+// error storm doesn't keep rewriting the file, always dumps regardless
+void link_trace_dump(struct link_t *link, const char *reason, boolean always)
+{
+	char file_name[FILENAME_MAX + 16];
+	char message_buffer[FILENAME_MAX + 64];
+	uint64_t now = trace_now_us();
+
+	if(link->trace.buf == NULL)
+		return;
+	if(!always && link->dumped_us != 0 && now - link->dumped_us < TRACEDUMPSECONDS * 1000000ULL)
+		return;
+	if(!always)
+		link->dumped_us = now;
+
+	snprintf(file_name, sizeof(file_name), "%s.%d", link->config->trace_file_name, (int)(link - links));
+	if(trace_dump(&link->trace, file_name, link->device, reason, now) < 0)
+		snprintf(message_buffer, sizeof(message_buffer), "Can't write serial trace %s: %s", file_name, strerror(errno));
+	else
+		snprintf(message_buffer, sizeof(message_buffer), "Serial trace of %u records written to %s", link->trace.records, file_name);
+	link_log(link, message_buffer);
+}
+
+// dump the serial traces of all links, e.g. on SIGUSR1
+void link_trace_dump_all(const char *reason)
+{
+	int i = 0;
+
+	for(i = 0; i < num_links; i++)
+		link_trace_dump(&links[i], reason, true);
+}
+
+// log tty I/O counters of all links
+void link_log_io(void)
+{
+	char message_buffer[256];
+	int i = 0;
+
+	for(i = 0; i < num_links; i++)
+	{
+		sprintf(message_buffer, "tty I/O: %lu bytes in %lu writes, %lu bytes in %lu reads", links[i].io.tx_bytes, links[i].io.tx_syscalls, links[i].io.rx_bytes, links[i].io.rx_syscalls);
+		if(links[i].mode == LINK_XBEE_API)
+			sprintf(message_buffer + strlen(message_buffer), ", %lu API frames, %lu bad frames", links[i].parser.frames, links[i].parser.errors);
+		if(links[i].transport == FDNET_RFC2217)
+			sprintf(message_buffer + strlen(message_buffer), ", %lu telnet commands", links[i].telnet.commands);
+		link_log(&links[i], message_buffer);
+	}
+}
+
+// write the I/O counters of all links as Prometheus metrics, labelled with the link's device
+void link_write_stats(FILE *f)
+{
+	static const char *names[] = {"mhsdpi_link_tx_bytes_total", "mhsdpi_link_tx_syscalls_total", "mhsdpi_link_rx_bytes_total",
+		"mhsdpi_link_rx_syscalls_total", "mhsdpi_link_api_frames_total", "mhsdpi_link_bad_frames_total"};
+	static const char *help[] = {"Bytes written to the link.", "write(), poll() and tcdrain() calls on the link.", "Bytes read from the link.",
+		"read() calls on the link.", "XBee API frames received.", "Malformed XBee API frames received."};
+	char device[2 * FILENAME_MAX], labels[2 * FILENAME_MAX + 16];
+	unsigned long values[6];
+	int m = 0, i = 0;
+
+	for(m = 0; m < 6; m++)
+	{
+		metrics_header(f, names[m], "counter", help[m]);
+		for(i = 0; i < num_links; i++)
+		{
+			values[0] = links[i].io.tx_bytes;
+			values[1] = links[i].io.tx_syscalls;
+			values[2] = links[i].io.rx_bytes;
+			values[3] = links[i].io.rx_syscalls;
+			values[4] = links[i].parser.frames;
+			values[5] = links[i].parser.errors;
+			metrics_escape(device, sizeof(device), links[i].device);
+			snprintf(labels, sizeof(labels), "link=\"%s\"", device);
+			metrics_value(f, names[m], labels, values[m]);
+		}
+	}
+}
+
+// route one received API frame to its gauge, returns the gauge or NULL
+static struct gauge_t *link_frame(struct link_t *link, struct xbee_frame_t *frame)
+{
+	char message_buffer[256];
+	struct gauge_t *g = NULL;
+	int i = 0;
+
+	switch(frame->api_id)
+	{
+		case XBEE_RX64:
+		case XBEE_RX16:
+			for(i = 0; i < link->num_gauges; i++)
+				if(xbee_addr_equal(&link->gauges[i]->addr, &frame->addr))
+					g = link->gauges[i];
+
+			if(g == NULL)
+			{
+				sprintf(message_buffer, "Data from unknown XBee address %llx", (unsigned long long)frame->addr.addr);
+				link_log(link, message_buffer);
+			}
+			else if(fdring_put(&g->rx, (const char *)frame->data, frame->len) < frame->len)
+				gauge_log_level(g, LOGGER_WARNING, "Receive buffer overflow, data dropped");
+			break;
+
+		case XBEE_TXSTATUS:
+			if(frame->status != XBEE_TX_SUCCESS && (g = link->frame_gauge[frame->frame_id]) != NULL)
+			{
+				sprintf(message_buffer, "XBee could not deliver command, TX status %d", frame->status);
+				gauge_log(g, message_buffer);
+			}
+			g = NULL;
+			break;
+	}
+
+	return g;
+}
+
+// record the n bytes fdring_fill() put into ring r from tail on, they may wrap around its end
+static void link_trace_rx(struct link_t *link, const struct fdring_t *r, size_t tail, size_t n)
+{
+	char buf[FDRING_SIZE];
+	size_t at = tail & FDRING_MASK;
+	size_t first = at + n > FDRING_SIZE ? FDRING_SIZE - at : n;
+
+	if(link->trace.buf == NULL)
+		return;
+
+	memcpy(buf, &r->buf[at], first);
+	memcpy(&buf[first], r->buf, n - first);
+	trace_add(&link->trace, TRACE_RX, 0, buf, n, trace_now_us());
+}
+
+// tty device or connection has data, was hung up or has finished connecting
+static void link_on_read(int fd, uint32_t events, void *ctx)
+{
+	struct link_t *link = (struct link_t *)ctx;
+	struct xbee_frame_t frame;
+	struct gauge_t *g = NULL;
+	boolean has_data[MAXGAUGES];
+	uint8_t buf[FDRING_SIZE];
+	uint8_t reply[TELNET_MAXREPLY];
+	size_t replylen = 0, tail = 0;
+	ssize_t n = 0, i = 0;
+
+	if(!link->ready && link->transport != 0) // connect finished, errors are reported by link_connected
+	{
+		link_connected(link);
+		if(!link->ready || !(events & EPOLLIN))
+			return;
+	}
+
+	if(events & (EPOLLHUP | EPOLLERR))
+	{
+		link_lost(link, link->transport == 0 ? "tty device hung up" : "Serial bridge closed the connection");
+		return;
+	}
+
+	if(link->mode == LINK_TRANSPARENT && link->transport != FDNET_RFC2217)
+	{
+		g = link->gauges[0];
+		tail = g->rx.tail;
+		if((n = fdring_fill(&g->rx, fd, &link->io)) > 0)
+			link_trace_rx(link, &g->rx, tail, n);
+		if(n == 0 && link->transport != 0) // everything available in one read
+		{
+			link_lost(link, "Serial bridge closed the connection");
+			return;
+		}
+		gauge_input(g);
+		return;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	link->io.rx_syscalls++;
+	if(n == 0 && link->transport != 0)
+	{
+		link_lost(link, "Serial bridge closed the connection");
+		return;
+	}
+	if(n <= 0)
+		return;
+	link->io.rx_bytes += n;
+	trace_add(&link->trace, TRACE_RX, link->mode == LINK_TRANSPARENT ? 0 : TRACE_NOCHANNEL, buf, n, trace_now_us());
+
+	if(link->transport == FDNET_RFC2217)
+	{
+		n = telnet_filter(&link->telnet, buf, n, reply, &replylen);
+		if(replylen > 0)
+		{
+			trace_add(&link->trace, TRACE_TX, TRACE_NOCHANNEL, reply, replylen, trace_now_us());
+			fdwrite_all(fd, reply, replylen, TTYWRITETIMEOUT, false, &link->io);
+		}
+	}
+
+	if(link->mode == LINK_TRANSPARENT)
+	{
+		g = link->gauges[0];
+		if(fdring_put(&g->rx, (const char *)buf, n) < (size_t)n)
+			gauge_log_level(g, LOGGER_WARNING, "Receive buffer overflow, data dropped");
+		gauge_input(g);
+		return;
+	}
+
+	memset(has_data, 0, sizeof(has_data));
+	for(i = 0; i < n; i++)
+	{
+		if(xbee_parse_byte(&link->parser, buf[i]) == 1 && xbee_decode(&link->parser, &frame) == 0 && (g = link_frame(link, &frame)) != NULL)
+			has_data[g->link_index] = true;
+	}
+
+	for(i = 0; i < link->num_gauges; i++) // payloads may complete lines of several gauges
+		if(has_data[i])
+			gauge_input(link->gauges[i]);
+}
+
+// connect deadline expired or it is time for the next open attempt
+static void link_on_timer(int fd, uint32_t events, void *ctx)
+{
+	struct link_t *link = (struct link_t *)ctx;
+
+	evtimer_ack(fd);
+
+	if(link->ttyfile >= 0 && !link->ready)
+		link_lost(link, "Timed out connecting to serial bridge");
+	else
+		link_reopen(link);
+}
+
+// the directory of the tty device has changed
+static void link_on_watch(int fd, uint32_t events, void *ctx)
+{
+	struct link_t *link = (struct link_t *)ctx;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev = NULL;
+	const char *name = strrchr(link->device, '/');
+	ssize_t n = 0, i = 0;
+
+	name = name != NULL ? name + 1 : link->device;
+
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for(i = 0; i < n; i += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *)&buf[i];
+			if(ev->len == 0 || strcmp(ev->name, name) != 0)
+				continue;
+
+			if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			{
+				if(link->ttyfile >= 0) // some USB serial drivers don't hang up open fds right away
+					link_lost(link, "Device removed");
+			}
+			else if(link->ttyfile < 0) // device node (re)appeared, give udev a moment to set it up
+			{
+				link_log(link, "Device appeared");
+				link->backoff = LINKBACKOFFMIN;
+				evtimer_arm_ms(link->timerfd, LINKHOTPLUGSETTLE);
+			}
+		}
+	}
+}
@@ -0,0 +1,366 @@
+/*
+
+	logger.c
+
+	buffered log file with levels, deduplication, rate limiting and size based rotation
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+// set up logger l, no file is opened before the first message
+void logger_init(struct logger_t *l, int level, off_t max_size, int keep, uint32_t flush_ms, uint32_t dedup_ms, uint32_t per_minute)
+{
+	memset(l, 0, sizeof(*l));
+	l->fd = -1;
+	l->mirror_fd = STDERR_FILENO;
+	l->level = level;
+	l->max_size = max_size;
+	l->keep = keep;
+	l->flush_ms = flush_ms;
+	l->dedup_ms = dedup_ms;
+	l->rate = per_minute;
+	l->tokens = per_minute;
+}
+
+// LOGGER_* for a level name (error, warning, info, debug), -1 for an unknown one
+int logger_level(const char *name)
+{
+	if(strcmp(name, "error") == 0)
+		return LOGGER_ERROR;
+	if(strcmp(name, "warning") == 0)
+		return LOGGER_WARNING;
+	if(strcmp(name, "info") == 0)
+		return LOGGER_INFO;
+	if(strcmp(name, "debug") == 0)
+		return LOGGER_DEBUG;
+
+	return -1;
+}
+
+// severity of a message from its wording for callers that don't pass one: errors start with Error or Can't,
+// optionally after a "device: " prefix, everything else is info
+int logger_classify(const char *message)
+{
+	const char *text = strstr(message, ": ");
+
+	if(strncmp(message, "Error", 5) == 0 || strncmp(message, "Can't", 5) == 0)
+		return LOGGER_ERROR;
+	if(text != NULL && (strncmp(text + 2, "Error", 5) == 0 || strncmp(text + 2, "Can't", 5) == 0))
+		return LOGGER_ERROR;
+
+	return LOGGER_INFO;
+}
+
+// FNV-1a of process and message, never 0
+static uint32_t message_hash(const char *process, const char *message)
+{
+	uint32_t h = 2166136261u;
+
+	for(; *process != '\0'; process++)
+		h = (h ^ (uint8_t)*process) * 16777619u;
+	for(; *message != '\0'; message++)
+		h = (h ^ (uint8_t)*message) * 16777619u;
+
+	return h | 1;
+}
+
+// rename name to name.1, name.1 to name.2, ... dropping the oldest, and start a new file
+static void rotate(struct logger_t *l)
+{
+	char from[FILENAME_MAX + 16], to[FILENAME_MAX + 16];
+	int i = 0;
+
+	close(l->fd);
+	l->fd = -1;
+
+	for(i = l->keep; i > 1; i--)
+	{
+		snprintf(from, sizeof(from), "%s.%d", l->name, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", l->name, i);
+		rename(from, to);
+	}
+	if(l->keep > 0)
+	{
+		snprintf(to, sizeof(to), "%s.1", l->name);
+		rename(l->name, to);
+	}
+	else
+		unlink(l->name);
+}
+
+// open the log file when it isn't or was renamed by someone else's rotation, rotating it when the buffered lines
+// would take it past its size limit
+static int open_file(struct logger_t *l)
+{
+	struct stat st, named;
+
+	if(l->fd >= 0 && (stat(l->name, &named) < 0 || fstat(l->fd, &st) < 0 || named.st_ino != st.st_ino || named.st_dev != st.st_dev))
+	{
+		close(l->fd);
+		l->fd = -1;
+	}
+
+	if(l->fd >= 0 && l->max_size > 0 && l->size > 0 && l->size + (off_t)l->used > l->max_size)
+		rotate(l);
+
+	if(l->fd >= 0)
+		return 0;
+
+	if((l->fd = open(l->name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+		return -1;
+	l->size = fstat(l->fd, &st) == 0 ? st.st_size : 0;
+
+	if(l->max_size > 0 && l->size > 0 && l->size + (off_t)l->used > l->max_size) // left full by the previous run
+	{
+		rotate(l);
+		return open_file(l);
+	}
+
+	return 0;
+}
+
+// write the buffered lines with one write(). returns 0 on success, -1 on error (errno set), the lines are dropped either way
+static int write_buffer(struct logger_t *l)
+{
+	size_t done = 0;
+	ssize_t n = 0;
+	int rc = 0;
+
+	if(l->used == 0)
+		return 0;
+
+	if(l->mirror_fd >= 0)
+		(void)!write(l->mirror_fd, l->buf, l->used); // nobody reads stderr, a failed copy there is ignored
+
+	if(open_file(l) < 0)
+		rc = -1;
+
+	while(l->fd >= 0 && done < l->used)
+	{
+		if((n = write(l->fd, &l->buf[done], l->used - done)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			rc = -1;
+			break;
+		}
+		l->writes++;
+		done += n;
+	}
+
+	l->size += done;
+	if(rc == 0)
+		l->written += l->lines;
+	else
+		l->lost += l->lines;
+	l->used = 0;
+	l->lines = 0;
+	l->first_ms = 0;
+
+	return rc;
+}
+
+// refill the rate limit tokens. returns 1 when a line may be written and takes its token
+static int take_token(struct logger_t *l, uint64_t now_ms)
+{
+	if(l->rate <= 0)
+		return 1;
+
+	l->tokens += (now_ms - l->refilled_ms) * l->rate / 60000.0;
+	if(l->tokens > l->rate)
+		l->tokens = l->rate;
+	l->refilled_ms = now_ms;
+
+	if(l->tokens < 1)
+		return 0;
+
+	l->tokens -= 1;
+	return 1;
+}
+
+// format and buffer one line, the timestamp is formatted once per second
+static void add_line(struct logger_t *l, const char *process, const char *message, uint64_t now_ms)
+{
+	char line[LOGGER_MAXLINE];
+	time_t t = time(NULL);
+	struct tm local;
+	int len = 0;
+
+	if(t != l->stamp_time)
+	{
+		localtime_r(&t, &local);
+		strftime(l->stamp, sizeof(l->stamp), "%d.%m.%Y %T", &local);
+		l->stamp_time = t;
+	}
+
+	if((len = snprintf(line, sizeof(line), "%s (%s): %s.\n", process, l->stamp, message)) < 0)
+		return;
+	if(len >= (int)sizeof(line)) // cut off, keep line framing
+	{
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+
+	if(l->used + len > LOGGER_BUFSIZE)
+		write_buffer(l);
+
+	memcpy(&l->buf[l->used], line, len);
+	l->used += len;
+	if(l->lines++ == 0)
+		l->first_ms = now_ms;
+}
+
+// log how many lines the rate limit dropped since the last report
+static void emit_limited(struct logger_t *l, const char *process, uint64_t now_ms)
+{
+	char notice[64];
+
+	snprintf(notice, sizeof(notice), "%lu messages dropped by the log rate limit", l->limited);
+	add_line(l, process, notice, now_ms);
+	l->limited = 0;
+}
+
+// buffer a line subject to the rate limit, reporting the lines it dropped once lines get through again
+static void emit(struct logger_t *l, const char *process, const char *message, uint64_t now_ms)
+{
+	if(!take_token(l, now_ms))
+	{
+		l->limited++;
+		strncpy(l->limited_process, process, sizeof(l->limited_process) - 1);
+		return;
+	}
+
+	if(l->limited > 0)
+		emit_limited(l, process, now_ms);
+
+	add_line(l, process, message, now_ms);
+}
+
+// log how often the message of slot came again since it was written
+static void emit_repeats(struct logger_t *l, struct logger_slot_t *slot, uint64_t now_ms)
+{
+	char message[LOGGER_MAXMESSAGE + 64];
+
+	snprintf(message, sizeof(message), "%s (repeated %lu times in %lu s)", slot->message, slot->repeats, (unsigned long)((now_ms - slot->first_ms) / 1000));
+	add_line(l, slot->process, message, now_ms);
+	slot->repeats = 0;
+}
+
+// dedup slot of a message, a new one takes the free or least recently written slot, logging its repeat count
+static struct logger_slot_t *find_slot(struct logger_t *l, uint32_t hash, int *found, uint64_t now_ms)
+{
+	struct logger_slot_t *oldest = &l->slots[0];
+	int i = 0;
+
+	*found = 0;
+	for(i = 0; i < LOGGER_DEDUPSLOTS; i++)
+	{
+		if(l->slots[i].hash == hash)
+		{
+			*found = 1;
+			return &l->slots[i];
+		}
+		if(l->slots[i].hash == 0 || (oldest->hash != 0 && l->slots[i].first_ms < oldest->first_ms))
+			oldest = &l->slots[i];
+	}
+
+	if(oldest->repeats > 0)
+		emit_repeats(l, oldest, now_ms);
+
+	return oldest;
+}
+
+// log message of process at level to file_name at CLOCK_MONOTONIC now_ms, writing the batch when the buffer is full
+void logger_write(struct logger_t *l, const char *file_name, int level, const char *process, const char *message, uint64_t now_ms)
+{
+	struct logger_slot_t *slot = NULL;
+	uint32_t hash = 0;
+	int found = 0;
+
+	if(level > l->level)
+		return;
+
+	if(strcmp(file_name, l->name) != 0) // callers pass the file name with every message
+	{
+		write_buffer(l);
+		if(l->fd >= 0)
+			close(l->fd);
+		l->fd = -1;
+		strncpy(l->name, file_name, sizeof(l->name) - 1);
+	}
+
+	if(l->dedup_ms > 0)
+	{
+		hash = message_hash(process, message);
+		slot = find_slot(l, hash, &found, now_ms);
+		if(found && now_ms - slot->first_ms < l->dedup_ms)
+		{
+			slot->repeats++;
+			l->repeated++;
+			return;
+		}
+		if(found && slot->repeats > 0)
+			emit_repeats(l, slot, now_ms);
+
+		slot->hash = hash;
+		slot->first_ms = now_ms;
+		slot->repeats = 0;
+		strncpy(slot->process, process, sizeof(slot->process) - 1);
+		strncpy(slot->message, message, sizeof(slot->message) - 1);
+	}
+
+	emit(l, process, message, now_ms);
+
+	if(l->used > LOGGER_BUFSIZE / 2)
+		write_buffer(l);
+}
+
+// write out the buffered lines and the repeat counts of messages whose dedup window ended. returns 0 on success, -1 on error (errno set)
+int logger_flush(struct logger_t *l, uint64_t now_ms)
+{
+	int i = 0;
+
+	for(i = 0; i < LOGGER_DEDUPSLOTS; i++)
+		if(l->slots[i].repeats > 0 && now_ms - l->slots[i].first_ms >= l->dedup_ms)
+			emit_repeats(l, &l->slots[i], now_ms);
+
+	return write_buffer(l);
+}
+
+// CLOCK_MONOTONIC ms logger_flush() is due, 0 when nothing is pending
+uint64_t logger_deadline(const struct logger_t *l)
+{
+	uint64_t next = l->lines > 0 ? l->first_ms + l->flush_ms : 0;
+	uint64_t end = 0;
+	int i = 0;
+
+	for(i = 0; i < LOGGER_DEDUPSLOTS; i++)
+		if(l->slots[i].repeats > 0 && ((end = l->slots[i].first_ms + l->dedup_ms) < next || next == 0))
+			next = end;
+
+	return next;
+}
+
+// write out everything including pending repeat and rate limit counts and close the file
+void logger_close(struct logger_t *l, uint64_t now_ms)
+{
+	int i = 0;
+
+	for(i = 0; i < LOGGER_DEDUPSLOTS; i++)
+		if(l->slots[i].repeats > 0)
+			emit_repeats(l, &l->slots[i], now_ms);
+	if(l->limited > 0)
+		emit_limited(l, l->limited_process, now_ms);
+	write_buffer(l);
+
+	if(l->fd >= 0)
+		close(l->fd);
+	l->fd = -1;
+}
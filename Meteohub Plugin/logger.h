@@ -0,0 +1,88 @@
+/*
+
+	logger.h
+
+	buffered log file: messages are formatted into a buffer and written with one write() per
+	batch to a file kept open, instead of opening and closing the file for every message. Messages
+	below the configured level are skipped, a message repeated within the dedup window is logged
+	once and counted, a token bucket limits the lines per minute during error storms, and the file
+	is rotated (name.1, name.2, ...) when it reaches its size limit.
+
+*/
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+// defines
+#define LOGGER_BUFSIZE 16384
+#define LOGGER_MAXLINE 1024
+#define LOGGER_DEDUPSLOTS 16	// distinct recent messages tracked for deduplication
+#define LOGGER_MAXMESSAGE 256	// message text kept per dedup slot for its repeat summary
+
+// severity levels, lower is more severe
+#define LOGGER_ERROR 0
+#define LOGGER_WARNING 1
+#define LOGGER_INFO 2
+#define LOGGER_DEBUG 3
+
+// structs
+struct logger_slot_t
+{
+	uint32_t hash;					// of the message text, 0 = free
+	uint64_t first_ms;				// CLOCK_MONOTONIC ms the message was last written
+	unsigned long repeats;			// times it came again since then
+	char process[64];
+	char message[LOGGER_MAXMESSAGE];
+};
+
+struct logger_t
+{
+	char name[FILENAME_MAX];		// log file, empty = none yet
+	int fd;
+	int mirror_fd;					// lines are copied here too, -1 = none
+	int level;						// messages above this level are skipped
+	off_t size;						// of the log file
+	off_t max_size;					// rotate when reached, 0 = never
+	int keep;						// rotated files kept
+	uint32_t flush_ms;				// max ms a line stays buffered
+	uint32_t dedup_ms;				// repeats of a message within this are counted, 0 = off
+	double rate;					// lines per minute, 0 = unlimited
+	double tokens;
+	uint64_t refilled_ms;
+	char buf[LOGGER_BUFSIZE];
+	size_t used;
+	int lines;						// buffered
+	uint64_t first_ms;				// CLOCK_MONOTONIC ms the oldest buffered line was added
+	time_t stamp_time;				// timestamp formatted once per second
+	char stamp[32];
+	struct logger_slot_t slots[LOGGER_DEDUPSLOTS];
+	unsigned long written;			// lines written
+	unsigned long writes;			// write() calls to the log file
+	unsigned long repeated;			// lines folded into repeat counts
+	unsigned long limited;			// lines dropped by the rate limit, not yet reported
+	char limited_process[64];		// of the last dropped line, the report is logged under it
+	unsigned long lost;				// lines lost to write errors
+};
+
+// set up logger l, no file is opened before the first message
+void logger_init(struct logger_t *l, int level, off_t max_size, int keep, uint32_t flush_ms, uint32_t dedup_ms, uint32_t per_minute);
+// LOGGER_* for a level name (error, warning, info, debug), -1 for an unknown one
+int logger_level(const char *name);
+// severity of a message from its wording for callers that don't pass one: errors start with Error or Can't,
+// optionally after a "device: " prefix, everything else is info
+int logger_classify(const char *message);
+// log message of process at level to file_name at CLOCK_MONOTONIC now_ms, writing the batch when the buffer is full
+void logger_write(struct logger_t *l, const char *file_name, int level, const char *process, const char *message, uint64_t now_ms);
+// write out the buffered lines and the repeat counts of messages whose dedup window ended. returns 0 on success, -1 on error (errno set)
+int logger_flush(struct logger_t *l, uint64_t now_ms);
+// CLOCK_MONOTONIC ms logger_flush() is due, 0 when nothing is pending
+uint64_t logger_deadline(const struct logger_t *l);
+// write out everything including pending repeat and rate limit counts and close the file
+void logger_close(struct logger_t *l, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+
+	metrics.c
+
+	latency histograms and Prometheus text exposition format output
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+const double metrics_bounds[METRICS_BUCKETS] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 15000, 30000, 60000};
+
+void histogram_add(struct histogram_t *h, double ms)
+{
+	int i = 0;
+
+	while(i < METRICS_BUCKETS && ms > metrics_bounds[i])
+		i++;
+
+	if(h->count == 0 || ms < h->min)
+		h->min = ms;
+	if(ms > h->max)
+		h->max = ms;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += ms;
+}
+
+// estimate of quantile q (0 to 1) in ms, interpolated within its bucket narrowed to the smallest and largest sample. 0 when empty
+double histogram_quantile(const struct histogram_t *h, double q)
+{
+	double rank = q * h->count, lower = 0, upper = 0;
+	unsigned long seen = 0;
+	int i = 0;
+
+	if(h->count == 0)
+		return 0;
+
+	for(i = 0; i <= METRICS_BUCKETS; i++)
+	{
+		if(seen + h->buckets[i] >= rank && h->buckets[i] > 0)
+		{
+			lower = i > 0 ? metrics_bounds[i - 1] : 0;
+			upper = i < METRICS_BUCKETS ? metrics_bounds[i] : h->max; // +Inf bucket ends at the largest sample
+			if(lower < h->min)
+				lower = h->min;
+			if(upper > h->max)
+				upper = h->max;
+			return lower + ((upper - lower) * (rank - seen) / h->buckets[i]);
+		}
+		seen += h->buckets[i];
+	}
+
+	return h->max;
+}
+
+void window_add(struct window_t *w, double ms, int64_t now_ms)
+{
+	w->at[w->count % METRICS_WINDOW] = now_ms;
+	w->samples[w->count++ % METRICS_WINDOW] = ms < 0 ? 0 : (uint32_t)(ms + 0.5);
+	w->sum += ms < 0 ? 0 : ms;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// copy the samples added at since_ms or later into sorted, smallest first. returns their number
+static size_t window_sorted(const struct window_t *w, int64_t since_ms, uint32_t sorted[METRICS_WINDOW])
+{
+	size_t kept = w->count < METRICS_WINDOW ? w->count : METRICS_WINDOW;
+	size_t i = 0, n = 0;
+
+	for(i = 0; i < kept; i++)
+		if(w->at[i] >= since_ms)
+			sorted[n++] = w->samples[i];
+
+	qsort(sorted, n, sizeof(sorted[0]), compare_samples);
+
+	return n;
+}
+
+// quantile q (0 to 1) of n sorted samples by nearest rank, 0 when there are none
+static double nearest_rank(const uint32_t *sorted, size_t n, double q)
+{
+	size_t rank = 0;
+
+	if(n == 0)
+		return 0;
+
+	rank = (size_t)(q * n + 0.999999); // ceil, 1 based
+	if(rank < 1)
+		rank = 1;
+	if(rank > n)
+		rank = n;
+
+	return sorted[rank - 1];
+}
+
+// quantile q (0 to 1) in ms of the samples added at since_ms or later by nearest rank, 0 when there are none
+double window_quantile(const struct window_t *w, double q, int64_t since_ms)
+{
+	uint32_t sorted[METRICS_WINDOW];
+
+	return nearest_rank(sorted, window_sorted(w, since_ms, sorted), q);
+}
+
+// copy in into out (len bytes) escaped as a Prometheus label value
+void metrics_escape(char *out, size_t len, const char *in)
+{
+	size_t n = 0;
+
+	for(; *in != '\0' && n + 3 < len; in++)
+	{
+		if(*in == '\\' || *in == '"')
+			out[n++] = '\\';
+		else if(*in == '\n')
+		{
+			out[n++] = '\\';
+			out[n++] = 'n';
+			continue;
+		}
+		out[n++] = *in;
+	}
+	out[n] = '\0';
+}
+
+// write the HELP and TYPE lines of metric name, type is counter, gauge or histogram
+void metrics_header(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// write one sample of metric name, labels is the inside of {} or empty
+void metrics_value(FILE *f, const char *name, const char *labels, double value)
+{
+	if(labels[0] != '\0')
+		fprintf(f, "%s{%s} %.15g\n", name, labels, value);
+	else
+		fprintf(f, "%s %.15g\n", name, value);
+}
+
+// write the _bucket, _sum and _count samples of histogram h in seconds
+void metrics_histogram(FILE *f, const char *name, const char *labels, const struct histogram_t *h)
+{
+	const char *sep = labels[0] != '\0' ? "," : "";
+	unsigned long cumulative = 0;
+	int i = 0;
+
+	for(i = 0; i < METRICS_BUCKETS; i++)
+	{
+		cumulative += h->buckets[i];
+		fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep, metrics_bounds[i] / 1000.0, cumulative);
+	}
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, h->count);
+
+	if(labels[0] != '\0')
+	{
+		fprintf(f, "%s_sum{%s} %.6f\n", name, labels, h->sum / 1000.0);
+		fprintf(f, "%s_count{%s} %lu\n", name, labels, h->count);
+	}
+	else
+	{
+		fprintf(f, "%s_sum %.6f\n", name, h->sum / 1000.0);
+		fprintf(f, "%s_count %lu\n", name, h->count);
+	}
+}
+
+// write the 0.5, 0.9 and 0.99 quantile samples in seconds of the window's samples added at since_ms or later,
+// and _sum and _count of all samples ever added so they only grow as Prometheus expects
+void metrics_summary(FILE *f, const char *name, const char *labels, const struct window_t *w, int64_t since_ms)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99};
+	const char *sep = labels[0] != '\0' ? "," : "";
+	uint32_t sorted[METRICS_WINDOW];
+	size_t n = window_sorted(w, since_ms, sorted);
+	size_t i = 0;
+
+	for(i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		fprintf(f, "%s{%s%squantile=\"%g\"} %.3f\n", name, labels, sep, quantiles[i], nearest_rank(sorted, n, quantiles[i]) / 1000.0);
+
+	if(labels[0] != '\0')
+	{
+		fprintf(f, "%s_sum{%s} %.3f\n", name, labels, w->sum / 1000.0);
+		fprintf(f, "%s_count{%s} %lu\n", name, labels, w->count);
+	}
+	else
+	{
+		fprintf(f, "%s_sum %.3f\n", name, w->sum / 1000.0);
+		fprintf(f, "%s_count %lu\n", name, w->count);
+	}
+}
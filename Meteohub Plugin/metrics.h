@@ -0,0 +1,63 @@
+/*
+
+	metrics.h
+
+	latency histograms with fixed bucket bounds and Prometheus text exposition format output, for
+	the node_exporter textfile collector or a one-shot dump. Histograms are recorded in ms and
+	written in seconds as Prometheus expects. A window of recent samples gives exact quantiles
+	where the bucket bounds are too coarse, written as a summary of the samples younger than a
+	maximum age.
+
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// defines
+#define METRICS_BUCKETS 14 // bucket upper bounds, plus one for +Inf
+#define METRICS_WINDOW 256 // recent samples a window keeps
+
+// structs
+struct histogram_t
+{
+	unsigned long buckets[METRICS_BUCKETS + 1];	// per bucket, not cumulative
+	unsigned long count;
+	double sum;						// ms
+	double min;						// ms
+	double max;						// ms
+};
+
+// ring of the last METRICS_WINDOW samples
+struct window_t
+{
+	uint32_t samples[METRICS_WINDOW];	// ms
+	int64_t at[METRICS_WINDOW];		// monotonic ms the sample was added
+	unsigned long count;			// samples added, the ring holds the last METRICS_WINDOW
+	double sum;						// ms of all samples added
+};
+
+// bucket upper bounds in ms, 5 ms to 60 s covers a serial reply to a timed out depth reading
+extern const double metrics_bounds[METRICS_BUCKETS];
+
+void histogram_add(struct histogram_t *h, double ms);
+// estimate of quantile q (0 to 1) in ms, interpolated within its bucket narrowed to the smallest and largest sample. 0 when empty
+double histogram_quantile(const struct histogram_t *h, double q);
+void window_add(struct window_t *w, double ms, int64_t now_ms);
+// quantile q (0 to 1) in ms of the samples added at since_ms or later by nearest rank, 0 when there are none
+double window_quantile(const struct window_t *w, double q, int64_t since_ms);
+
+// copy in into out (len bytes) escaped as a Prometheus label value
+void metrics_escape(char *out, size_t len, const char *in);
+// write the HELP and TYPE lines of metric name, type is counter, gauge or histogram
+void metrics_header(FILE *f, const char *name, const char *type, const char *help);
+// write one sample of metric name, labels is the inside of {} or empty
+void metrics_value(FILE *f, const char *name, const char *labels, double value);
+// write the _bucket, _sum and _count samples of histogram h in seconds
+void metrics_histogram(FILE *f, const char *name, const char *labels, const struct histogram_t *h);
+// write the 0.5, 0.9 and 0.99 quantile samples in seconds of the window's samples added at since_ms or later,
+// and _sum and _count of all samples ever added so they only grow as Prometheus expects
+void metrics_summary(FILE *f, const char *name, const char *labels, const struct window_t *w, int64_t since_ms);
+
+#endif
@@ -0,0 +1,505 @@
+/*
+
+	mhsdbench.c
+
+	end-to-end poll cycle benchmark: runs the plug-in against gaugesim once per fault-injection profile
+	and prints one JSON line per profile with the poll cycle latency, syscalls, CPU time and peak RSS.
+	Every profile runs in its own directory (out_dir/profile) with its own mhsdpi.conf, log, stats
+	file and gaugesim pty, the plug-in through a mhsdpi symlink there so it reads that mhsdpi.conf.
+	After warm_up seconds (startup and seed readings) the counters are taken as the baseline, after
+	seconds more the plug-in is stopped with SIGTERM and the difference is divided by the poll cycles
+	emitted in between.
+
+	  clean     gauge answers every command
+	  loss5     5% of the bytes the gauge sends are lost
+	  slowwake  the XBee link takes 800 ms to wake up for the first byte after an idle period
+	  dead      sensor doesn't answer, every ranging returns -5000
+	  flapping  USB adapter is unplugged for 3 s every 13 s
+
+	cycle_p50_ms and cycle_p99_ms are over the poll cycles of the measurement
+	(mhsdpi_poll_latency_recent_seconds with STATS_RECENT_SECONDS set to seconds, up to 256 cycles),
+	failed cycles included. tty_syscalls are write(), poll(), tcdrain() and read() calls on the link,
+	rw_syscalls are every read and write of the plug-in (/proc/pid/io syscr + syscw, log and output
+	files included), wakeups are epoll_wait() returns. cpu_ms_per_cycle is from /proc/pid/schedstat,
+	cpu_user_s and cpu_sys_s are seconds counted in clock ticks (/proc/pid/stat), peak_rss_kb is
+	ru_maxrss of the whole run. A profile whose gauge emits no poll cycle in the measurement is
+	reported with cycles 0, e.g. dead with a short run: seeding the readings window retries every
+	snow depth reading RETRY_COUNT times, so with the default RETRY_COUNT dead emits its first poll
+	cycle about 20 s after the start and needs warm_up + seconds of at least that.
+
+	usage: mhsdbench [-t seconds] [-w warm_up] [-s sleep_seconds] [-o out_dir] [-p mhsdpi] [-g gaugesim] [profile ...]
+	  -t seconds        measured time per profile, default 60
+	  -w warm_up        time before the measurement starts, default 10
+	  -s sleep_seconds  SLEEP_SECONDS of the plug-in, default 2
+	  -o out_dir        directory for the profile directories, default bench
+	  -p mhsdpi         plug-in to run, default ./mhsdpi
+	  -g gaugesim       simulator to run, default ./gaugesim
+	  profile           profiles to run, default all
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// defines
+#define MAXARGS 32
+#define LINKWAITMS 3000		// for gaugesim to create its pty link
+#define STOPWAITMS 10000	// for the plug-in to exit after SIGTERM
+
+// structs
+struct profile_t
+{
+	const char *name;
+	const char *args;		// gaugesim options on top of the common ones
+};
+
+// counters read at the start and the end of the measurement
+struct sample_t
+{
+	double cycles;
+	double tty_syscalls;
+	double wakeups;
+	double timeouts;
+	double retries;
+	double failures;
+	unsigned long long rw_syscalls;
+	unsigned long long cpu_ticks[2];	// user, system
+	unsigned long long cpu_ns;		// on CPU, the ticks are too coarse for a few ms per cycle
+};
+
+static const struct profile_t profiles[] =
+{
+	{"clean", ""},
+	{"loss5", "-x 5"},
+	{"slowwake", "-w 800"},
+	{"dead", "-d -5000"},
+	{"flapping", "-f 10:3"},
+};
+#define NUMPROFILES ((int)(sizeof(profiles) / sizeof(profiles[0])))
+
+// common gaugesim options: fast ranging so the cycle is the plug-in's, not the sensor's, and a fixed seed
+static const char *gaugesim_args = "-r 200 -a 10 -s 1";
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+// split args at spaces into argv from argv[*argc] on
+static void split_args(char *args, char *argv[], int *argc)
+{
+	char *save = NULL, *token = NULL;
+
+	for(token = strtok_r(args, " ", &save); token != NULL && *argc < MAXARGS - 1; token = strtok_r(NULL, " ", &save))
+		argv[(*argc)++] = token;
+	argv[*argc] = NULL;
+}
+
+// fork and exec argv in dir with stdout and stderr going to log_name, returns the pid or -1
+static pid_t spawn(char *argv[], const char *dir, const char *log_name)
+{
+	pid_t pid = 0;
+	int fd = -1;
+
+	if((pid = fork()) != 0)
+		return pid;
+
+	if(chdir(dir) < 0 || (fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		_exit(127);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+	execv(argv[0], argv);
+	_exit(127);
+}
+
+// remove the files a previous run left in dir, returns 0 on success, -1 on error
+static int clear_dir(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *e = NULL;
+	DIR *d = NULL;
+
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if((d = opendir(dir)) == NULL)
+		return -1;
+
+	while((e = readdir(d)) != NULL)
+		if(strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+		{
+			if(snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) < (int)sizeof(path))
+				unlink(path);
+		}
+
+	closedir(d);
+	return 0;
+}
+
+// read file_name into a NUL terminated buffer, NULL on error
+static char *read_file(const char *file_name)
+{
+	char *buf = NULL;
+	size_t len = 0, n = 0;
+	FILE *f = NULL;
+
+	if((f = fopen(file_name, "r")) == NULL)
+		return NULL;
+
+	do
+	{
+		if((buf = realloc(buf, len + 4096 + 1)) == NULL)
+			break;
+		len += (n = fread(buf + len, 1, 4096, f));
+	}
+	while(n == 4096);
+	fclose(f);
+
+	if(buf != NULL)
+		buf[len] = '\0';
+
+	return buf;
+}
+
+// sum (or with max the largest) of the samples of metric name in Prometheus text prom whose labels contain match
+static double prom_value(const char *prom, const char *name, const char *match, int max)
+{
+	size_t len = strlen(name);
+	const char *line = prom, *end = NULL, *value = NULL;
+	double total = 0, v = 0;
+
+	for(; line != NULL && *line != '\0'; line = end != NULL ? end + 1 : NULL)
+	{
+		end = strchr(line, '\n');
+		if(line[0] == '#' || strncmp(line, name, len) != 0 || (line[len] != '{' && line[len] != ' '))
+			continue;
+		if((value = memchr(line, ' ', end != NULL ? (size_t)(end - line) : strlen(line))) == NULL)
+			continue;
+		if(match[0] != '\0' && (strstr(line, match) == NULL || strstr(line, match) > value))
+			continue;
+
+		v = atof(value + 1);
+		if(!max)
+			total += v;
+		else if(v > total)
+			total = v;
+	}
+
+	return total;
+}
+
+// value of key in /proc/pid/io
+static unsigned long long proc_io(pid_t pid, const char *key)
+{
+	char file_name[64], line[128];
+	unsigned long long value = 0;
+	size_t len = strlen(key);
+	FILE *f = NULL;
+
+	snprintf(file_name, sizeof(file_name), "/proc/%d/io", (int)pid);
+	if((f = fopen(file_name, "r")) == NULL)
+		return 0;
+
+	while(fgets(line, sizeof(line), f) != NULL)
+		if(strncmp(line, key, len) == 0 && line[len] == ':')
+			value = strtoull(line + len + 1, NULL, 10);
+
+	fclose(f);
+	return value;
+}
+
+// user and system clock ticks of pid from /proc/pid/stat, returns 0 on success, -1 on error
+static int proc_cpu(pid_t pid, unsigned long long ticks[2])
+{
+	char file_name[64], buf[1024], *p = NULL;
+	FILE *f = NULL;
+	size_t n = 0;
+	int field = 0;
+
+	snprintf(file_name, sizeof(file_name), "/proc/%d/stat", (int)pid);
+	if((f = fopen(file_name, "r")) == NULL)
+		return -1;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	if((p = strrchr(buf, ')')) == NULL) // the command name may contain spaces
+		return -1;
+
+	for(field = 2; p != NULL && field < 14; field++) // utime and stime are fields 14 and 15
+		p = strchr(p + 1, ' ');
+	if(p == NULL || sscanf(p, " %llu %llu", &ticks[0], &ticks[1]) != 2)
+		return -1;
+
+	return 0;
+}
+
+// ns pid ran on a CPU from /proc/pid/schedstat, 0 when it isn't there
+static unsigned long long proc_runtime(pid_t pid)
+{
+	char file_name[64];
+	unsigned long long ns = 0;
+	FILE *f = NULL;
+
+	snprintf(file_name, sizeof(file_name), "/proc/%d/schedstat", (int)pid);
+	if((f = fopen(file_name, "r")) == NULL)
+		return 0;
+	if(fscanf(f, "%llu", &ns) != 1)
+		ns = 0;
+
+	fclose(f);
+	return ns;
+}
+
+// take the counters of the stats file contents prom
+static void prom_sample(const char *prom, struct sample_t *s)
+{
+	s->cycles = prom_value(prom, "mhsdpi_poll_cycles_total", "", 0);
+	s->tty_syscalls = prom_value(prom, "mhsdpi_link_tx_syscalls_total", "", 0) + prom_value(prom, "mhsdpi_link_rx_syscalls_total", "", 0);
+	s->wakeups = prom_value(prom, "mhsdpi_event_loop_wakeups_total", "", 0);
+	s->timeouts = prom_value(prom, "mhsdpi_command_timeouts_total", "", 0);
+	s->retries = prom_value(prom, "mhsdpi_command_retries_total", "", 0);
+	s->failures = prom_value(prom, "mhsdpi_command_failures_total", "", 0);
+}
+
+// take the syscall and CPU counters of the running plug-in pid, returns 0 on success, -1 when it isn't running
+static int proc_sample(pid_t pid, struct sample_t *s)
+{
+	s->rw_syscalls = proc_io(pid, "syscr") + proc_io(pid, "syscw");
+	s->cpu_ns = proc_runtime(pid);
+
+	return proc_cpu(pid, s->cpu_ticks);
+}
+
+// wait up to ms for pid to exit, returns 0 when it did, -1 when it is still running
+static int wait_exit(pid_t pid, long ms, int *status, struct rusage *usage)
+{
+	pid_t rc = 0;
+
+	for(; (rc = wait4(pid, status, WNOHANG, usage)) == 0 && ms > 0; ms -= 50)
+		sleep_ms(50);
+
+	return rc == pid ? 0 : -1;
+}
+
+static void stop(pid_t pid)
+{
+	int status = 0;
+
+	kill(pid, SIGTERM);
+	if(wait_exit(pid, STOPWAITMS, &status, NULL) < 0)
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+	}
+}
+
+// run profile p for warm_up + seconds, print its JSON line. returns 0 on success, -1 on error
+static int run_profile(const struct profile_t *p, const char *out_dir, const char *plugin, const char *simulator,
+	int seconds, int warm_up, int sleep_seconds)
+{
+	char dir[PATH_MAX], link_name[PATH_MAX], prom_name[PATH_MAX], file_name[PATH_MAX], args[256];
+	char *argv[MAXARGS];
+	struct sample_t start, end;
+	struct rusage usage;
+	struct stat st;
+	double cycles = 0, ticks = sysconf(_SC_CLK_TCK), user = 0, sys = 0;
+	pid_t sim = -1, pid = -1;
+	char *prom = NULL;
+	int argc = 0, status = 0, waited = 0, rc = -1;
+	FILE *f = NULL;
+
+	if(snprintf(dir, sizeof(dir), "%s/%s", out_dir, p->name) >= (int)sizeof(dir) ||
+		snprintf(link_name, sizeof(link_name), "%s/ttyGauge", dir) >= (int)sizeof(link_name) ||
+		snprintf(prom_name, sizeof(prom_name), "%s/mhsdpi.prom", dir) >= (int)sizeof(prom_name) ||
+		snprintf(file_name, sizeof(file_name), "%s/mhsdpi", dir) >= (int)sizeof(file_name) - 5)
+	{
+		fprintf(stderr, "%s: %s is too long\n", p->name, out_dir);
+		return -1;
+	}
+
+	if(clear_dir(dir) < 0 || symlink(plugin, file_name) < 0 || (f = fopen(strcat(file_name, ".conf"), "w")) == NULL)
+	{
+		fprintf(stderr, "%s: can't set up %s: %s\n", p->name, dir, strerror(errno));
+		return -1;
+	}
+	// relative to the profile directory, .conf values end at the first space
+	fprintf(f, "DEVICE ./ttyGauge\nSLEEP_SECONDS %d\nREPLY_TIMEOUT 1\nSTATS_FILE_NAME ./mhsdpi.prom\nSTATS_SECONDS %d\nSTATS_RECENT_SECONDS %d\n",
+		sleep_seconds, warm_up, seconds);
+	fprintf(f, "LATEST_FILE_NAME none\nLATEST_SOCKET none\nTRACE_FILE_NAME ./trace\n");
+	fclose(f);
+
+	argv[argc++] = (char *)simulator;
+	argv[argc++] = "-l";
+	argv[argc++] = link_name;
+	snprintf(args, sizeof(args), "%s %s", gaugesim_args, p->args);
+	split_args(args, argv, &argc);
+	if((sim = spawn(argv, dir, "gaugesim.log")) < 0)
+	{
+		fprintf(stderr, "%s: can't start %s: %s\n", p->name, simulator, strerror(errno));
+		return -1;
+	}
+
+	for(waited = 0; lstat(link_name, &st) < 0 && waited < LINKWAITMS; waited += 50)
+		sleep_ms(50);
+	if(waited >= LINKWAITMS)
+	{
+		fprintf(stderr, "%s: %s didn't create %s\n", p->name, simulator, link_name);
+		stop(sim);
+		return -1;
+	}
+
+	argv[0] = "./mhsdpi"; // the plug-in reads argv[0].conf
+	argv[1] = "-L";
+	argv[2] = NULL;
+	if((pid = spawn(argv, dir, "mhsdpi.out")) < 0)
+	{
+		fprintf(stderr, "%s: can't start %s: %s\n", p->name, plugin, strerror(errno));
+		stop(sim);
+		return -1;
+	}
+
+	sleep_ms(warm_up * 1000L + 500); // the stats file is written every warm_up seconds, the first one is the baseline
+	memset(&start, 0, sizeof(start));
+	memset(&end, 0, sizeof(end));
+	if(proc_sample(pid, &start) < 0 || (prom = read_file(prom_name)) == NULL)
+	{
+		fprintf(stderr, "%s: %s isn't running or wrote no stats, see %s\n", p->name, plugin, dir);
+		goto done;
+	}
+	prom_sample(prom, &start);
+	free(prom);
+	prom = NULL;
+
+	sleep_ms(seconds * 1000L);
+	if(proc_sample(pid, &end) < 0) // before SIGTERM, shutting down isn't measured
+	{
+		fprintf(stderr, "%s: %s stopped, see %s\n", p->name, plugin, dir);
+		goto done;
+	}
+
+	kill(pid, SIGTERM); // the plug-in writes its stats file a last time
+	if(wait_exit(pid, STOPWAITMS, &status, &usage) < 0)
+	{
+		fprintf(stderr, "%s: %s didn't stop on SIGTERM\n", p->name, plugin);
+		goto done;
+	}
+	pid = -1;
+
+	if((prom = read_file(prom_name)) == NULL)
+	{
+		fprintf(stderr, "%s: can't read %s\n", p->name, prom_name);
+		goto done;
+	}
+	prom_sample(prom, &end);
+
+	cycles = end.cycles - start.cycles;
+	user = (end.cpu_ticks[0] - start.cpu_ticks[0]) / ticks;
+	sys = (end.cpu_ticks[1] - start.cpu_ticks[1]) / ticks;
+
+	printf("{\"profile\":\"%s\",\"seconds\":%d,\"sleep_seconds\":%d,\"cycles\":%.0f,\"cycle_p50_ms\":%.0f,\"cycle_p90_ms\":%.0f,\"cycle_p99_ms\":%.0f,",
+		p->name, seconds, sleep_seconds, cycles,
+		prom_value(prom, "mhsdpi_poll_latency_recent_seconds", "quantile=\"0.5\"", 1) * 1000,
+		prom_value(prom, "mhsdpi_poll_latency_recent_seconds", "quantile=\"0.9\"", 1) * 1000,
+		prom_value(prom, "mhsdpi_poll_latency_recent_seconds", "quantile=\"0.99\"", 1) * 1000);
+	printf("\"tty_syscalls_per_cycle\":%.2f,\"rw_syscalls_per_cycle\":%.2f,\"wakeups_per_cycle\":%.2f,",
+		cycles > 0 ? (end.tty_syscalls - start.tty_syscalls) / cycles : 0, cycles > 0 ? (end.rw_syscalls - start.rw_syscalls) / cycles : 0,
+		cycles > 0 ? (end.wakeups - start.wakeups) / cycles : 0);
+	printf("\"cpu_user_s\":%.2f,\"cpu_sys_s\":%.2f,\"cpu_ms_per_cycle\":%.3f,\"peak_rss_kb\":%ld,",
+		user, sys, cycles > 0 ? (end.cpu_ns - start.cpu_ns) / 1e6 / cycles : 0, usage.ru_maxrss);
+	printf("\"timeouts\":%.0f,\"retries\":%.0f,\"failures\":%.0f,\"exit_status\":%d}\n",
+		end.timeouts - start.timeouts, end.retries - start.retries, end.failures - start.failures,
+		WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+	fflush(stdout);
+	rc = 0; // no poll cycles is a result too, e.g. the dead sensor is still seeding its readings window
+
+done:
+	if(pid > 0)
+		stop(pid);
+	stop(sim);
+	free(prom);
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_dir = "bench", *plugin = "./mhsdpi", *simulator = "./gaugesim";
+	char plugin_path[PATH_MAX], simulator_path[PATH_MAX], out_path[PATH_MAX];
+	int seconds = 60, warm_up = 10, sleep_seconds = 2, opt = 0, i = 0, k = 0, failed = 0;
+
+	while((opt = getopt(argc, argv, "t:w:s:o:p:g:")) != -1)
+	{
+		switch(opt)
+		{
+			case 't': seconds = atoi(optarg); break;
+			case 'w': warm_up = atoi(optarg); break;
+			case 's': sleep_seconds = atoi(optarg); break;
+			case 'o': out_dir = optarg; break;
+			case 'p': plugin = optarg; break;
+			case 'g': simulator = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-t seconds] [-w warm_up] [-s sleep_seconds] [-o out_dir] [-p mhsdpi] [-g gaugesim] [profile ...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(seconds < 1 || warm_up < 1 || sleep_seconds < 1)
+	{
+		fprintf(stderr, "seconds, warm_up and sleep_seconds must be at least 1\n");
+		return 1;
+	}
+
+	for(k = optind; k < argc; k++)
+	{
+		for(i = 0; i < NUMPROFILES && strcmp(argv[k], profiles[i].name) != 0; i++)
+			;
+		if(i == NUMPROFILES)
+		{
+			fprintf(stderr, "unknown profile %s\n", argv[k]);
+			return 1;
+		}
+	}
+
+	// the plug-in runs in the profile directory, so the programs and directories are made absolute
+	if(mkdir(out_dir, 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "can't create %s: %s\n", out_dir, strerror(errno));
+		return 1;
+	}
+	if(realpath(plugin, plugin_path) == NULL || realpath(simulator, simulator_path) == NULL || realpath(out_dir, out_path) == NULL)
+	{
+		fprintf(stderr, "can't find %s, %s or %s: %s\n", plugin, simulator, out_dir, strerror(errno));
+		return 1;
+	}
+
+	for(i = 0; i < NUMPROFILES; i++)
+	{
+		for(k = optind; k < argc && strcmp(argv[k], profiles[i].name) != 0; k++)
+			;
+		if(optind < argc && k == argc)
+			continue;
+
+		fprintf(stderr, "%s: %d s warm-up, %d s measured\n", profiles[i].name, warm_up, seconds);
+		if(run_profile(&profiles[i], out_path, plugin_path, simulator_path, seconds, warm_up, sleep_seconds) < 0)
+			failed++;
+	}
+
+	return failed > 0 ? 1 : 0;
+}
@@ -32,19 +32,85 @@ Modified:	22-Sep-2014 by Fred Trimble ftt@smtcpa.com
 				Ver 2.0a added main loop exit via return codes propigated through sensor readings. To allow meteohub to restart plugin when comm errors occure.
 			18-Feb-2017 by Fred Trimble ftt@smtcpa.com
 				Ver 2.0b bug fixes in avarage amd moving average functions and initial sensor readings functions.
+			16-Oct-2026
+				Ver 2.1 poll any number of gauges (one DEVICE line per gauge) from one process using an epoll() event loop.
+				Each gauge is a non-blocking state machine (gauge.c) and outputs its own block of dataN ids.
+				Ver 2.2 replies are used as soon as they arrive instead of after fixed XBee catch-up delays,
+				REPLY_TIMEOUT sets the deadline for a reply.
+				Ver 2.3 snow depth, battery volts and charger status are read in one transaction, with PIPELINE_COMMANDS
+				commands are sent back to back and replies are matched by their command letter.
+				Ver 2.4 one XBee coordinator in API mode can serve many gauges, DEVICE tty_device@xbee_address
+				addresses each gauge's remote XBee.
+				Ver 2.5 DEVICE can be tcp://host:port or rfc2217://host:port to reach gauges through serial-over-IP bridges.
+				Ver 2.6 devices stay open, lost devices and connections are reopened with exponential backoff and tty
+				devices are reopened as soon as their node reappears. CLOSE_DEVICE is ignored. Fixed memory leak in set_tty_port.
+				Ver 2.7 comm errors no longer end the plug-in. A supervisor marks gauges degraded, reopens the link of a gauge
+				that stops answering and re-probes it, keeping the readings window and datum.
+				Ver 2.8 after a sensor restart the gauge is probed until it answers (RESTART_TIMEOUT upper bound)
+				instead of sleeping a fixed 2 minutes.
+				Ver 2.9 readings window statistics are kept incrementally in O(1) per reading, window size is set by READINGS_WINDOW.
+				Fixed integer division in the readings average.
+				Ver 3.0 snow depth readings pass through a configurable chain of outlier filters (FILTERS: stdev, median,
+				hampel, kalman) instead of reinitializing the readings window from the sensor when a reading is out of range.
+				Fixed the standard deviation rule rejecting every reading when the window holds identical readings.
+				Ver 3.1 READINGS_FILE_NAME holds a versioned, checksummed snapshot of the readings window with sample times,
+				filter state and datum, replaced atomically after each poll. A restarted plug-in resumes from a snapshot younger
+				than SNAPSHOT_MAX_AGE instead of taking new seed readings.
+				Ver 3.2 adaptive poll interval between POLL_MIN_SECONDS and POLL_MAX_SECONDS: gauges are polled at the floor while
+				snow depth is changing, back off while it is stable and go to the ceiling when the battery is low and not charging.
+				Ver 3.3 each reading has its own poll interval (BATTERY_SECONDS, CHARGER_SECONDS and the optional RANGE_SECONDS and
+				RSSI_SECONDS), readings due together are taken in one transaction. Polls are scheduled with absolute timers on
+				wall clock boundaries so they don't drift and DST changes don't stretch intervals.
+				Ver 3.4 polls start ahead of their boundary by the gauge's recent acquisition latency (p95 or average) and readings
+				are output at the boundary. Latency, lookahead and emit jitter are logged with the filter rejections.
+				Ver 3.5 every poll cycle is appended to a memory mapped history store (STORE_FILE_NAME.NNNNNN.tss segments):
+				raw, filtered and smoothed snow depth, battery volts, charger status, retries and error code.
+				Ver 3.6 hourly and daily snow depth rollups (STORE_FILE_NAME.hour.rlp, .day.rlp) are kept as readings arrive and
+				caught up from the history at start. mhsdquery queries and rebuilds them.
+				Ver 3.7 CSV, InfluxDB line protocol and JSON lines output files (CSV_FILE_NAME, INFLUX_FILE_NAME, JSONL_FILE_NAME)
+				with batched writes, SINK_BATCH, SINK_FLUSH_SECONDS and SINK_FSYNC.
+				Ver 3.8 latest readings of every gauge with their age, health and retries are published to a shared memory
+				file (LATEST_FILE_NAME) under per gauge sequence locks and answered on a Unix socket (LATEST_SOCKET), so local
+				readers get them without polling the gauge. mhsdquery -l reads the shared memory file.
+				Ver 3.9 the log file is kept open and written in batches instead of being opened and closed for every message.
+				Messages have levels (LOG_LEVEL), repeats are counted instead of logged (LOG_DEDUP_SECONDS), error storms are
+				rate limited (LOG_RATE) and a log of its own is rotated at LOG_MAX_KB. A log rotated by meteohub is reopened.
+				A log file that can't be opened no longer crashes.
+				Ver 4.0 reply latency histograms and sent, retry, timeout, failure and firmware error counters per command, poll
+				cycle latency, filter rejections and link I/O counters, written to a Prometheus text file (STATS_FILE_NAME) and
+				dumped by --stats after one poll cycle of every gauge.
+				Ver 4.1 serial flight recorder: a ring of the bytes sent and received on each link with microsecond times and
+				the log messages in between (TRACE_KB) is dumped to TRACE_FILE_NAME.N on errors and SIGUSR1, mhsdtrace prints it.
+				Ver 4.2 SIGTERM and SIGINT stop the plug-in cleanly: the log is flushed and the stats file written. Stats add
+				the cycle latency quantiles of the last 256 polls within STATS_RECENT_SECONDS, failed polls included, and the
+				event loop wakeups.
+				make bench runs the plug-in against gaugesim with fault-injection profiles and reports cycle latency, syscalls,
+				CPU time and peak RSS per poll cycle as JSON lines (mhsdbench).
 
 */
 
 // includes
+#include <getopt.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+
 #include "mhsdpi.h"
 
 // defines
 //#define DEBUG
-#define VERSION "2.0b"
-#define WAKEUPDELAY 10
-#define GETDEPTHREADINGDELAY 15
-#define TTYWRITETIMEOUT 500
-#define TTYREADTIMEOUT 500
+#define VERSION "4.2"
+
+static struct gauge_t gauges[MAXGAUGES];
+static int num_gauges = 0;
+static struct config_t config;
+static int stopping = 0;			// SIGTERM or SIGINT received
+static struct logger_t logger;		// log file shared by every message of the plug-in
+static int log_timerfd = -1;		// writes out batched log lines, -1 = each message is written at once
+static uint64_t log_armed = 0;		// CLOCK_MONOTONIC ms the log timer is armed for, 0 = not armed
+
+static void log_on_timer(int fd, uint32_t events, void *ctx);
+static void on_signal(int fd, uint32_t events, void *ctx);
+static void log_close(void);
 
 /*
 main program
@@ -57,23 +123,18 @@ int main (int argc, char *argv[])
 	strcpy(config_file_name, argv[0]);
 	strcat(config_file_name, ".conf");
 	static const char *optString = "BCd:h?Ls:t:";
-	int datum = 0;
-	int snowdepth = -1;
-	int chargerStatus = -1;
-	int snowdepth_sma = 0; // filtered Simple Moving Average snow depth
-	int batteryVolts = -1;
-	int readings[MAXREADINGS];
-	int new_average = 0;
-	uint32_t seconds_since_midnight = 0;
+	static const struct option longOpts[] = {{"stats", no_argument, NULL, 'S'}, {NULL, 0, NULL, 0}};
+	int64_t next_wake = 0;
 	int rc = 0;
-
-	struct config_t config;
-	struct termios oldsettings;
+	boolean device_args = false;
+	struct evloop_t loop;
+	sigset_t sigmask;
+	int sigfd = -1;
 
 	// set default values for command line/config options
 	config.restart_remote_sensor = false;
 	config.close_tty_file = false;
-	strcpy(config.device,"");
+	config.num_devices = 0;
 	config.write_log = false;
 	strcpy(log_file_name, argv[0]);
 	strcat(log_file_name,".log");
@@ -81,26 +142,59 @@ int main (int argc, char *argv[])
 	strcpy(readings_file_name, argv[0]);
 	strcat(readings_file_name, ".dat");
 	strcpy(config.readings_file_name, readings_file_name);
+	strcpy(config.store_file_name, argv[0]); // history segments go next to the plug-in as mhsdpi.000001.tss, ...
+	config.store_segment_records = STORESEGMENTRECORDS;
+	config.store_segments = 0; // keep all
+	config.store_sync_records = 12; // 1 hr at 5 minute polling
+	config.csv_file_name[0] = NUL; // output files off
+	config.influx_file_name[0] = NUL;
+	config.jsonl_file_name[0] = NUL;
+	config.sink_batch = 16;
+	config.sink_flush_seconds = 60;
+	config.sink_fsync = SINK_FSYNC_NONE;
+	strcpy(config.latest_file_name, "/dev/shm/mhsdpi.latest"); // tmpfs, nothing is written to the SD card
+	strcpy(config.latest_socket, "/tmp/mhsdpi.sock");
+	config.log_level = LOGGER_INFO;
+	config.log_max_kb = 0; // meteohub rotates its own log
+	config.log_files = 2;
+	config.log_flush_seconds = 2;
+	config.log_dedup_seconds = 600;
+	config.log_rate = 60;
+	config.stats_file_name[0] = NUL; // off
+	config.stats_seconds = 60;
+	config.stats_recent_seconds = 600;
+	config.stats_once = false;
+	strcpy(config.trace_file_name, "/tmp/mhsdpi.trace");
+	config.trace_kb = 16;
 	config.sleep_seconds = 3660; // 1 hr is default sleep time;
 	config.set_auto_datum = false;
 	config.manual_datum = 5000;  // 5000 mm is default mounting datum height of sensor
 	config.set_manual_datum = false;
 	config.stdev_filter = 6;
 	config.retry_count = 10;
+	config.reply_timeout = 0; // use per command default deadlines
+	config.pipeline_commands = false; // released firmware clears its input after each command
+	config.restart_timeout = RESTARTDELAY;
+	config.readings_window = MAXREADINGS;
+	strcpy(config.filters, "stdev");
+	config.filter_window = 5;
+	config.hampel_threshold = 3.0;
+	config.kalman_q = 25.0; // (5 mm)^2 per hour
+	config.kalman_r = 100.0; // (10 mm)^2
+	config.snapshot_max_age = 0; // twice the longest polling interval
+	config.poll_min_seconds = 0; // fixed polling interval
+	config.poll_max_seconds = 4 * 3600;
+	config.poll_slope_threshold = 10.0;
+	config.poll_stdev_threshold = 25.0;
+	config.poll_low_battery = 350; // 3.50 V
+	config.battery_seconds = 0; // with every snow depth poll
+	config.charger_seconds = 0;
+	config.range_seconds = 0; // off
+	config.rssi_seconds = 0;
 
-	int ttyfile;
-
-	uint32_t mh_data_id = 0;
 	int i = 0;
-	for(i = 0; i < MAXREADINGS; i++) // initilize readings history array elements to zero
-		readings[i] = 0;
-
-	const char mh_data_fmt[] = "data%d %d\n";
 
 	char *message_buffer;
-	char *message_buffer2;
-
-	int set_tty_error_code = 0;
 
 	// get cofig options
 	if(!get_configuration(&config, config_file_name))
@@ -109,7 +203,7 @@ int main (int argc, char *argv[])
 
 	// get command line options, will override values read from .conf file
 	int opt = 0;
-	while ((opt = getopt(argc, argv ,optString)) != -1)
+	while ((opt = getopt_long(argc, argv ,optString, longOpts, NULL)) != -1)
 	{
 		switch(opt)
 		{
@@ -120,7 +214,11 @@ int main (int argc, char *argv[])
 				config.close_tty_file = true;
 				break;
 			case 'd':
-				strcpy(config.device, optarg);
+				if(!device_args) // devices on the command line replace the ones from the .conf file
+					config.num_devices = 0;
+				device_args = true;
+				if(config.num_devices < MAXGAUGES)
+					strcpy(config.device[config.num_devices++], optarg);
 				break;
 			case 'D':
 				config.set_auto_datum = true;
@@ -139,13 +237,18 @@ int main (int argc, char *argv[])
 			case 't':
 				config.sleep_seconds = (uint16_t)atoi(optarg);
 				break;
+			case 'S':
+				config.stats_once = true;
+				break;
 
 		}
 	}
 
+	logger_init(&logger, config.log_level, (off_t)config.log_max_kb * 1024, config.log_files, config.log_flush_seconds * 1000, config.log_dedup_seconds * 1000, config.log_rate);
+	atexit(log_close); // buffered lines are written however the plug-in ends
+
 	message_buffer = (char *)malloc(sizeof(char) * 256);
-	message_buffer2 = (char *)malloc(sizeof(char) * 512);
-	if (message_buffer == NULL || message_buffer2 == NULL)
+	if (message_buffer == NULL)
 	{
 		fprintf(stderr, "can't allocate dynamic memory for buffers\n");
 		return -2;
@@ -157,215 +260,127 @@ int main (int argc, char *argv[])
 	else
 		fprintf(stderr, "%s.\n", message_buffer);
 
-	if(strlen(config.device) == 0) // can't run when no device is specified
+	if(config.num_devices == 0) // can't run when no device is specified
 	{
 		display_usage(argv[0]);
 		return -1;
 	}
 
-	ttyfile = open(config.device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	tcgetattr(ttyfile, &oldsettings); // save old tty settings
-	
-	if (!isatty(ttyfile))
+	if(config.readings_window < 1 || config.readings_window > MAXREADINGSWINDOW)
 	{
-		if(config.write_log)
-		{
-			sprintf(message_buffer, "%s is not a tty", config.device);
-			writelog(config.log_file_name, argv[0], message_buffer);
-		}
-		return 1;
+		sprintf(message_buffer, "READINGS_WINDOW must be 1 to %d, using %d", MAXREADINGSWINDOW, MAXREADINGS);
+		writelog(config.log_file_name, argv[0], message_buffer);
+		config.readings_window = MAXREADINGS;
 	}
-	// set tty port
-	if((set_tty_error_code = set_tty_port(ttyfile, config.device, argv[0], config.log_file_name, config.write_log)))
+
+	if(config.poll_min_seconds > 0 && config.poll_max_seconds < config.poll_min_seconds)
 	{
-		if(config.write_log)
-		{
-			sprintf(message_buffer, "Error setting serial port: %d", set_tty_error_code);
-			writelog(config.log_file_name, argv[0], message_buffer);
-		}
-		return 2;
+		sprintf(message_buffer, "POLL_MAX_SECONDS is below POLL_MIN_SECONDS, using %d", config.poll_min_seconds);
+		writelog(config.log_file_name, argv[0], message_buffer);
+		config.poll_max_seconds = config.poll_min_seconds;
 	}
 
-	tcflush(ttyfile, TCIOFLUSH);
+	if(config.close_tty_file) // links are kept open and reopened by the link manager when the device comes back
+		writelog_level(config.log_file_name, argv[0], LOGGER_WARNING, "CLOSE_DEVICE/-C is no longer needed and is ignored, devices are reopened after USB re-enumeration");
 
-	// restart remote sensor if called for
-	if(config.restart_remote_sensor)
+	if(evloop_init(&loop) < 0)
 	{
-		if(restart_sensor(ttyfile))
-			sprintf(message_buffer, "Issued remote restart of sensor command");
-		else
-			sprintf(message_buffer, "Remote restart of sensor failed");
-
-		if(config.write_log)
-			writelog(config.log_file_name, argv[0], message_buffer);
-
-		sleep(2*60); // delay to allow sensor to reboot and be ready to accept input
+		writelog(config.log_file_name, argv[0], "Error creating event loop");
+		return -2;
 	}
-	else
-		sleep(WAKEUPDELAY); // minimal delay to make sure sensor is ready
 
-	// log sensor firmware version
-	if(config.write_log)
-		print_firmware_version(ttyfile, config.log_file_name, argv[0]);
-
-	if(config.set_manual_datum && !config.set_auto_datum)
+	if((log_timerfd = evtimer_create()) < 0 || evloop_add(&loop, log_timerfd, EPOLLIN, log_on_timer, NULL) < 0)
 	{
-		if(config.manual_datum == set_manual_calibration_value(ttyfile, config.manual_datum))
-			sprintf(message_buffer, "Set sensor datum to: %d", config.manual_datum);
-		else
-			sprintf(message_buffer, "Set sensor datum failed");
-			
-		if(config.write_log)
-			writelog(config.log_file_name, argv[0], message_buffer);
+		writelog(config.log_file_name, argv[0], "Can't create log flush timer, log lines are written one by one");
+		if(log_timerfd >= 0)
+			close(log_timerfd);
+		log_timerfd = -1;
 	}
 
-	if(config.set_auto_datum && !config.set_manual_datum)
+	sigemptyset(&sigmask); // SIGUSR1 dumps the serial traces, SIGTERM and SIGINT stop the plug-in from the event loop
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGINT);
+	if(sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0 || (sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+		evloop_add(&loop, sigfd, EPOLLIN, on_signal, NULL) < 0)
 	{
-		datum = set_calibration_value(ttyfile, config.retry_count);
-		if(config.write_log)
-		{
-			sprintf(message_buffer, "Auto sensor datum set to: %d", datum);
-			writelog(config.log_file_name, argv[0], message_buffer);
-		}
+		writelog(config.log_file_name, argv[0], "Can't watch for signals, serial traces are only dumped on errors");
+		if(sigfd >= 0)
+			close(sigfd);
+		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
 	}
 
-	if(!config.set_auto_datum && !config.set_manual_datum)
+	for(i = 0; i < config.num_devices; i++) // gauges sharing a coordinator XBee share one link
 	{
-		datum = get_calibration_value(ttyfile, config.retry_count);
-		if(datum >= 0)
-		{
-			// log sensor datum value
-			if(config.write_log)
-			{
-				sprintf(message_buffer,"Datum value: %d", datum);
-				writelog(config.log_file_name, argv[0], message_buffer);
-			}
-		}
-		else
-			writelog(config.log_file_name, argv[0], "Error getting datum value from sensor");
+		if(gauge_init(&gauges[i], i, config.device[i], &config, argv[0], &loop) != 0 || link_attach(&gauges[i]) != 0)
+			return -1;
+		num_gauges++;
 	}
 
-	if(get_initial_sensor (readings, datum, ttyfile, config.retry_count) == 0)
-		writelog(config.log_file_name, argv[0], "Error getting initial sensor values");
-	else
-		write_array(readings, MAXREADINGS, config.readings_file_name);
-
-	seconds_since_midnight = get_seconds_since_midnight();
-
-	if(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds) > 0)
+	for(i = 0; i < num_gauges; i++)
 	{
-		sprintf(message_buffer, "Initial sleep: %d", config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds));
-		writelog(config.log_file_name, argv[0], message_buffer);
-		sleep(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds)); // start polling on an even boundry of the specified polling interval
+		if((rc = gauge_open(&gauges[i])) != 0)
+			return rc;
 	}
 
-	do // main plug-in loop
+	for(i = 0; i < num_gauges; i++)
 	{
-		mh_data_id = 0;
-
-		snowdepth = get_depth_value(ttyfile, config.retry_count); // read sensor value for snow depth via xBee Explorer on USB
-		batteryVolts = get_battery_voltage(ttyfile, config.retry_count); // read sensor value for battery volts via xBee Explorer on USB
-		chargerStatus = get_charger_status(ttyfile, config.retry_count); // read LiPo charger status
-
-		if(snowdepth >= 0)
-		{
-			new_average = (int)(average(readings, MAXREADINGS) + 0.5);
-			
-			if(snowdepth == datum)
-				snowdepth = new_average;
-
-			if(abs(snowdepth) >= ((config.stdev_filter * standard_deviation(readings, MAXREADINGS)) + abs(new_average))) // if the sample is more than config.stdev_filter standard deviations away from the average
-			{
-				writelog(config.log_file_name, argv[0],"Snow depth reading out of range. Reinitializing sensor");;
-				if(get_initial_sensor (readings, datum, ttyfile, config.retry_count) == 0)
-				{
-					writelog(config.log_file_name, argv[0], "Error getting initial sensor values");
-				}
-				new_average = (int)(average(readings, MAXREADINGS) + 0.5);
-				sprintf(message_buffer,"Snow depth: %d reading out of range per filtering rules. Using new average: %d", snowdepth, new_average);
-				writelog(config.log_file_name, argv[0],message_buffer);
-				snowdepth = new_average; // use the prior readings average
-			}
-
-			snowdepth_sma = (int)(moving_average(readings, MAXREADINGS, snowdepth) + 0.5); // smooth the sensor readings
-
-			write_array(readings, MAXREADINGS, config.readings_file_name);
-
-			fprintf(stdout, mh_data_fmt, mh_data_id++, snowdepth_sma * 100);
-			rc = 0;
-			//sprintf(message_buffer,"Snow depth reading: %d", snowdepth_sma);
-			//writelog(config.log_file_name, argv[0], message_buffer);
-		}
-		else
-		{
-			sprintf(message_buffer,"Error reading raw snow depth: %d", snowdepth);
-			writelog(config.log_file_name, argv[0], message_buffer);
-			mh_data_id++;
-			rc = -2;
-		}
+		gauge_queue_startup(&gauges[i]);
+		gauge_start(&gauges[i]);
+	}
 
-		if(batteryVolts >= 0)
-		{
-			fprintf(stdout, mh_data_fmt, mh_data_id++, batteryVolts); // battery voltage is already *100 comming from sensor
-			rc = 0;
-		}
-		else
-		{
-			sprintf(message_buffer,"Error reading raw battery volts: %d", batteryVolts);
-			writelog(config.log_file_name, argv[0], message_buffer);
-			mh_data_id++;
-			rc = -3;
-		}
+	if(outputs_init(&loop, &config, argv[0], gauges, num_gauges) < 0)
+	{
+		writelog(config.log_file_name, argv[0], "Error creating output flush timer");
+		return -2;
+	}
 
-		if(chargerStatus >= 0)
-		{
-			fprintf(stdout, mh_data_fmt, mh_data_id++, chargerStatus * 100);
-			rc = 0;
-		}
-		else
-		{
-			sprintf(message_buffer,"Error reading raw charger status: %d", chargerStatus);
-			writelog(config.log_file_name, argv[0], message_buffer);
-			mh_data_id++;
-			rc = -4;
-		}
+	if(stats_init(&loop, &config, argv[0], gauges, num_gauges) < 0)
+	{
+		writelog(config.log_file_name, argv[0], "Error creating stats timer");
+		return -2;
+	}
 
-		fflush(stdout);
+	if(sched_init(&loop, gauges, num_gauges) < 0) // start polling on even boundries of the polling intervals
+	{
+		writelog(config.log_file_name, argv[0], "Error creating poll scheduler timer");
+		return -2;
+	}
 
-		if(config.close_tty_file) // close tty file
-		{
-			tcsetattr(ttyfile, TCSANOW, &oldsettings); // put old tty port setting back
-			close(ttyfile);
-		}
+	next_wake = sched_next_wake();
+	sprintf(message_buffer, "Initial sleep: %lld", (long long)(next_wake - (get_wall_ms() / 1000)));
+	writelog(config.log_file_name, argv[0], message_buffer);
 
-		seconds_since_midnight = get_seconds_since_midnight();
-		sleep(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds)); // sleep just the right amount to keep on boundry
+	// main plug-in loop, comm errors are recovered from by the gauge supervisor and link manager, only
+	// unrecoverable faults end the plug-in
+	while(!stopping && !stats_done() && evloop_run_once(&loop, -1) >= 0)
+		;
 
-		if(config.close_tty_file) // open tty back up
-		{
-			ttyfile = open(config.device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-			tcgetattr(ttyfile, &oldsettings); // save old tty settings
-			// set tty port
-			if((set_tty_error_code = set_tty_port(ttyfile, config.device, argv[0], config.log_file_name, config.write_log)))
-			{
-				if(config.write_log)
-				{
-					sprintf(message_buffer,"Error setting serial port: %d", set_tty_error_code);
-					writelog(config.log_file_name, argv[0], message_buffer);
-				}
-				rc = -1;
-			}
-			else
-				rc = 0;
-
-			tcflush(ttyfile, TCIOFLUSH);
-		}
-		//read_array(readings, MAXREADINGS, readings_file_name); 
+	if(stopping)
+		writelog(config.log_file_name, argv[0], "Stopped by signal");
+	else if(stats_done())
+		stats_write(stderr);
+	else
+	{
+		writelog(config.log_file_name, argv[0], "Error waiting for events");
+		rc = -1;
 	}
-	while(rc >= 0);
 
-	tcsetattr(ttyfile, TCSANOW, &oldsettings); // put old tty port setting back
-	close(ttyfile);
+	for(i = 0; i < num_gauges; i++)
+	{
+		gauge_filter_report(&gauges[i]);
+		cadence_report(&gauges[i]);
+		sched_report(&gauges[i]);
+		gauge_close(&gauges[i]);
+	}
+	outputs_close();
+	stats_close();
+	link_log_io();
+	link_close_all();
+	sprintf(message_buffer, "Log: %lu lines in %lu writes, %lu repeats counted, %lu lost", logger.written, logger.writes, logger.repeated, logger.lost);
+	writelog(config.log_file_name, argv[0], message_buffer);
+	log_timerfd = -1; // closed with the event loop, the rest is written at exit
+	evloop_close(&loop);
 	free(message_buffer);
 
 	return rc;
@@ -375,30 +390,6 @@ int main (int argc, char *argv[])
 function bodies
 */
 
-// read sensor vaules into intial array used for sma smoothing
-int get_initial_sensor (int *values, int datum, int fd, uint16_t retry_count)
-{
-	int retval = 1;
-	int i = 0;
-	int depth = 0;
-	for(i = 0; i < MAXREADINGS; i++) // initilize the sma values array with current sensor readings
-	{
-		depth = get_depth_value(fd, retry_count);
-		if(depth >= 0 && depth != datum) // don't use error values
-			values[i] = depth;
-		else
-		{
-			depth = (int)(average(values, i + 1) + 0.5); // backfill sensor reading errors with average of prior readings
-			if(depth >= 0)
-				values[i] = depth;
-			else // error
-				retval = 0;
-		}
-	}
-	return retval;
-}
-
-
 // write array of int to a file 
 int write_array(const int *values, int n, char *filename)
 {
@@ -432,286 +423,11 @@ int read_array(int *values, int n, char *filename)
 	return retval;
 }
 
-// calculate the moving average of an array of n integer values with the addition of new_value
-// used to smooth snow depth readings
-float moving_average(int *values, int n, int new_value)
-{
-	int i = 0;;
-	for(i = 1; i < n; i++) // move old values over 1 slot
-		values[i - 1] = values[i];
-
-	values[n - 1] = new_value; // place new value into last slot
-
-	return(average(values, n)); // average of old values & new value
-}
-
-float average(const int *values, int n)
-{
-	int sum = 0;
-	int i = 0;
-	for(i = 0; i < n; i++)
-		sum += values[i];
-
-	return(sum / n);
-}
-
-// calculate standard deviation of an array of n integar values
-// used to filter out outlyer readings from snow depth sensor
-float standard_deviation(const int *values, int n)
-{
-	int i = 0;
-	float sum = 0;
-	float avg;
-
-	avg = average(values, n);
-
-	for(i = 0; i < n; i++)
-		sum += (values[i] - avg) * (values[i] - avg);
-
-	return sqrt(sum / n);
-}
-
-// read Snow Depth Sensor firmware version, 7 lines
-void print_firmware_version(int fd, char *logfilename, char *myname)
-{
-#define BUFSIZE 100
-	char buf[BUFSIZE];
-	int i = 0;
-	
-	tcflush(fd, TCIOFLUSH);
-	fdputc_poll(CMD_GET_ABOUT, fd, TTYWRITETIMEOUT);
-	sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-	for(i = 0; i < 7; i++)
-	{
-		memset(buf, NUL, sizeof(buf));
-		fdgets_poll(buf, sizeof(buf), fd, TTYREADTIMEOUT);
-#ifdef DEBUG
-		int j = 0;
-		for (j = 0; j < strlen(buf); j++)
-			fprintf(stderr, "%c - 0x%x\n", buf[j],  buf[j]);;
-#endif
-		if(strlen(buf) > 0)
-		{
-			buf[strlen(buf) - 1] = '\0'; // get rid of CR-LF at end of string
-			writelog(logfilename, myname, buf);
-		}
-	}
-}
-
-// read Snow Depth Sensor calibration height value
-int get_calibration_value(int fd, uint16_t retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-	do
-	{
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_GET_CALIBRATION, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-#ifdef DEBUG
-		int i = 0;
-		for (i = 0; i < strlen(message_buffer); i++)
-		fprintf(stderr, "%c - 0x%x\n", message_buffer[i],  message_buffer[i]);;
-#endif
-		if(message_buffer[0] == CMD_GET_CALIBRATION && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-
-	return retvalue;
-}
-
-// set auto Snow Depth Sensor calibration height value
-int set_calibration_value(int fd, uint16_t retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-
-	do
-	{
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_SET_CALIBRATE, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-#ifdef DEBUG
-		int i = 0;
-		for (i = 0; i < strlen(message_buffer); i++)
-			fprintf(stderr, "%c - 0x%x\n", message_buffer[i],  message_buffer[i]);;
-#endif
-		if(message_buffer[0] == CMD_SET_CALIBRATE && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		else if(message_buffer[0] == CMD_SET_CALIBRATE && message_buffer[1] == '-' && (message_buffer[2] >= '0' && message_buffer[2] <= '9'))
-			retvalue = -(((message_buffer[2] - '0') * 1000) + ((message_buffer[3] - '0') * 100) + ((message_buffer[4] - '0') * 10) + (message_buffer[5] - '0'));
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-	
-	return retvalue;
-}
-
-// manually set Snow Depth Sensor calibration value datum (aka mounting height above terra firma)
-int set_manual_calibration_value(int fd, int value)
-{
-	char message_buffer[7];
-	char command_buffer[7];
-	int retvalue = -1;
-
-	tcflush(fd, TCIOFLUSH);
-	memset(command_buffer, NUL, sizeof(command_buffer));
-	sprintf(command_buffer, "%c%04d\n", CMD_SET_MANUAL_CALIBRATE, value);
-	fdputs_poll(command_buffer, fd, TTYWRITETIMEOUT);
-	fsync(fd);
-	fdputc_poll(CMD_SET_MANUAL_CALIBRATE, fd, TTYWRITETIMEOUT);
-	memset(message_buffer, NUL, sizeof(message_buffer));
-	sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-	fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-#ifdef DEBUG
-	int i = 0;
-	for (i = 0; i < strlen(command_buffer); i++)
-		fprintf(stderr, "%c - 0x%x\n", command_buffer[i],  command_buffer[i]);;
-	for (i = 0; i < strlen(message_buffer); i++)
-		fprintf(stderr, "%c - 0x%x\n", message_buffer[i],  message_buffer[i]);;
-#endif
-	if(message_buffer[0] == CMD_SET_MANUAL_CALIBRATE && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-		retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		
-	return retvalue;
-}
-
-// read Snow Depth Sensor snow depth value
-int get_depth_value(int fd, int retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-	do
-	{
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_GET_DEPTH, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(GETDEPTHREADINGDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-		if(message_buffer[0] == CMD_GET_DEPTH && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-		{
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		}
-		else if(message_buffer[0] == CMD_GET_DEPTH && message_buffer[1] == '-' && (message_buffer[2] >= '0' && message_buffer[2] <= '9'))
-			retvalue = -(((message_buffer[2] - '0') * 1000) + ((message_buffer[3] - '0') * 100) + ((message_buffer[4] - '0') * 10) + (message_buffer[5] - '0'));
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-
-	return retvalue;
-}
-
-// read Snow Depth Sensor range value
-int get_range_value(int fd, uint16_t retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-	do
-	{
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_GET_RANGE, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-		if(message_buffer[0] == CMD_GET_RANGE && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		else if(message_buffer[0] == CMD_GET_RANGE && message_buffer[1] == '-' && (message_buffer[2] >= '0' && message_buffer[2] <= '9'))
-			retvalue = -(((message_buffer[2] - '0') * 1000) + ((message_buffer[3] - '0') * 100) + ((message_buffer[4] - '0') * 10) + (message_buffer[5] - '0'));
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-
-	return retvalue;
-}
-
-// read remote battery voltage
-int get_battery_voltage(int fd, int retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-	do
-	{
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_GET_VOLTAGE, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-		if(message_buffer[0] == CMD_GET_VOLTAGE && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-	
-	return retvalue;
-}
-
-// read LiPo batter charger status from remote sensor
-int get_charger_status(int fd, int retry_count)
-{
-	char message_buffer[7];
-	int retvalue = -1;
-	do
-	{	
-		tcflush(fd, TCIOFLUSH);
-		fdputc_poll(CMD_GET_CHARGER_STATUS, fd, TTYWRITETIMEOUT);
-		memset(message_buffer, NUL, sizeof(message_buffer));
-		sleep(WAKEUPDELAY); // inital delay to let XBee catch-up
-		fdgets_poll(message_buffer, sizeof(message_buffer), fd, TTYREADTIMEOUT);
-		if(message_buffer[0] == CMD_GET_CHARGER_STATUS && (message_buffer[1] >= '0' && message_buffer[1] <= '9'))
-			retvalue = ((message_buffer[1] - '0') * 1000) + ((message_buffer[2] - '0') * 100) + ((message_buffer[3] - '0') * 10) + (message_buffer[4] - '0');
-		else
-			retvalue = -1;
-
-		retry_count--;
-	}
-	while(retry_count >= 0 && retvalue < 0);
-
-	return retvalue;
-}
-
-// send command to restart CPU on remote Teensey 3.1/3.2 microcontroller
-boolean restart_sensor(int fd)
-{
-	boolean retvalue = true;
-	tcflush(fd, TCIOFLUSH);
-	fdputc_poll(CMD_RESTART, fd, TTYWRITETIMEOUT);
-
-	return retvalue;
-}
-
 // set serial port to communicate with Snow Depth sensor via xBee in transparent mode at 34800 baud
 int set_tty_port(int ttyfile, char *device, char* myname, char *log_file_name, boolean writetolog)
 {
 	struct termios config;
-	char *message_buffer;
-
-	message_buffer = (char *)malloc(sizeof(char) * 256);
-	if (message_buffer == NULL)
-	{
-		fprintf(stderr, "can't allocate dynamic memory for buffers\n");
-		return -1;
-	}
+	char message_buffer[256 + FILENAME_MAX];
 
 	if (tcgetattr(ttyfile, &config) < 0)
 	{
@@ -762,33 +478,89 @@ uint32_t get_seconds_since_midnight (void)
 	return localtm->tm_sec + localtm->tm_min * 60 + localtm->tm_hour * 3600;
 }
 
-// write formatted messages to a log file named in logfilename
+// wall clock milliseconds since the epoch
+int64_t get_wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// milliseconds since an arbitrary point, not affected by clock changes
+uint64_t get_monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// log a message to the log file named in logfilename at the level of its wording (logger_classify())
 void writelog (char *logfilename, char *process_name, char *message)
 {
-	char timestamp[25];
-	time_t t;
-	struct tm *localtm;
-	FILE *stream;
+	writelog_level(logfilename, process_name, logger_classify(message), message);
+}
 
-	t = time(NULL);
-	localtm = localtime(&t);
+// log a message at LOGGER_* level, batched and written by the log timer once the event loop runs
+void writelog_level(char *logfilename, char *process_name, int level, char *message)
+{
+	uint64_t now = get_monotonic_ms();
+	uint64_t deadline = 0;
+
+	logger_write(&logger, logfilename, level, process_name, message, now);
 
-	strftime(timestamp, sizeof(timestamp), "%d.%m.%Y %T", localtm);
+	if(log_timerfd < 0) // before the event loop runs
+		logger_flush(&logger, now);
+	else if((deadline = logger_deadline(&logger)) != 0 && (log_armed == 0 || deadline < log_armed))
+	{
+		evtimer_arm_at_ms(log_timerfd, deadline);
+		log_armed = deadline;
+	}
+}
 
-	stream = fopen(logfilename, "a");
-	fprintf(stream, "%s (%s): %s.\n", process_name, timestamp, message);
-	fprintf(stderr, "%s (%s): %s.\n", process_name, timestamp, message);
-	fclose(stream);
+// write out the batched log lines and repeat counts that are due
+static void log_on_timer(int fd, uint32_t events, void *ctx)
+{
+	evtimer_ack(fd);
+	logger_flush(&logger, get_monotonic_ms());
+
+	if((log_armed = logger_deadline(&logger)) != 0)
+		evtimer_arm_at_ms(fd, log_armed);
+}
+
+// SIGUSR1, SIGTERM or SIGINT was received
+static void on_signal(int fd, uint32_t events, void *ctx)
+{
+	struct signalfd_siginfo info;
+
+	while(read(fd, &info, sizeof(info)) == sizeof(info))
+	{
+		if(info.ssi_signo == SIGUSR1)
+			link_trace_dump_all("SIGUSR1");
+		else
+			stopping = 1;
+	}
+}
+
+static void log_close(void)
+{
+	logger_close(&logger, get_monotonic_ms());
 }
 
 // display command line usage parameters
 void display_usage(char *myname)
 {
 	fprintf(stderr, "mhsdpi Version %s - Meteohub Plug-In for snow depth gauge.\n", VERSION);
-	fprintf(stderr, "Usage: %s -d tty_device [-C] [-L] [-t sleep_time]\n", myname);
-	fprintf(stderr, "  -d tty_device  /dev/tty[x] device name where USB XBee adapter is connected.\n");
-	fprintf(stderr, "  -C             Close/reopen tty device between polls.\n");
+	fprintf(stderr, "Usage: %s -d tty_device [-d tty_device ...] [-C] [-L] [-t sleep_time] [--stats]\n", myname);
+	fprintf(stderr, "  -d tty_device  /dev/tty[x] device name where USB XBee adapter is connected, repeat for each gauge.\n");
+	fprintf(stderr, "                 tty_device@xbee_address addresses a gauge through a coordinator XBee in API mode (AP=2).\n");
+	fprintf(stderr, "                 tcp://host:port or rfc2217://host:port reaches the XBee through a serial-over-IP bridge.\n");
+	fprintf(stderr, "  -C             Ignored, tty devices stay open and are reopened when they come back.\n");
 	fprintf(stderr, "  -L             Write messages to log file.\n");
 	fprintf(stderr, "  -t sleep_time  Number of seconds to sleep between polling the snow depth sensor.\n");
+	fprintf(stderr, "  --stats        Poll every gauge once, write command latency, retry and error stats to stderr and exit.\n");
 	exit(EXIT_FAILURE);
 }
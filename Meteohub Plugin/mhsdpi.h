@@ -19,15 +19,76 @@
 #include <time.h>
 #include <malloc.h>
 #include <math.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/inotify.h>
 
 #include "fdget.h" // fd based lib that uses poll() for tty  I/O
+#include "evloop.h" // epoll() event loop used to drive all gauges from one process
+#include "xbee.h" // XBee API mode frames used when one coordinator serves many gauges
+#include "fdnet.h" // raw TCP and RFC 2217 serial bridges
+#include "rollstat.h" // O(1) rolling mean and standard deviation of the readings window
+#include "filter.h" // outlier filter stages applied to each snow depth reading
+#include "snapshot.h" // atomic, checksummed state file used to warm start
+#include "tsstore.h" // append-only memory mapped history of every poll cycle
+#include "rollup.h" // hourly and daily snow depth aggregates of the history
+#include "sink.h" // batched CSV, InfluxDB and JSON lines output files
+#include "latest.h" // latest readings in shared memory for local readers
+#include "logger.h" // buffered, deduplicated and rotated log file
+#include "metrics.h" // latency histograms and Prometheus text output
+#include "trace.h" // in-memory ring of the bytes sent and received on each link
 /*
 	defines
 */
 #define true 1
 #define false 0
 ///#define MAXREADINGS 10 // number of readings to use for moving average smoothing
-#define MAXREADINGS 5 // number of readings to use for moving average smoothing
+#define MAXREADINGS 5 // default readings window, also the number of readings taken to seed the window at startup
+#define MAXREADINGSWINDOW 4096 // upper bound for READINGS_WINDOW, 288 is 24 h at 5 minute polling
+#define MAXGAUGES 16 // max number of snow depth gauges (tty devices) polled by one plug-in process
+#define MAXJOBS 16 // max number of queued commands per gauge
+#define DATAIDSPERGAUGE 3 // dataN ids used by each gauge: snow depth, battery volts, charger status
+#define EXTRADATAIDS (MAXGAUGES * DATAIDSPERGAUGE) // first dataN id of the optional range and RSSI readings, 2 per gauge
+#define MAXTXNCMDS 8 // max number of commands in one transaction
+#define FILTERREPORTCYCLES 24 // poll cycles between filter rejection rate log entries
+#define SNAPSHOTVERSION 1 // layout of struct gauge_snapshot_t and the samples following it
+#define STORESEGMENTRECORDS 65536 // default poll cycles per history segment, 2 MB, 227 days at 5 minute polling
+#define NUMROLLUPS 2 // hourly and daily
+#define NUMSINKS 3 // CSV, InfluxDB line protocol and JSON lines output files
+#define MAXQUERYLINE 512 // latest readings reply line per gauge on the query socket
+#define NUMCOMMANDS 10 // sensor command letters instrumented by stats.c
+#define NUMFIRMWAREERRORS 6 // firmware error replies -1000 to -5000, then any other negative value
+#define STATSATTEMPTS 4 // attempts used per command counted separately, the last one counts that many or more
+#define STATSONCEINTERVAL 1000 // ms between --stats checks for gauges ready for their poll cycle
+#define STATSONCESECONDS 600 // --stats dumps what it has when a gauge hasn't answered by then
+
+// sensor timing
+#define WAKEUPDELAY 10 // worst case seconds for the XBee to wake up and pass a command on to the sensor
+#define GETDEPTHREADINGDELAY 15 // worst case seconds for a snow depth reading, sensor ranging takes longer than other commands
+#define RESTARTDELAY (2*60) // default upper bound in seconds for the sensor to come back up after a restart
+#define READYPROBEINTERVAL 2000 // ms between A commands sent to a restarting sensor
+#define READYSETTLE TTYREADTIMEOUT // ms of quiet after the boot banner or about text before the sensor counts as ready
+#define TTYWRITETIMEOUT 500
+#define TTYREADTIMEOUT 500
+#define TTYREADWINDOW (5 * TTYREADTIMEOUT) // time to wait for a reply line after the XBee catch-up delay
+#define GETDEPTHDEADLINE ((GETDEPTHREADINGDELAY * 1000) + TTYREADWINDOW) // ms from sending D until its reply has to be complete
+#define REPLYDEADLINE ((WAKEUPDELAY * 1000) + TTYREADWINDOW) // ms from sending any other command until its reply has to be complete
+#define REPLYGAP TTYREADWINDOW // ms to wait for the next reply of a transaction once the gauge has answered
+#define CONNECTDEADLINE (WAKEUPDELAY * 1000) // ms allowed for connecting to a serial bridge
+#define LINKBACKOFFMIN 1000 // ms before the first attempt to reopen a lost tty device or connection
+#define LINKBACKOFFMAX (5*60*1000) // upper bound of the doubling reopen delay
+#define TRACEDUMPSECONDS 60 // min seconds between serial trace dumps of a link on errors, SIGUSR1 always dumps
+#define LINKHOTPLUGSETTLE 250 // ms between a tty device node appearing and opening it
+#define SUPERVISORRECONNECT 2 // consecutive poll cycles without any reply before the link is reopened and the gauge re-probed
+#define TTYBAUDRATE 38400 // serial port speed, also requested from RFC 2217 bridges
+
+// adaptive poll cadence
+#define CADENCECALMPOLLS 3 // consecutive calm poll cycles before the poll interval is doubled
+#define CADENCEREPORTSECONDS (24*3600) // seconds between wake-ups saved log entries
+#define SCHEDSLACKMS 50 // a wake this close before a due time counts as on time
+#define LOOKAHEADSAMPLES 32 // acquisition latencies and emit offsets kept per gauge for the p95 and jitter
+#define LOOKAHEADMARGIN 500 // ms added to the expected acquisition latency when starting a poll before its boundary
+#define LOOKAHEADALPHA 0.2 // weight of the newest latency in the moving average
 
 // commands
 #define CMD_GET_ABOUT 'A'
@@ -36,6 +97,7 @@
 #define CMD_GET_DEPTH 'D'
 #define CMD_GET_CALIBRATION 'G'
 #define CMD_GET_RANGE 'R'
+#define CMD_GET_RSSI 'N'
 #define CMD_SET_MANUAL_CALIBRATE 'S'
 #define CMD_GET_CHARGER_STATUS 'T'
 #define CMD_GET_VOLTAGE 'V'
@@ -49,6 +111,68 @@
 */
 typedef unsigned char boolean;
 
+// gauge states
+enum gauge_state_t
+{
+	GAUGE_CLOSED,	// link down, waiting for it to be (re)opened
+	GAUGE_IDLE,		// nothing queued, waiting for next poll cycle
+	GAUGE_PAUSE,	// waiting before sending next command
+	GAUGE_READ		// command sent, reading reply lines from sensor until complete or deadline
+};
+
+// gauge health tracked by the in-process supervisor, comm errors no longer end the plug-in
+enum gauge_health_t
+{
+	HEALTH_OK,			// all readings of the last poll cycle were good
+	HEALTH_DEGRADED,	// some readings failed, the gauge still answers
+	HEALTH_RECONNECT,	// gauge stopped answering, waiting for its link to be reopened
+	HEALTH_REPROBE		// link is back, checking that the gauge answers before polling it again
+};
+
+// gauge jobs, each one is one command sent to the sensor or one step of the poll cycle
+enum gauge_job_kind_t
+{
+	JOB_PAUSE,				// arg = seconds to wait
+	JOB_RESTART,
+	JOB_WAIT_READY,			// arg = max seconds to wait for a restarted sensor to answer
+	JOB_ABOUT,
+	JOB_GET_DATUM,
+	JOB_SET_DATUM,
+	JOB_SET_MANUAL_DATUM,	// arg = datum
+	JOB_INITIAL_DEPTH,		// arg = index into readings
+	JOB_POLL,				// arg = METRICBIT() mask of the readings to take in one transaction
+	JOB_EMIT				// filter, smooth and output the poll cycle readings
+};
+
+// readings polled on their own intervals, each one is one sensor command. the first three bits match TSSTORE_HAS_*
+enum metric_t
+{
+	METRIC_DEPTH,		// D
+	METRIC_VOLTAGE,		// V
+	METRIC_CHARGER,		// T
+	METRIC_RANGE,		// R, optional
+	METRIC_RSSI,		// N, optional
+	NUMMETRICS
+};
+
+#define METRICBIT(m) (1 << (m))
+
+// how gauges are reached through a tty device
+enum link_mode_t
+{
+	LINK_TRANSPARENT,	// XBee in transparent mode, one gauge per tty device
+	LINK_XBEE_API		// XBee coordinator in API mode (AP=2), gauges addressed by their XBee address
+};
+
+// state of one command in a transaction
+enum txn_cmd_state_t
+{
+	TXN_PENDING,	// not sent yet or to be resent
+	TXN_SENT,		// waiting for its reply
+	TXN_DONE,		// valid reply received
+	TXN_FAILED		// out of attempts
+};
+
 /*
 	structs
 */
@@ -68,7 +192,8 @@ struct config_t
 {
 	boolean restart_remote_sensor;
 	boolean close_tty_file;
-	char device[FILENAME_MAX];
+	char device[MAXGAUGES][FILENAME_MAX];
+	uint16_t num_devices;
 	boolean set_auto_datum;
 	boolean write_log;
 	char log_file_name[FILENAME_MAX];
@@ -78,29 +203,296 @@ struct config_t
 	uint16_t sleep_seconds;
 	uint16_t stdev_filter;
 	uint16_t retry_count;
+	uint16_t reply_timeout;
+	boolean pipeline_commands;
+	uint16_t restart_timeout;
+	uint16_t readings_window;
+	char filters[128];				// comma separated outlier filter stages, see filter.h
+	uint16_t filter_window;
+	double hampel_threshold;
+	double kalman_q;
+	double kalman_r;
+	uint32_t snapshot_max_age;		// seconds, 0 = twice the longest poll interval
+	uint16_t poll_min_seconds;		// adaptive poll interval floor, 0 = poll every sleep_seconds
+	uint16_t poll_max_seconds;		// adaptive poll interval ceiling
+	double poll_slope_threshold;	// mm per hour
+	double poll_stdev_threshold;	// mm
+	uint16_t poll_low_battery;		// volts * 100
+	uint32_t battery_seconds;		// battery volts poll interval, 0 = with every snow depth poll
+	uint32_t charger_seconds;		// charger status poll interval, 0 = with every snow depth poll
+	uint32_t range_seconds;			// sensor range poll interval, 0 = off
+	uint32_t rssi_seconds;			// XBee RSSI poll interval, 0 = off
+	char store_file_name[FILENAME_MAX];	// history segments base name, none = off
+	uint32_t store_segment_records;	// poll cycles per segment file
+	uint32_t store_segments;		// segments kept, 0 = all
+	uint32_t store_sync_records;	// poll cycles between forced write backs, 0 = kernel write back only
+	char csv_file_name[FILENAME_MAX];	// strftime() patterns of the output files, empty = off
+	char influx_file_name[FILENAME_MAX];
+	char jsonl_file_name[FILENAME_MAX];
+	uint16_t sink_batch;			// lines buffered per output file before writing
+	uint32_t sink_flush_seconds;	// max seconds a line stays buffered
+	int sink_fsync;					// SINK_FSYNC_*
+	char latest_file_name[FILENAME_MAX];	// shared memory file of the latest readings, none = off
+	char latest_socket[FILENAME_MAX];	// Unix socket answering with the latest readings, none = off
+	int log_level;					// LOGGER_*, messages above it are skipped
+	uint32_t log_max_kb;			// log file size it is rotated at, 0 = never
+	uint16_t log_files;				// rotated log files kept
+	uint32_t log_flush_seconds;		// max seconds a log line stays buffered
+	uint32_t log_dedup_seconds;		// repeats of a message within this are counted instead of logged, 0 = off
+	uint32_t log_rate;				// max log lines per minute, 0 = unlimited
+	char stats_file_name[FILENAME_MAX];	// Prometheus text file of the stats, empty = off
+	uint32_t stats_seconds;			// seconds between stats file writes
+	uint32_t stats_recent_seconds;	// max age of the poll cycles in the recent latency quantiles
+	boolean stats_once;				// --stats, poll every gauge once, dump the stats and exit
+	char trace_file_name[FILENAME_MAX];	// serial trace dumps, .N is appended per link, none = off
+	uint32_t trace_kb;				// serial trace ring size per link, 0 = off
+};
+
+struct gauge_job_t
+{
+	enum gauge_job_kind_t kind;
+	int arg;
+};
+
+// batch of commands sent back to back, replies are matched to commands by their leading command letter
+struct gauge_txn_t
+{
+	char cmds[MAXTXNCMDS + 1];				// command letters, e.g. "DVT"
+	enum txn_cmd_state_t state[MAXTXNCMDS];
+	int values[MAXTXNCMDS];					// reply value per command, < 0 when failed
+	int attempts[MAXTXNCMDS];				// attempts left per command
+	int arg;								// argument for the S command
+	int sent;								// commands sent in the last batch
+	int replies;							// replies received for the last batch
+	int tries[MAXTXNCMDS];					// attempts used per command
+	uint64_t sent_ms[MAXTXNCMDS];			// CLOCK_MONOTONIC ms each command was last sent
+};
+
+// adaptive poll interval of one gauge, always the floor times a power of 2 so polls stay on boundaries
+struct cadence_t
+{
+	uint32_t interval;				// seconds
+	int calm;						// consecutive calm poll cycles
+	boolean low_battery;
+	unsigned long polls;
+	long saved;						// wake-ups saved against polling every sleep_seconds
+	int64_t last_poll;				// wall clock seconds of the last snow depth poll
+	uint64_t reported_ms;			// CLOCK_MONOTONIC
+};
+
+// acquisition latency of one gauge, polls start this much before their boundary and are emitted at it
+struct lookahead_t
+{
+	double ewma;					// ms, poll start to the last reply
+	int latencies[LOOKAHEADSAMPLES];// ms, ring of the latest complete acquisitions
+	int count;
+	int head;
+	uint32_t lead;					// ms a poll is started before its boundary
+	struct rollstat_t jitter;		// ms, emit time minus boundary
+	int max_jitter;					// ms, largest absolute emit offset
+	uint64_t started;				// CLOCK_MONOTONIC ms the current poll started
+	uint32_t latency;				// ms the current poll took, 0 while running or after a failed command
+	int64_t emit_at;				// wall clock ms the current poll is emitted, its boundary
+};
+
+// command instrumentation events, see stats_command()
+enum stats_event_t
+{
+	STATS_SENT,		// command written to the link
+	STATS_REPLY,	// reply line received, value is its parsed value
+	STATS_BADREPLY,	// reply line that doesn't parse
+	STATS_TIMEOUT,	// no reply before the deadline
+	STATS_RETRY,	// queued for resend
+	STATS_DONE,		// valid reply, no more attempts
+	STATS_FAILED	// out of attempts
+};
+
+// counters and reply latency of one sensor command of a gauge
+struct command_stats_t
+{
+	struct histogram_t latency;		// ms from sending the command to its reply
+	unsigned long sent;
+	unsigned long replies;
+	unsigned long bad_replies;
+	unsigned long timeouts;
+	unsigned long retries;
+	unsigned long failures;			// commands that used up their attempts
+	unsigned long errors[NUMFIRMWAREERRORS];	// firmware error replies
+	unsigned long attempts[STATSATTEMPTS];		// finished commands by attempts used
+};
+
+struct gauge_stats_t
+{
+	struct command_stats_t commands[NUMCOMMANDS];
+	struct histogram_t cycle;		// ms from starting a poll to its last reply or failure
+	struct window_t recent;			// the same for the last METRICS_WINDOW poll cycles
+	uint32_t cycle_ms;				// of the poll cycle being emitted, 0 = none
+	unsigned long cycles;
+};
+
+struct gauge_t;
+
+// one tty device or serial bridge connection and the gauges reached through it
+struct link_t
+{
+	char device[FILENAME_MAX];		// tty device path or tcp:// or rfc2217:// url
+	enum link_mode_t mode;
+	int transport;					// 0 for a local tty device, FDNET_TCP or FDNET_RFC2217
+	char host[256];					// serial bridge host and port
+	char port[32];
+	int ttyfile;					// tty device or socket
+	boolean ready;					// open and connected, commands can be sent
+	int timerfd;					// connect deadline and reopen backoff
+	int backoff;					// ms until the next reopen attempt
+	int watchfd;					// inotify on the tty device directory for hotplug
+	struct telnet_t telnet;			// RFC 2217 receive state
+	struct termios oldsettings;
+	struct config_t *config;
+	char *myname;
+	struct evloop_t *loop;
+	struct gauge_t *gauges[MAXGAUGES];
+	int num_gauges;
+	struct xbee_parser_t parser;	// API mode receive frames
+	uint8_t frame_id;				// last TX request frame id
+	struct gauge_t *frame_gauge[256];	// gauge each TX request frame id was sent for
+	struct fdstats_t io;			// tty I/O counters
+	struct trace_t trace;			// recent bytes sent and received, dumped on errors
+	uint64_t dumped_us;				// CLOCK_MONOTONIC us of the last trace dump on an error, 0 = none
+};
+
+struct gauge_t
+{
+	int id;							// gauge number, data ids start at id * DATAIDSPERGAUGE
+	char *device;					// DEVICE value, tty device path with optional @XBee address
+	struct link_t *link;			// tty device the gauge is reached through
+	int link_index;					// index of the gauge in link->gauges
+	struct xbee_addr_t addr;		// XBee address of the gauge in API mode
+	int timerfd;
+	struct config_t *config;
+	char *myname;
+	struct evloop_t *loop;
+	enum gauge_state_t state;
+	struct gauge_job_t jobs[MAXJOBS];	// queue of pending jobs
+	int job_head;
+	int job_count;
+	struct gauge_txn_t txn;			// commands of the current job
+	boolean pipeline;				// send all commands of a transaction at once, cleared when the gauge drops them
+	int lines;						// reply lines read for the current job
+	uint64_t job_started;			// ms, CLOCK_MONOTONIC
+	struct fdring_t rx;				// received sensor output
+	boolean initialized;			// datum and readings history are valid
+	boolean initial_ok;
+	int datum;
+	struct rollstat_t readings;		// snow depth readings window used for filtering and smoothing
+	int64_t *reading_times;			// wall clock seconds of each reading, same ring positions as readings
+	struct filter_chain_t filters;	// outlier filter stages, run before a reading enters the window
+	unsigned long cycles;			// poll cycles emitted
+	char readings_file_name[FILENAME_MAX];
+	int snowdepth;
+	int batteryVolts;
+	int chargerStatus;
+	int range;
+	int rssi;
+	int polled;						// METRICBIT() mask of the readings taken in the last poll cycle
+	int retries;					// commands resent in the current poll cycle
+	int64_t due[NUMMETRICS];		// wall clock seconds each reading is due next, 0 = not scheduled on its own
+	int rc;							// result of the last poll cycle, < 0 on comm errors
+	enum gauge_health_t health;
+	int failures;					// consecutive poll cycles without any good reading
+	struct cadence_t cadence;
+	struct lookahead_t lookahead;
+	struct tsstore_t store;			// history of every poll cycle
+	boolean storing;				// store is open
+	boolean clock_behind;			// wall clock is behind the last stored record, logged once per step back
+	struct rollup_t rollups[NUMROLLUPS];	// hourly and daily aggregates of the history
+	struct gauge_stats_t stats;		// command latency, retry and error counters
+};
+
+// gauge state saved after every poll cycle so a restarted plug-in resumes without re-sampling the sensor,
+// followed by count struct gauge_snapshot_sample_t oldest first
+struct gauge_snapshot_t
+{
+	char device[256];				// the snapshot is only used by the gauge it was saved for
+	int datum;
+	int count;
+	int filter_window;
+	int num_stages;
+	struct filter_stage_t stages[FILTER_MAXSTAGES];
+	uint64_t saved_ms;				// CLOCK_MONOTONIC when saved, Kalman sample times are relative to it
+};
+
+struct gauge_snapshot_sample_t
+{
+	int64_t time;					// wall clock seconds
+	int32_t value;
 };
 
 /*
 	function prototypes
 */
-int get_initial_sensor (int *values, int datum, int fd, uint16_t retry_count);
 int write_array(const int *values, int n, char *filename);
 int read_array(int *values,int n, char *filename);
-float moving_average(int *values, int n, int new_value);
-float average(const int *values, int n);
-float standard_deviation(const int *values, int n);
-void print_firmware_version(int fd, char *logfilename, char *myname);
-int get_calibration_value(int fd, uint16_t retry_count);
-int set_calibration_value(int fd, uint16_t retry_count);
-int set_manual_calibration_value(int fd, int value);
-int get_depth_value(int fd, int retry_count);
-int get_range_value(int fd, uint16_t retry_count);
-int get_battery_voltage(int fd, int retry_count);
-int get_charger_status(int fd, int retry_count);
-boolean restart_sensor(int fd);
+int parse_reply(const char *buf, size_t len, char cmd, int *value);
 
 int set_tty_port(int ttyfile, char *device, char* myname, char *log_file_name, boolean writetolog);
 uint32_t get_seconds_since_midnight (void);
+uint64_t get_monotonic_ms(void);
+int64_t get_wall_ms(void);
 void writelog (char *logfilename, char *process_name, char *message);
+void writelog_level(char *logfilename, char *process_name, int level, char *message);
 void display_usage(char *myname);
 int get_configuration(struct config_t *config, char *path);
+
+// gauge.c
+int gauge_init(struct gauge_t *g, int id, char *device, struct config_t *config, char *myname, struct evloop_t *loop);
+int gauge_open(struct gauge_t *g);
+void gauge_queue(struct gauge_t *g, enum gauge_job_kind_t kind, int arg);
+void gauge_start(struct gauge_t *g);
+void gauge_queue_startup(struct gauge_t *g);
+boolean gauge_poll(struct gauge_t *g, int metrics, int64_t boundary);
+boolean gauge_busy(const struct gauge_t *g);
+void gauge_log(struct gauge_t *g, char *message);
+void gauge_log_level(struct gauge_t *g, int level, char *message);
+void gauge_input(struct gauge_t *g);
+void gauge_filter_report(struct gauge_t *g);
+void gauge_close(struct gauge_t *g);
+
+// cadence.c
+void cadence_init(struct gauge_t *g);
+void cadence_polled(struct gauge_t *g, int64_t now);
+void cadence_update(struct gauge_t *g);
+void cadence_report(struct gauge_t *g);
+
+// sched.c
+int sched_init(struct evloop_t *loop, struct gauge_t *gauges, int num_gauges);
+int64_t sched_next_wake(void);
+void sched_reschedule(struct gauge_t *g);
+int sched_lookahead_init(struct gauge_t *g);
+void sched_acquired(struct gauge_t *g);
+void sched_report(struct gauge_t *g);
+
+// outputs.c
+int outputs_init(struct evloop_t *loop, struct config_t *config, char *myname, struct gauge_t *gauges, int num_gauges);
+void outputs_write(struct gauge_t *g, const struct tsstore_record_t *r);
+void outputs_close(void);
+
+// stats.c
+int stats_init(struct evloop_t *loop, struct config_t *config, char *myname, struct gauge_t *gauges, int num_gauges);
+void stats_command(struct gauge_t *g, int i, enum stats_event_t event, int value);
+void stats_polled(struct gauge_t *g);
+boolean stats_done(void);
+void stats_write(FILE *f);
+void stats_close(void);
+
+// link.c
+int link_attach(struct gauge_t *g);
+int link_open(struct link_t *link);
+void link_close(struct link_t *link);
+void link_lost(struct link_t *link, char *message);
+void link_close_all(void);
+ssize_t link_write(struct link_t *link, struct gauge_t *g, const char *buf, size_t len, boolean drain);
+void link_log_io(void);
+void link_write_stats(FILE *f);
+void link_trace_note(struct link_t *link, int channel, const char *message);
+void link_trace_dump(struct link_t *link, const char *reason, boolean always);
+void link_trace_dump_all(const char *reason);
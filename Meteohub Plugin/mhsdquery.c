@@ -0,0 +1,289 @@
+/*
+
+	mhsdquery.c
+
+	batch queries of the plug-in's history store and rollups without parsing logs. Hourly and daily
+	queries read the closed buckets from the rollup files and aggregate the history written after
+	them, or the whole history when there is no rollup file. Rebuilding rewrites the rollup files
+	from the history, e.g. after changing the time zone or losing a rollup file.
+
+	usage: mhsdquery [-r raw|hour|day] [-f from] [-t to] [-b] store_file_name
+	       mhsdquery -l latest_file_name
+	  -r raw|hour|day  history records, hourly or daily min, max, mean, count and last snow depth (default day)
+	  -f from          first time, local YYYY-MM-DD or YYYY-MM-DDTHH:MM, default the start of the history
+	  -t to            last time, same format, default the end of the history
+	  -b               rebuild the rollup files from the history, best done with the plug-in stopped
+	  store_file_name  STORE_FILE_NAME of the gauge, with .1, .2, ... for gauges after the first one
+	  -l               print the latest readings of every gauge from the plug-in's LATEST_FILE_NAME
+
+	output is CSV on stdout, depths in mm and battery volts * 100, the time taken goes to stderr
+
+*/
+
+#define _GNU_SOURCE // strptime()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tsstore.h"
+#include "rollup.h"
+#include "latest.h"
+
+static long buckets_printed = 0;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// local YYYY-MM-DD or YYYY-MM-DDTHH:MM as wall clock ms, -1 when not a time
+static int64_t parse_time(const char *text)
+{
+	struct tm local;
+	const char *end = NULL;
+
+	memset(&local, 0, sizeof(local));
+	if(((end = strptime(text, "%Y-%m-%dT%H:%M", &local)) == NULL || *end != '\0') &&
+		((end = strptime(text, "%Y-%m-%d", &local)) == NULL || *end != '\0'))
+		return -1;
+	local.tm_isdst = -1;
+
+	return (int64_t)mktime(&local) * 1000;
+}
+
+static void format_time(int64_t time, const char *format, char *buf, size_t len)
+{
+	time_t t = (time_t)(time / 1000);
+	struct tm local;
+
+	localtime_r(&t, &local);
+	strftime(buf, len, format, &local);
+}
+
+static void print_bucket(const struct rollup_bucket_t *b, uint32_t resolution, void *ctx)
+{
+	char when[32];
+
+	format_time(b->start, resolution == ROLLUP_DAY ? "%Y-%m-%d" : "%Y-%m-%d %H:%M", when, sizeof(when));
+	printf("%s,%d,%d,%.1f,%u,%d\n", when, b->min, b->max, (double)b->sum / b->count, b->count, b->last);
+	buckets_printed++;
+}
+
+static int print_records(const struct tsstore_record_t *records, size_t n, void *ctx)
+{
+	char when[32];
+	size_t i = 0;
+
+	for(i = 0; i < n; i++)
+	{
+		format_time(records[i].time, "%Y-%m-%d %H:%M:%S", when, sizeof(when));
+		printf("%s,%d,%d,%d,%d,%d,%u,%d\n", when, records[i].raw, records[i].filtered, records[i].smoothed,
+			records[i].volts, records[i].charger, records[i].retries, records[i].error);
+	}
+
+	return 0;
+}
+
+static int add_records(const struct tsstore_record_t *records, size_t n, void *ctx)
+{
+	return rollup_add_records((struct rollup_t *)ctx, records, n) < 0;
+}
+
+// print the buckets of resolution between from and to, closed ones from the rollup file and the rest from the history
+static long query_rollups(const char *base, uint32_t resolution, int64_t from, int64_t to)
+{
+	char name[FILENAME_MAX];
+	struct rollup_bucket_t *buckets = NULL;
+	struct rollup_t r;
+	long count = 0, i = 0, records = 0;
+	int64_t first = from > 0 ? rollup_bucket_start(from, resolution) : 0;
+
+	rollup_init(&r, resolution);
+	r.emit = print_bucket;
+	r.resume = first;
+
+	if(rollup_file_name(name, sizeof(name), base, resolution) == 0 && (count = rollup_read(name, resolution, &buckets)) > 0)
+	{
+		for(i = 0; i < count && buckets[i].start <= to; i++)
+			if(buckets[i].start >= first)
+				print_bucket(&buckets[i], resolution, NULL);
+		if(rollup_bucket_end(buckets[count - 1].start, resolution) > r.resume)
+			r.resume = rollup_bucket_end(buckets[count - 1].start, resolution);
+		free(buckets);
+	}
+
+	if(r.resume <= to && (records = tsstore_scan_blocks(base, r.resume, to, add_records, &r)) < 0)
+		return -1;
+	rollup_flush(&r);
+
+	return records;
+}
+
+// print the latest readings of every gauge from the shared memory file, one line per gauge
+static int print_latest(const char *filename)
+{
+	const struct latest_t *shm = NULL;
+	struct latest_gauge_t g;
+	struct timespec ts;
+	char line[512];
+	int i = 0, rc = 0;
+
+	if((shm = latest_attach(filename)) == NULL)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for(i = 0; i < (int)shm->num_gauges && i < LATEST_MAXGAUGES; i++)
+	{
+		if(latest_read(shm, i, &g) < 0)
+		{
+			fprintf(stderr, "gauge %d: plug-in stopped while publishing it\n", i);
+			rc = -1;
+			continue;
+		}
+		latest_format(&g, i, ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000), line, sizeof(line));
+		fputs(line, stdout);
+	}
+
+	latest_detach(shm);
+	return rc;
+}
+
+// rewrite the rollup file of resolution from the whole history, the open bucket is left to the plug-in
+static int rebuild(const char *base, uint32_t resolution)
+{
+	char name[FILENAME_MAX], tmpname[FILENAME_MAX + 8];
+	struct rollup_t r;
+	long records = 0;
+
+	if(rollup_file_name(name, sizeof(name), base, resolution) < 0)
+		return -1;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+	unlink(tmpname);
+
+	if(rollup_open(&r, tmpname, resolution) < 0)
+		return -1;
+
+	if((records = tsstore_scan_blocks(base, 0, INT64_MAX, add_records, &r)) < 0 || fsync(r.fd) < 0)
+	{
+		rollup_close(&r);
+		unlink(tmpname);
+		return -1;
+	}
+	rollup_close(&r);
+
+	if(rename(tmpname, name) < 0)
+	{
+		unlink(tmpname);
+		return -1;
+	}
+
+	fprintf(stderr, "%s: %lu buckets from %ld history records\n", name, r.written, records);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *usage = "usage: %s [-r raw|hour|day] [-f from] [-t to] [-b] store_file_name\n       %s -l latest_file_name\n";
+	const char *base = NULL;
+	uint32_t resolution = ROLLUP_DAY;
+	int64_t from = 0, to = INT64_MAX, started = 0;
+	long records = 0;
+	int opt = 0, raw = 0, rebuilding = 0, latest = 0;
+
+	while((opt = getopt(argc, argv, "r:f:t:bl")) != -1)
+	{
+		switch(opt)
+		{
+			case 'r':
+				if(strcmp(optarg, "raw") == 0)
+					raw = 1;
+				else if(strcmp(optarg, "hour") == 0)
+					resolution = ROLLUP_HOUR;
+				else if(strcmp(optarg, "day") == 0)
+					resolution = ROLLUP_DAY;
+				else
+				{
+					fprintf(stderr, usage, argv[0], argv[0]);
+					return 1;
+				}
+				break;
+			case 'f':
+			case 't':
+				if(parse_time(optarg) < 0)
+				{
+					fprintf(stderr, "bad time %s, use YYYY-MM-DD or YYYY-MM-DDTHH:MM\n", optarg);
+					return 1;
+				}
+				if(opt == 'f')
+					from = parse_time(optarg);
+				else
+					to = parse_time(optarg);
+				break;
+			case 'b':
+				rebuilding = 1;
+				break;
+			case 'l':
+				latest = 1;
+				break;
+			default:
+				fprintf(stderr, usage, argv[0], argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		fprintf(stderr, usage, argv[0], argv[0]);
+		return 1;
+	}
+	base = argv[optind];
+	started = now_ms();
+
+	if(latest)
+	{
+		if(print_latest(base) < 0)
+		{
+			perror(base);
+			return 1;
+		}
+		return 0;
+	}
+
+	if(rebuilding)
+	{
+		if(rebuild(base, ROLLUP_HOUR) < 0 || rebuild(base, ROLLUP_DAY) < 0)
+		{
+			perror(base);
+			return 1;
+		}
+		fprintf(stderr, "rebuilt in %lld ms\n", (long long)(now_ms() - started));
+		return 0;
+	}
+
+	if(raw)
+	{
+		printf("time,raw,filtered,smoothed,volts,charger,retries,error\n");
+		records = tsstore_scan_blocks(base, from, to, print_records, NULL);
+	}
+	else
+	{
+		printf("%s,min,max,mean,count,last\n", resolution == ROLLUP_DAY ? "day" : "hour");
+		records = query_rollups(base, resolution, from, to);
+	}
+
+	if(records < 0)
+	{
+		perror(base);
+		return 1;
+	}
+
+	fprintf(stderr, "%ld buckets, %ld history records scanned in %lld ms\n", buckets_printed, records, (long long)(now_ms() - started));
+	return 0;
+}
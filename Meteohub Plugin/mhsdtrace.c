@@ -0,0 +1,177 @@
+/*
+
+	mhsdtrace.c
+
+	prints a serial trace dump of the plug-in (TRACE_FILE_NAME.N), one record per line: wall clock time,
+	seconds before the dump, seconds since the previous record, direction, gauge, length and the bytes
+	with control characters escaped. Dumps from a machine with the other byte order are read as well.
+
+	usage: mhsdtrace [-x] trace_file_name
+	  -x  add a hex dump of each TX and RX record
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "trace.h"
+
+static uint32_t swap32(uint32_t v)
+{
+	return __builtin_bswap32(v);
+}
+
+static uint64_t swap64(uint64_t v)
+{
+	return ((uint64_t)swap32((uint32_t)v) << 32) | swap32((uint32_t)(v >> 32));
+}
+
+// wall clock ms as local YYYY-MM-DD HH:MM:SS.mmm
+static void format_wall(char *out, size_t len, int64_t ms)
+{
+	time_t t = (time_t)(ms / 1000);
+	struct tm local;
+	char stamp[32];
+
+	localtime_r(&t, &local);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+	snprintf(out, len, "%s.%03d", stamp, (int)(ms % 1000));
+}
+
+// print len bytes of data quoted, control and non-ASCII bytes escaped
+static void print_bytes(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	putchar('"');
+	for(i = 0; i < len; i++)
+	{
+		if(data[i] == '\r')
+			fputs("\\r", stdout);
+		else if(data[i] == '\n')
+			fputs("\\n", stdout);
+		else if(data[i] == '"' || data[i] == '\\')
+			printf("\\%c", data[i]);
+		else if(data[i] < 0x20 || data[i] >= 0x7f)
+			printf("\\x%02x", data[i]);
+		else
+			putchar(data[i]);
+	}
+	putchar('"');
+}
+
+static void print_hex(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	for(i = 0; i < len; i++)
+		printf("%s%02x", i % 16 == 0 ? "\n\t\t" : " ", data[i]);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *types[] = {"TX", "RX", "NOTE"};
+	struct trace_file_t header;
+	struct trace_record_t r;
+	const uint8_t *payload = NULL;
+	uint8_t *data = NULL;
+	uint64_t previous = 0;
+	size_t off = 0, len = 0;
+	char when[64], channel[8];
+	FILE *f = NULL;
+	long printed = 0;
+	int opt = 0, hex = 0, swap = 0;
+
+	while((opt = getopt(argc, argv, "x")) != -1)
+	{
+		switch(opt)
+		{
+			case 'x':
+				hex = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-x] trace_file_name\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		fprintf(stderr, "usage: %s [-x] trace_file_name\n", argv[0]);
+		return 1;
+	}
+
+	if((f = fopen(argv[optind], "rb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "%s is not a serial trace dump\n", argv[optind]);
+		fclose(f);
+		return 1;
+	}
+
+	if(header.byteorder != TRACE_BYTEORDER)
+	{
+		swap = 1;
+		header.version = swap32(header.version);
+		header.records = swap32(header.records);
+		header.overwritten = swap32(header.overwritten);
+		header.bytes = swap32(header.bytes);
+		header.dump_us = swap64(header.dump_us);
+		header.wall_ms = (int64_t)swap64((uint64_t)header.wall_ms);
+	}
+
+	if(header.version != TRACE_VERSION)
+	{
+		fprintf(stderr, "%s is a version %u dump, this mhsdtrace reads version %d\n", argv[optind], header.version, TRACE_VERSION);
+		fclose(f);
+		return 1;
+	}
+
+	if((data = malloc(header.bytes + 1)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		fclose(f);
+		return 1;
+	}
+	len = fread(data, 1, header.bytes, f);
+	fclose(f);
+
+	header.device[sizeof(header.device) - 1] = '\0';
+	header.reason[sizeof(header.reason) - 1] = '\0';
+	format_wall(when, sizeof(when), header.wall_ms);
+	printf("# %s dumped %s (%s), %u records, %u overwritten since start\n", header.device, when, header.reason, header.records, header.overwritten);
+
+	while((payload = trace_next(data, len, &off, swap, &r)) != NULL)
+	{
+		format_wall(when, sizeof(when), header.wall_ms - (int64_t)((header.dump_us - r.us) / 1000));
+		if(r.channel == TRACE_NOCHANNEL)
+			strcpy(channel, "-");
+		else
+			snprintf(channel, sizeof(channel), "g%u", r.channel);
+
+		printf("%s %11.6f %+10.6f %-4s %-3s %5u ", when, -(double)(header.dump_us - r.us) / 1e6, previous != 0 ? (double)(r.us - previous) / 1e6 : 0.0,
+			r.type <= TRACE_NOTE ? types[r.type] : "?", channel, r.len);
+		print_bytes(payload, r.len);
+		if(hex && r.type != TRACE_NOTE)
+			print_hex(payload, r.len);
+		putchar('\n');
+
+		previous = r.us;
+		printed++;
+	}
+
+	if(off < len || len < header.bytes)
+		fprintf(stderr, "%s is truncated after %ld records\n", argv[optind], printed);
+
+	free(data);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+
+	outputs.c
+
+	output files beside meteohub's stdout: CSV, InfluxDB line protocol and JSON lines sinks fed
+	with the record of every poll cycle. Lines are batched per sink, one timer writes out batches
+	that are older than SINK_FLUSH_SECONDS so a slow poll interval doesn't hold lines back.
+	The latest readings of every gauge are kept here too, published to the shared memory file and
+	answered on the query socket straight from memory.
+
+*/
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "mhsdpi.h"
+
+static struct sink_t outputs[NUMSINKS];
+static boolean failing[NUMSINKS];			// last write failed, logged once until it works again
+static int num_outputs = 0;
+static int outputs_timerfd = -1;
+static struct config_t *outputs_config = NULL;
+static char *outputs_myname = NULL;
+static struct latest_gauge_t latest[MAXGAUGES];	// latest readings of each gauge, by gauge id
+static int num_latest = 0;
+static struct latest_t *latest_shm = NULL;	// shared memory file, NULL = off
+static int latest_fd = -1;					// query socket
+
+static const char *sink_names[NUMSINKS] = {"CSV", "InfluxDB", "JSON lines"};
+
+static void outputs_on_timer(int fd, uint32_t events, void *ctx);
+static void outputs_on_query(int fd, uint32_t events, void *ctx);
+
+static void outputs_log(char *message)
+{
+	if(outputs_config->write_log)
+		writelog(outputs_config->log_file_name, outputs_myname, message);
+	else
+		fprintf(stderr, "%s.\n", message);
+}
+
+// arm the timer for the oldest buffered batch
+static void outputs_arm(void)
+{
+	uint64_t next = 0, deadline = 0;
+	int i = 0;
+
+	for(i = 0; i < num_outputs; i++)
+		if((deadline = sink_deadline(&outputs[i])) != 0 && (next == 0 || deadline < next))
+			next = deadline;
+
+	if(next == 0)
+		evtimer_arm_ms(outputs_timerfd, 0);
+	else
+		evtimer_arm_at_ms(outputs_timerfd, next);
+}
+
+// log a failing sink once, and again once it works
+static void outputs_result(int i, int rc)
+{
+	char message_buffer[FILENAME_MAX + 128];
+
+	if(rc < 0 && !failing[i])
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "Can't write %s output %s: %s, lines are dropped until it works",
+			sink_names[outputs[i].format], outputs[i].name[0] != NUL ? outputs[i].name : outputs[i].pattern, strerror(errno));
+		outputs_log(message_buffer);
+	}
+	else if(rc == 0 && failing[i])
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "%s output %s works again, %lu lines dropped", sink_names[outputs[i].format], outputs[i].name, outputs[i].dropped);
+		outputs_log(message_buffer);
+	}
+	failing[i] = rc < 0;
+}
+
+// set up the shared memory file and query socket of the latest readings, failures are logged and leave them off
+static void outputs_latest_init(struct evloop_t *loop, struct gauge_t *gauges, int num_gauges)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	int i = 0;
+
+	num_latest = num_gauges;
+	for(i = 0; i < num_latest; i++)
+	{
+		strncpy(latest[i].device, gauges[i].device, sizeof(latest[i].device) - 1);
+		latest[i].error = -1; // not polled yet
+	}
+
+	if(strcmp(outputs_config->latest_file_name, "none") != 0)
+	{
+		if((latest_shm = latest_create(outputs_config->latest_file_name, num_latest, get_wall_ms())) == NULL)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "Can't create latest readings file %s: %s", outputs_config->latest_file_name, strerror(errno));
+			outputs_log(message_buffer);
+		}
+		else
+			for(i = 0; i < num_latest; i++)
+				latest_publish(latest_shm, i, &latest[i]);
+	}
+
+	if(strcmp(outputs_config->latest_socket, "none") != 0)
+	{
+		if((latest_fd = fdnet_listen_unix(outputs_config->latest_socket)) < 0 || evloop_add(loop, latest_fd, EPOLLIN, outputs_on_query, NULL) < 0)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "Can't listen on latest readings socket %s: %s", outputs_config->latest_socket, strerror(errno));
+			outputs_log(message_buffer);
+			if(latest_fd >= 0)
+				close(latest_fd);
+			latest_fd = -1;
+		}
+	}
+}
+
+// set up the configured sinks, their flush timer and the latest readings. returns 0 on success, -1 on error
+int outputs_init(struct evloop_t *loop, struct config_t *config, char *myname, struct gauge_t *gauges, int num_gauges)
+{
+	const char *patterns[NUMSINKS] = {config->csv_file_name, config->influx_file_name, config->jsonl_file_name};
+	int format = 0;
+
+	outputs_config = config;
+	outputs_myname = myname;
+
+	outputs_latest_init(loop, gauges, num_gauges);
+
+	for(format = 0; format < NUMSINKS; format++) // format is the SINK_* number
+		if(patterns[format][0] != NUL)
+			sink_init(&outputs[num_outputs++], format, patterns[format], config->sink_batch, config->sink_flush_seconds * 1000, config->sink_fsync);
+
+	if(num_outputs == 0)
+		return 0;
+
+	if((outputs_timerfd = evtimer_create()) < 0 || evloop_add(loop, outputs_timerfd, EPOLLIN, outputs_on_timer, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+// update the latest readings of gauge g with the record of its poll cycle and publish them
+static void outputs_latest(struct gauge_t *g, const struct tsstore_record_t *r)
+{
+	struct latest_gauge_t *l = &latest[g->id];
+	int values[NUMMETRICS] = {r->smoothed, r->volts, r->charger, g->range, g->rssi}; // LATEST_* are in METRIC_* order
+	int m = 0;
+
+	for(m = 0; m < NUMMETRICS; m++)
+		if(r->metrics & METRICBIT(m))
+		{
+			l->readings[m].last = m == METRIC_DEPTH ? r->raw : values[m];
+			if(l->readings[m].last >= 0)
+			{
+				l->readings[m].value = values[m];
+				l->readings[m].time = r->time;
+			}
+		}
+
+	if((r->metrics & METRICBIT(METRIC_DEPTH)) && r->raw >= 0)
+	{
+		l->raw = r->raw;
+		l->filtered = r->filtered;
+	}
+	l->health = g->health;
+	l->retries = r->retries;
+	l->error = r->error;
+	l->polls++;
+	l->updated = get_wall_ms();
+
+	if(latest_shm != NULL)
+		latest_publish(latest_shm, g->id, l);
+}
+
+// add the record of one poll cycle of gauge g to every sink and the latest readings
+void outputs_write(struct gauge_t *g, const struct tsstore_record_t *r)
+{
+	uint64_t now = get_monotonic_ms();
+	int i = 0;
+
+	outputs_latest(g, r);
+
+	for(i = 0; i < num_outputs; i++)
+		outputs_result(i, sink_write(&outputs[i], r, g->device, now));
+
+	if(num_outputs > 0)
+		outputs_arm();
+}
+
+// answer every waiting query socket client with the latest readings, one line per gauge, and hang up
+static void outputs_on_query(int fd, uint32_t events, void *ctx)
+{
+	char reply[MAXGAUGES * MAXQUERYLINE];
+	size_t len = 0;
+	int client = -1, i = 0;
+
+	while((client = accept(fd, NULL, NULL)) >= 0)
+	{
+		if(len == 0) // same answer for every client of this wake up
+			for(i = 0; i < num_latest; i++)
+				len += latest_format(&latest[i], i, get_wall_ms(), &reply[len], MAXQUERYLINE);
+
+		send(client, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL); // fits the socket buffer, a client that can't take it goes without
+		close(client);
+	}
+}
+
+// write out the batches that are due
+static void outputs_on_timer(int fd, uint32_t events, void *ctx)
+{
+	uint64_t now = get_monotonic_ms();
+	uint64_t deadline = 0;
+	int i = 0;
+
+	evtimer_ack(fd);
+
+	for(i = 0; i < num_outputs; i++)
+		if((deadline = sink_deadline(&outputs[i])) != 0 && deadline <= now)
+			outputs_result(i, sink_flush(&outputs[i]));
+
+	outputs_arm();
+}
+
+// write out all buffered lines, close the files and remove the latest readings file and socket
+void outputs_close(void)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	int i = 0;
+
+	for(i = 0; i < num_outputs; i++)
+	{
+		sink_close(&outputs[i]);
+		snprintf(message_buffer, sizeof(message_buffer), "%s output: %lu lines in %lu writes, %lu dropped",
+			sink_names[outputs[i].format], outputs[i].written, outputs[i].writes, outputs[i].dropped);
+		outputs_log(message_buffer);
+	}
+	num_outputs = 0;
+
+	if(latest_fd >= 0)
+	{
+		close(latest_fd);
+		unlink(outputs_config->latest_socket);
+		latest_fd = -1;
+	}
+	if(latest_shm != NULL)
+	{
+		munmap(latest_shm, sizeof(*latest_shm));
+		unlink(outputs_config->latest_file_name); // readers still attached keep the last readings
+		latest_shm = NULL;
+	}
+}
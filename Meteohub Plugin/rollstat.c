@@ -0,0 +1,126 @@
+/*
+
+	rollstat.c
+
+	rolling window statistics with O(1) push, mean and variance are kept up to date
+	incrementally (Welford) instead of rescanning the window
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rollstat.h"
+
+// returns 0 on success, -1 when the window can't be allocated
+int rollstat_init(struct rollstat_t *s, int window)
+{
+	memset(s, 0, sizeof(*s));
+
+	if(window < 1 || (s->values = (int *)malloc(sizeof(int) * window)) == NULL)
+		return -1;
+
+	s->window = window;
+
+	return 0;
+}
+
+void rollstat_free(struct rollstat_t *s)
+{
+	free(s->values);
+	s->values = NULL;
+	s->window = 0;
+	rollstat_clear(s);
+}
+
+// empty the window
+void rollstat_clear(struct rollstat_t *s)
+{
+	s->count = 0;
+	s->head = 0;
+	s->mean = 0;
+	s->m2 = 0;
+	s->pushes = 0;
+}
+
+// recompute mean and variance from the window, two pass for accuracy
+static void rollstat_resync(struct rollstat_t *s)
+{
+	double sum = 0, d = 0;
+	int i = 0;
+
+	for(i = 0; i < s->count; i++)
+		sum += s->values[(s->head + i) % s->window];
+	s->mean = s->count > 0 ? sum / s->count : 0;
+
+	s->m2 = 0;
+	for(i = 0; i < s->count; i++)
+	{
+		d = s->values[(s->head + i) % s->window] - s->mean;
+		s->m2 += d * d;
+	}
+
+	s->pushes = 0;
+}
+
+// add value to the window, the oldest sample drops out when the window is full
+void rollstat_push(struct rollstat_t *s, int value)
+{
+	double old_mean = s->mean;
+	int oldest = 0;
+	int tail = 0;
+
+	if(s->count < s->window) // window still filling, plain Welford add
+	{
+		tail = (s->head + s->count) % s->window;
+		s->values[tail] = value;
+		s->count++;
+		s->mean += (value - old_mean) / s->count;
+		s->m2 += (value - old_mean) * (value - s->mean);
+	}
+	else // replace the oldest sample, count stays the same
+	{
+		oldest = s->values[s->head];
+		s->values[s->head] = value;
+		s->head = (s->head + 1) % s->window;
+		s->mean += (double)(value - oldest) / s->count;
+		s->m2 += (value - oldest) * ((value - s->mean) + (oldest - old_mean));
+	}
+
+	if(s->m2 < 0) // rounding
+		s->m2 = 0;
+
+	if(++s->pushes >= ROLLSTAT_RESYNC) // amortized O(1)
+		rollstat_resync(s);
+}
+
+double rollstat_mean(const struct rollstat_t *s)
+{
+	return s->mean;
+}
+
+// population variance (divided by count) of the window
+double rollstat_variance(const struct rollstat_t *s)
+{
+	return s->count > 0 ? s->m2 / s->count : 0;
+}
+
+double rollstat_stdev(const struct rollstat_t *s)
+{
+	return sqrt(rollstat_variance(s));
+}
+
+// copy the samples oldest first into out, returns the number copied
+int rollstat_copy(const struct rollstat_t *s, int *out)
+{
+	int first = s->window - s->head;
+
+	if(first > s->count)
+		first = s->count;
+
+	memcpy(out, &s->values[s->head], sizeof(int) * first);
+	memcpy(&out[first], s->values, sizeof(int) * (s->count - first));
+
+	return s->count;
+}
@@ -0,0 +1,43 @@
+/*
+
+	rollstat.h
+
+	rolling window statistics with O(1) push, mean and variance are kept up to date
+	incrementally (Welford) instead of rescanning the window
+
+*/
+#ifndef ROLLSTAT_H
+#define ROLLSTAT_H
+
+#include <stdint.h>
+
+// defines
+#define ROLLSTAT_RESYNC 4096 // pushes between recomputing mean and variance from the window to drop rounding drift
+
+// structs
+struct rollstat_t
+{
+	int *values;		// ring of the last window samples
+	int window;			// capacity
+	int count;			// samples in the window
+	int head;			// index of the oldest sample
+	double mean;
+	double m2;			// sum of squared differences from the mean
+	uint32_t pushes;	// since the last resync
+};
+
+// returns 0 on success, -1 when the window can't be allocated
+int rollstat_init(struct rollstat_t *s, int window);
+void rollstat_free(struct rollstat_t *s);
+// empty the window
+void rollstat_clear(struct rollstat_t *s);
+// add value to the window, the oldest sample drops out when the window is full
+void rollstat_push(struct rollstat_t *s, int value);
+double rollstat_mean(const struct rollstat_t *s);
+// population variance (divided by count) of the window
+double rollstat_variance(const struct rollstat_t *s);
+double rollstat_stdev(const struct rollstat_t *s);
+// copy the samples oldest first into out, returns the number copied
+int rollstat_copy(const struct rollstat_t *s, int *out);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+
+	rollup.c
+
+	hourly and daily snow depth aggregates kept in append-only files next to the history store.
+	History records are aggregated a bucket at a time: the filtered depths of a bucket are gathered
+	into a dense column and reduced by plain min, max and sum loops the compiler vectorizes, so
+	rebuilding a season of rollups is a few passes over contiguous memory.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rollup.h"
+
+void rollup_init(struct rollup_t *r, uint32_t resolution)
+{
+	memset(r, 0, sizeof(*r));
+	r->resolution = resolution;
+	r->fd = -1;
+}
+
+// fill name with the rollup file name of base for resolution. returns 0 on success, -1 when it doesn't fit
+int rollup_file_name(char *name, size_t len, const char *base, uint32_t resolution)
+{
+	if(snprintf(name, len, "%s.%s.rlp", base, resolution == ROLLUP_DAY ? "day" : "hour") >= (int)len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+// start of the bucket holding wall clock ms time, local hours and days
+int64_t rollup_bucket_start(int64_t time, uint32_t resolution)
+{
+	time_t t = (time_t)(time / 1000);
+	struct tm local;
+
+	if(localtime_r(&t, &local) == NULL)
+		return (time / ((int64_t)resolution * 1000)) * resolution * 1000;
+
+	local.tm_sec = 0;
+	local.tm_min = 0;
+	if(resolution == ROLLUP_DAY)
+	{
+		local.tm_hour = 0;
+		local.tm_isdst = -1; // midnight can be on the other side of a DST change
+	}
+
+	return (int64_t)mktime(&local) * 1000;
+}
+
+// start of the bucket after the one starting at wall clock ms start
+int64_t rollup_bucket_end(int64_t start, uint32_t resolution)
+{
+	time_t t = (time_t)(start / 1000);
+	struct tm local;
+
+	if(resolution != ROLLUP_DAY || localtime_r(&t, &local) == NULL)
+		return start + ((int64_t)resolution * 1000);
+
+	local.tm_mday++; // normalized by mktime()
+	local.tm_hour = 0;
+	local.tm_min = 0;
+	local.tm_sec = 0;
+	local.tm_isdst = -1;
+
+	return (int64_t)mktime(&local) * 1000;
+}
+
+// open or create the rollup file, dropping a torn last bucket, and resume after its last bucket. returns 0 on success, -1 on error (errno set)
+int rollup_open(struct rollup_t *r, const char *filename, uint32_t resolution)
+{
+	struct rollup_header_t h;
+	struct rollup_bucket_t last;
+	struct stat st;
+	off_t buckets = 0;
+
+	rollup_init(r, resolution);
+
+	if((r->fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0 || fstat(r->fd, &st) < 0)
+	{
+		rollup_close(r);
+		return -1;
+	}
+
+	if(st.st_size == 0)
+	{
+		memset(&h, 0, sizeof(h));
+		h.magic = ROLLUP_MAGIC;
+		h.version = ROLLUP_VERSION;
+		h.bucket_size = sizeof(struct rollup_bucket_t);
+		h.resolution = resolution;
+		if(write(r->fd, &h, sizeof(h)) != sizeof(h))
+		{
+			rollup_close(r);
+			return -1;
+		}
+		return 0;
+	}
+
+	if(pread(r->fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != ROLLUP_MAGIC || h.version != ROLLUP_VERSION ||
+		h.bucket_size != sizeof(struct rollup_bucket_t) || h.resolution != resolution)
+	{
+		rollup_close(r);
+		errno = EINVAL;
+		return -1;
+	}
+
+	buckets = (st.st_size - sizeof(h)) / sizeof(struct rollup_bucket_t);
+	if(sizeof(h) + (buckets * sizeof(struct rollup_bucket_t)) != (size_t)st.st_size) // torn append
+		ftruncate(r->fd, sizeof(h) + (buckets * sizeof(struct rollup_bucket_t)));
+
+	if(buckets > 0 && pread(r->fd, &last, sizeof(last), sizeof(h) + ((buckets - 1) * sizeof(last))) == sizeof(last))
+		r->resume = rollup_bucket_end(last.start, resolution);
+
+	return 0;
+}
+
+// write out and hand on the open bucket when it holds samples
+static int close_bucket(struct rollup_t *r)
+{
+	int rc = 0;
+
+	if(r->open.count > 0)
+	{
+		if(r->fd >= 0)
+		{
+			if(write(r->fd, &r->open, sizeof(r->open)) == sizeof(r->open))
+				r->written++;
+			else
+				rc = -1;
+		}
+		if(r->emit != NULL)
+			r->emit(&r->open, r->resolution, r->ctx);
+	}
+
+	r->end = 0;
+	return rc;
+}
+
+// close the open bucket if time is past it and open the one holding time
+static int roll(struct rollup_t *r, int64_t time)
+{
+	int rc = 0;
+
+	if(r->end != 0 && time < r->end)
+		return 0;
+
+	rc = close_bucket(r);
+
+	memset(&r->open, 0, sizeof(r->open));
+	r->open.start = rollup_bucket_start(time, r->resolution);
+	r->open.min = INT32_MAX;
+	r->open.max = INT32_MIN;
+	r->end = rollup_bucket_end(r->open.start, r->resolution);
+
+	return rc;
+}
+
+// min, max and sum of a dense column, branch free loops the compiler turns into SIMD min, max and widening adds
+static void column_reduce(const int32_t *column, size_t n, int32_t *min, int32_t *max, int64_t *sum)
+{
+	int32_t lo = *min, hi = *max;
+	int64_t s = 0;
+	size_t i = 0;
+
+	for(i = 0; i < n; i++)
+	{
+		lo = column[i] < lo ? column[i] : lo;
+		hi = column[i] > hi ? column[i] : hi;
+	}
+	for(i = 0; i < n; i++)
+		s += column[i];
+
+	*min = lo;
+	*max = hi;
+	*sum += s;
+}
+
+// add the snow depth sample value (mm, < 0 = none) at wall clock ms time. returns 0, -1 when a closed bucket can't be written
+int rollup_add(struct rollup_t *r, int64_t time, int32_t value)
+{
+	int rc = 0;
+
+	if(time < r->resume)
+		return 0;
+
+	rc = roll(r, time);
+	if(value >= 0)
+	{
+		r->open.min = value < r->open.min ? value : r->open.min;
+		r->open.max = value > r->open.max ? value : r->open.max;
+		r->open.sum += value;
+		r->open.count++;
+		r->open.last = value;
+	}
+
+	return rc;
+}
+
+// add the filtered snow depth of n history records oldest first. returns 0, -1 when a closed bucket can't be written
+int rollup_add_records(struct rollup_t *r, const struct tsstore_record_t *records, size_t n)
+{
+	int32_t column[ROLLUP_COLUMN];
+	size_t i = 0, end = 0, k = 0, lo = 0, hi = 0, mid = 0;
+	int rc = 0;
+
+	for(lo = 0, hi = n; lo < hi; ) // skip records already in the file
+	{
+		mid = lo + ((hi - lo) / 2);
+		if(records[mid].time < r->resume)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for(i = lo; i < n; i = end)
+	{
+		if(roll(r, records[i].time) < 0)
+			rc = -1;
+
+		for(lo = i, hi = n; lo < hi; ) // records of the open bucket end at the first one past it
+		{
+			mid = lo + ((hi - lo) / 2);
+			if(records[mid].time < r->end)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		end = lo;
+
+		while(i < end) // gather good depths into a dense column, a chunk at a time
+		{
+			for(k = 0; i < end && k < ROLLUP_COLUMN; i++)
+			{
+				column[k] = records[i].filtered;
+				k += records[i].filtered >= 0; // kept when good, overwritten otherwise
+			}
+			if(k == 0)
+				continue;
+
+			column_reduce(column, k, &r->open.min, &r->open.max, &r->open.sum);
+			r->open.count += k;
+			r->open.last = column[k - 1];
+		}
+	}
+
+	return rc;
+}
+
+// close the open bucket, e.g. at the end of a query. returns 0, -1 when it can't be written
+int rollup_flush(struct rollup_t *r)
+{
+	return close_bucket(r);
+}
+
+void rollup_close(struct rollup_t *r)
+{
+	if(r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+	r->end = 0;
+}
+
+// read the buckets of a rollup file into *buckets (malloc()ed). returns the count, -1 on error (errno set)
+long rollup_read(const char *filename, uint32_t resolution, struct rollup_bucket_t **buckets)
+{
+	struct rollup_header_t h;
+	struct stat st;
+	long count = 0;
+	int fd = -1;
+
+	*buckets = NULL;
+	if((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if(fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != ROLLUP_MAGIC || h.version != ROLLUP_VERSION ||
+		h.bucket_size != sizeof(struct rollup_bucket_t) || h.resolution != resolution)
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	count = (st.st_size - sizeof(h)) / sizeof(struct rollup_bucket_t);
+	if(count > 0 && ((*buckets = (struct rollup_bucket_t *)malloc(count * sizeof(struct rollup_bucket_t))) == NULL ||
+		pread(fd, *buckets, count * sizeof(struct rollup_bucket_t), sizeof(h)) != (ssize_t)(count * sizeof(struct rollup_bucket_t))))
+	{
+		free(*buckets);
+		*buckets = NULL;
+		close(fd);
+		errno = errno == 0 ? EIO : errno;
+		return -1;
+	}
+	close(fd);
+
+	return count;
+}
@@ -0,0 +1,76 @@
+/*
+
+	rollup.h
+
+	hourly and daily snow depth aggregates (min, max, mean, count, last) kept next to the history
+	store in append-only files base.hour.rlp and base.day.rlp. A bucket is written once the first
+	sample of a later bucket arrives, the open bucket is rebuilt from the history store at start.
+
+*/
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tsstore.h"
+
+// defines
+#define ROLLUP_MAGIC 0x4C52534D // "MSRL" little endian
+#define ROLLUP_VERSION 1
+#define ROLLUP_HOUR 3600
+#define ROLLUP_DAY 86400 // local calendar days, 23 or 25 hours on DST changes
+#define ROLLUP_COLUMN 256 // values gathered into one column per kernel call
+
+// structs
+struct rollup_header_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t bucket_size;
+	uint32_t resolution;	// ROLLUP_HOUR or ROLLUP_DAY
+	uint32_t reserved;
+};
+
+struct rollup_bucket_t
+{
+	int64_t start;			// wall clock ms
+	int32_t min;			// mm
+	int32_t max;
+	int64_t sum;			// mean is sum / count
+	uint32_t count;			// samples with a snow depth
+	int32_t last;
+};
+
+// one resolution being built, from the plug-in sample by sample or from the history store by the query tool
+struct rollup_t
+{
+	uint32_t resolution;
+	int fd;					// rollup file closed buckets are appended to, -1 = none
+	int64_t resume;			// wall clock ms, samples before it are already in the file
+	int64_t end;			// wall clock ms the open bucket ends, 0 = none open
+	struct rollup_bucket_t open;
+	unsigned long written;	// buckets appended
+	void (*emit)(const struct rollup_bucket_t *b, uint32_t resolution, void *ctx); // optional, called for each closed bucket
+	void *ctx;
+};
+
+void rollup_init(struct rollup_t *r, uint32_t resolution);
+// fill name with the rollup file name of base for resolution. returns 0 on success, -1 when it doesn't fit
+int rollup_file_name(char *name, size_t len, const char *base, uint32_t resolution);
+// open or create the rollup file, dropping a torn last bucket, and resume after its last bucket. returns 0 on success, -1 on error (errno set)
+int rollup_open(struct rollup_t *r, const char *filename, uint32_t resolution);
+// add the snow depth sample value (mm, < 0 = none) at wall clock ms time. returns 0, -1 when a closed bucket can't be written
+int rollup_add(struct rollup_t *r, int64_t time, int32_t value);
+// add the filtered snow depth of n history records oldest first. returns 0, -1 when a closed bucket can't be written
+int rollup_add_records(struct rollup_t *r, const struct tsstore_record_t *records, size_t n);
+// close the open bucket, e.g. at the end of a query. returns 0, -1 when it can't be written
+int rollup_flush(struct rollup_t *r);
+void rollup_close(struct rollup_t *r);
+// read the buckets of a rollup file into *buckets (malloc()ed). returns the count, -1 on error (errno set)
+long rollup_read(const char *filename, uint32_t resolution, struct rollup_bucket_t **buckets);
+// start of the bucket holding wall clock ms time, and the start of the bucket after the one starting at start
+int64_t rollup_bucket_start(int64_t time, uint32_t resolution);
+int64_t rollup_bucket_end(int64_t start, uint32_t resolution);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+
+	sched.c
+
+	multi-rate poll scheduler. Each reading (snow depth, battery volts, charger status and the
+	optional range and RSSI) is due on its own interval boundaries since local midnight. One
+	absolute CLOCK_MONOTONIC timer wakes the plug-in at the earliest due time, readings of a gauge
+	that fall due together are taken in one transaction. Due times are wall clock boundaries
+	computed fresh at every wake, so late wakes don't add up to drift and DST changes only move
+	boundaries, they don't stretch or skip intervals.
+
+	Polls start ahead of their boundary by the gauges recent acquisition latency (lookahead) and
+	their readings are held until the boundary, so meteohub gets them at the boundary instead of
+	a variable number of seconds after it.
+
+*/
+
+#include "mhsdpi.h"
+
+static struct gauge_t *sched_gauges = NULL;
+static int sched_num_gauges = 0;
+static int sched_timerfd = -1;
+
+static const char *metric_names[NUMMETRICS] = {"snow depth", "battery volts", "charger status", "range", "RSSI"};
+
+// battery volts and charger status with a 0 interval are taken with every snow depth poll
+static const boolean metric_with_depth[NUMMETRICS] = {false, true, true, false, false};
+
+static void sched_on_timer(int fd, uint32_t events, void *ctx);
+
+// seconds between polls of metric, the snow depth interval is set by the adaptive cadence. 0 = not scheduled on its own
+static uint32_t sched_interval(const struct gauge_t *g, enum metric_t m)
+{
+	switch(m)
+	{
+		case METRIC_DEPTH: return g->cadence.interval;
+		case METRIC_VOLTAGE: return g->config->battery_seconds;
+		case METRIC_CHARGER: return g->config->charger_seconds;
+		case METRIC_RANGE: return g->config->range_seconds;
+		case METRIC_RSSI: return g->config->rssi_seconds;
+		default: return 0;
+	}
+}
+
+// first interval boundary since local midnight after wall clock second now, boundaries start over at midnight
+static int64_t sched_align(int64_t now, uint32_t interval)
+{
+	struct tm local;
+	time_t t = (time_t)now;
+	int64_t since = 0, next = 0;
+
+	if(localtime_r(&t, &local) == NULL)
+		return ((now / interval) + 1) * interval;
+
+	since = (local.tm_hour * 3600) + (local.tm_min * 60) + local.tm_sec; // seconds of the local clock face since midnight
+	next = ((since / interval) + 1) * interval;
+	if(next > 86400) // an interval that doesn't divide the day is cut short at midnight
+		next = 86400;
+
+	return now + (next - since);
+}
+
+// wall clock ms a poll of metric m has to start, its boundary less the gauges lookahead
+static int64_t sched_start_ms(const struct gauge_t *g, enum metric_t m)
+{
+	return (g->due[m] * 1000) - g->lookahead.lead;
+}
+
+// wall clock ms of the next poll start of any gauge, 0 when nothing is scheduled
+static int64_t sched_next_ms(void)
+{
+	int64_t next = 0;
+	int i = 0, m = 0;
+
+	for(i = 0; i < sched_num_gauges; i++)
+		for(m = 0; m < NUMMETRICS; m++)
+			if(sched_gauges[i].due[m] != 0 && (next == 0 || sched_start_ms(&sched_gauges[i], (enum metric_t)m) < next))
+				next = sched_start_ms(&sched_gauges[i], (enum metric_t)m);
+
+	return next;
+}
+
+// arm the timer for the earliest poll start of any gauge
+static void sched_arm(void)
+{
+	int64_t next = sched_next_ms();
+	int64_t wall = get_wall_ms();
+	uint64_t mono = get_monotonic_ms();
+
+	if(next == 0)
+		return;
+
+	evtimer_arm_at_ms(sched_timerfd, next > wall ? mono + (next - wall) : mono); // wall clock start time on the monotonic clock
+}
+
+// wall clock second of the next wake, 0 when nothing is scheduled
+int64_t sched_next_wake(void)
+{
+	return sched_next_ms() / 1000;
+}
+
+// recompute the snow depth due time after the adaptive cadence changed its interval
+void sched_reschedule(struct gauge_t *g)
+{
+	if(sched_timerfd < 0)
+		return;
+
+	g->due[METRIC_DEPTH] = sched_align((get_wall_ms() + g->lookahead.lead + SCHEDSLACKMS) / 1000, sched_interval(g, METRIC_DEPTH)); // leave time for the lookahead
+	sched_arm();
+}
+
+// schedule the readings of all gauges and create the scheduler timer. returns 0 on success, -1 on error
+int sched_init(struct evloop_t *loop, struct gauge_t *gauges, int num_gauges)
+{
+	int64_t now = get_wall_ms() / 1000;
+	uint32_t interval = 0;
+	struct gauge_t *g = NULL;
+	int i = 0, m = 0;
+
+	sched_gauges = gauges;
+	sched_num_gauges = num_gauges;
+
+	if((sched_timerfd = evtimer_create()) < 0 || evloop_add(loop, sched_timerfd, EPOLLIN, sched_on_timer, NULL) < 0)
+		return -1;
+
+	for(i = 0; i < num_gauges; i++)
+	{
+		g = &gauges[i];
+		for(m = 0; m < NUMMETRICS; m++)
+			g->due[m] = (interval = sched_interval(g, (enum metric_t)m)) > 0 ? sched_align(now, interval) : 0;
+	}
+
+	sched_arm();
+
+	return 0;
+}
+
+// start the polls that are due, one transaction per gauge, and re-arm for the next start
+static void sched_on_timer(int fd, uint32_t events, void *ctx)
+{
+	char message_buffer[256];
+	struct gauge_t *g = NULL;
+	int64_t now = 0, boundary = 0;
+	int i = 0, m = 0, metrics = 0;
+
+	evtimer_ack(fd);
+
+	now = get_wall_ms() + SCHEDSLACKMS;
+	for(i = 0; i < sched_num_gauges; i++)
+	{
+		g = &sched_gauges[i];
+		metrics = 0;
+		boundary = 0;
+
+		for(m = 0; m < NUMMETRICS; m++)
+		{
+			if(g->due[m] == 0 || sched_start_ms(g, (enum metric_t)m) > now)
+				continue;
+			metrics |= METRICBIT(m);
+			if(boundary == 0 || g->due[m] < boundary)
+				boundary = g->due[m];
+			g->due[m] = sched_align(g->due[m] > now / 1000 ? g->due[m] : now / 1000, sched_interval(g, (enum metric_t)m)); // started ahead of the boundary, the next one is after it
+		}
+
+		if(metrics & METRICBIT(METRIC_DEPTH))
+		{
+			for(m = 0; m < NUMMETRICS; m++)
+				if(metric_with_depth[m] && g->due[m] == 0)
+					metrics |= METRICBIT(m);
+			cadence_polled(g, boundary);
+		}
+
+		if(metrics == 0 || gauge_poll(g, metrics, boundary * 1000) || !g->initialized)
+			continue;
+
+		for(m = 0; m < NUMMETRICS && !(metrics & METRICBIT(m)); m++) // name the first skipped reading
+			;
+		snprintf(message_buffer, sizeof(message_buffer), "%s, skipping this %s poll", g->state == GAUGE_CLOSED ? "Device not connected" : "Gauge still busy", metric_names[m]);
+		gauge_log_level(g, LOGGER_WARNING, message_buffer);
+	}
+
+	sched_arm();
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+// 95th percentile of the latencies in the ring
+static int lookahead_p95(const struct lookahead_t *la)
+{
+	int sorted[LOOKAHEADSAMPLES];
+
+	memcpy(sorted, la->latencies, sizeof(int) * la->count);
+	qsort(sorted, la->count, sizeof(int), compare_int);
+
+	return sorted[((la->count * 95) + 99) / 100 - 1];
+}
+
+// returns 0 on success, -1 when the jitter window can't be allocated
+int sched_lookahead_init(struct gauge_t *g)
+{
+	memset(&g->lookahead, 0, sizeof(g->lookahead));
+
+	return rollstat_init(&g->lookahead.jitter, LOOKAHEADSAMPLES);
+}
+
+// account for a poll cycle being emitted now: add its acquisition latency when all its commands were answered,
+// its emit offset from the boundary, and move the lookahead to the p95 latency (or the average when higher)
+void sched_acquired(struct gauge_t *g)
+{
+	struct lookahead_t *la = &g->lookahead;
+	int offset = 0;
+	uint32_t lead = 0, cap = g->cadence.interval * 500; // half the snow depth interval, polls must not overlap
+
+	if(la->emit_at > 0)
+	{
+		offset = (int)(get_wall_ms() - la->emit_at);
+		rollstat_push(&la->jitter, offset);
+		if(abs(offset) > la->max_jitter)
+			la->max_jitter = abs(offset);
+	}
+
+	if(la->latency == 0)
+		return;
+
+	la->ewma = la->count == 0 ? la->latency : (LOOKAHEADALPHA * la->latency) + ((1 - LOOKAHEADALPHA) * la->ewma);
+	if(la->count < LOOKAHEADSAMPLES)
+		la->latencies[(la->head + la->count++) % LOOKAHEADSAMPLES] = la->latency;
+	else
+	{
+		la->latencies[la->head] = la->latency;
+		la->head = (la->head + 1) % LOOKAHEADSAMPLES;
+	}
+
+	lead = lookahead_p95(la);
+	if(la->ewma > lead)
+		lead = (uint32_t)la->ewma;
+	lead += LOOKAHEADMARGIN;
+	la->lead = lead < cap ? lead : cap;
+}
+
+// log acquisition latency, lookahead and emit jitter
+void sched_report(struct gauge_t *g)
+{
+	struct lookahead_t *la = &g->lookahead;
+	char message_buffer[256];
+
+	if(la->count == 0)
+		return;
+
+	snprintf(message_buffer, sizeof(message_buffer), "Acquisition latency %.0f ms average, %d ms p95, polls start %u ms early, emit jitter %+.0f ms mean %.0f ms sd %d ms max",
+		la->ewma, lookahead_p95(la), la->lead, rollstat_mean(&la->jitter), rollstat_stdev(&la->jitter), la->max_jitter);
+	gauge_log(g, message_buffer);
+}
@@ -0,0 +1,327 @@
+/*
+
+	sink.c
+
+	batched CSV, InfluxDB line protocol and JSON lines output files
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sink.h"
+
+static const char csv_header[] = "time,gauge,device,raw,filtered,smoothed,volts,charger,retries,error\n";
+
+// set up sink s writing format (SINK_CSV, ...) to files named by pattern, no file is opened before the first line
+void sink_init(struct sink_t *s, int format, const char *pattern, int batch, uint32_t flush_ms, int fsync_policy)
+{
+	memset(s, 0, sizeof(*s));
+	s->format = format;
+	strncpy(s->pattern, pattern, sizeof(s->pattern) - 1);
+	s->fd = -1;
+	s->batch = batch < 1 ? 1 : (batch > SINK_MAXBATCH ? SINK_MAXBATCH : batch);
+	s->flush_ms = flush_ms;
+	s->fsync_policy = fsync_policy;
+}
+
+// SINK_FSYNC_* for a policy name (none, batch, rotate), -1 for an unknown one
+int sink_fsync_policy(const char *name)
+{
+	if(strcmp(name, "none") == 0)
+		return SINK_FSYNC_NONE;
+	if(strcmp(name, "batch") == 0)
+		return SINK_FSYNC_BATCH;
+	if(strcmp(name, "rotate") == 0)
+		return SINK_FSYNC_ROTATE;
+
+	return -1;
+}
+
+// copy in to out (len bytes) with a backslash before each character in special, control characters are dropped
+static void escape(char *out, size_t len, const char *in, const char *special)
+{
+	size_t n = 0;
+
+	for(; *in != '\0' && n + 2 < len; in++)
+	{
+		if((unsigned char)*in < ' ')
+			continue;
+		if(strchr(special, *in) != NULL)
+			out[n++] = '\\';
+		out[n++] = *in;
+	}
+	out[n] = '\0';
+}
+
+// copy device into out (len bytes) as a CSV field, quoted with doubled quotes when it holds a comma or quote
+static void csv_field(char *out, size_t len, const char *in)
+{
+	size_t n = 0;
+	int quote = strpbrk(in, ",\"") != NULL;
+
+	if(quote)
+		out[n++] = '"';
+	for(; *in != '\0' && n + 3 < len; in++)
+	{
+		if((unsigned char)*in < ' ')
+			continue;
+		if(*in == '"')
+			out[n++] = '"';
+		out[n++] = *in;
+	}
+	if(quote)
+		out[n++] = '"';
+	out[n] = '\0';
+}
+
+// append printf output of an int to line (len bytes) at *n, output that doesn't fit is cut off
+static void append(char *line, size_t len, size_t *n, const char *format, int value)
+{
+	int added = 0;
+
+	if((added = snprintf(&line[*n], len - *n, format, value)) > 0)
+		*n = (*n + added) < len ? *n + added : len - 1;
+}
+
+// append printf output of a string to line (len bytes) at *n, output that doesn't fit is cut off
+static void append_text(char *line, size_t len, size_t *n, const char *format, const char *value)
+{
+	int added = 0;
+
+	if((added = snprintf(&line[*n], len - *n, format, value)) > 0)
+		*n = (*n + added) < len ? *n + added : len - 1;
+}
+
+// format the line for record r, readings not taken or failed are left out. returns its length
+static size_t format_line(const struct sink_t *s, const struct tsstore_record_t *r, const char *device, char *line, size_t len)
+{
+	char when[32], dev[256], volts[16] = "";
+	time_t t = (time_t)(r->time / 1000);
+	struct tm local;
+	int depth = (r->metrics & TSSTORE_HAS_DEPTH) != 0 && r->raw >= 0;
+	int charger = (r->metrics & TSSTORE_HAS_CHARGER) != 0 && r->charger >= 0;
+	size_t n = 0;
+
+	localtime_r(&t, &local);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S%z", &local);
+	if((r->metrics & TSSTORE_HAS_VOLTS) != 0 && r->volts >= 0)
+		snprintf(volts, sizeof(volts), "%d.%02d", r->volts / 100, r->volts % 100);
+
+	switch(s->format)
+	{
+		case SINK_CSV:
+			csv_field(dev, sizeof(dev), device);
+			append_text(line, len, &n, "%s,", when);
+			append(line, len, &n, "%d,", r->gauge);
+			append_text(line, len, &n, "%s,", dev);
+			if(depth)
+			{
+				append(line, len, &n, "%d,", r->raw);
+				append(line, len, &n, "%d,", r->filtered);
+				append(line, len, &n, "%d,", r->smoothed);
+			}
+			else
+				append_text(line, len, &n, "%s", ",,,");
+			append_text(line, len, &n, "%s,", volts);
+			if(charger)
+				append(line, len, &n, "%d", r->charger);
+			append(line, len, &n, ",%d", r->retries);
+			append(line, len, &n, ",%d\n", r->error);
+			break;
+
+		case SINK_INFLUX:
+			escape(dev, sizeof(dev), device, ", =");
+			append(line, len, &n, "snowdepth,gauge=%d", r->gauge);
+			append_text(line, len, &n, ",device=%s ", dev);
+			if(depth)
+			{
+				append(line, len, &n, "raw=%di,", r->raw);
+				append(line, len, &n, "filtered=%di,", r->filtered);
+				append(line, len, &n, "smoothed=%di,", r->smoothed);
+			}
+			if(volts[0] != '\0')
+				append_text(line, len, &n, "volts=%s,", volts);
+			if(charger)
+				append(line, len, &n, "charger=%di,", r->charger);
+			append(line, len, &n, "retries=%di,", r->retries);
+			append(line, len, &n, "error=%di", r->error);
+			snprintf(when, sizeof(when), " %lld000000\n", (long long)r->time); // ns
+			append_text(line, len, &n, "%s", when);
+			break;
+
+		case SINK_JSONL:
+			escape(dev, sizeof(dev), device, "\"\\");
+			append_text(line, len, &n, "{\"time\":\"%s\"", when);
+			append(line, len, &n, ",\"gauge\":%d", r->gauge);
+			append_text(line, len, &n, ",\"device\":\"%s\"", dev);
+			if(depth)
+			{
+				append(line, len, &n, ",\"raw\":%d", r->raw);
+				append(line, len, &n, ",\"filtered\":%d", r->filtered);
+				append(line, len, &n, ",\"smoothed\":%d", r->smoothed);
+			}
+			if(volts[0] != '\0')
+				append_text(line, len, &n, ",\"volts\":%s", volts);
+			if(charger)
+				append(line, len, &n, ",\"charger\":%d", r->charger);
+			append(line, len, &n, ",\"retries\":%d", r->retries);
+			append(line, len, &n, ",\"error\":%d}\n", r->error);
+			break;
+	}
+
+	if(n > 0 && line[n - 1] != '\n') // cut off, keep line framing
+		line[n - 1] = '\n';
+
+	return n;
+}
+
+// queue len bytes of text as the next iovec of the batch
+static void queue(struct sink_t *s, const char *text, size_t len, uint64_t now_ms)
+{
+	memcpy(&s->buf[s->used], text, len);
+	s->iov[s->lines].iov_base = &s->buf[s->used];
+	s->iov[s->lines].iov_len = len;
+	if(s->lines++ == 0)
+		s->first_ms = now_ms;
+	s->used += len;
+}
+
+// write the buffered lines to the file open now and switch to file name
+static int rotate(struct sink_t *s, const char *name, uint64_t now_ms)
+{
+	struct stat st;
+	int rc = 0;
+
+	rc = sink_flush(s);
+	if(s->fd >= 0)
+	{
+		if(s->fsync_policy == SINK_FSYNC_ROTATE)
+			fsync(s->fd);
+		close(s->fd);
+	}
+
+	strcpy(s->name, name);
+	if((s->fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+	{
+		s->name[0] = '\0';
+		return -1;
+	}
+
+	if(s->format == SINK_CSV && fstat(s->fd, &st) == 0 && st.st_size == 0)
+		queue(s, csv_header, sizeof(csv_header) - 1, now_ms);
+
+	return rc;
+}
+
+// add the line for record r of the gauge on device, writing the batch when it is full or the file rotates. returns 0 on success, -1 on error (errno set)
+int sink_write(struct sink_t *s, const struct tsstore_record_t *r, const char *device, uint64_t now_ms)
+{
+	char name[FILENAME_MAX];
+	char line[SINK_MAXLINE];
+	time_t t = (time_t)(r->time / 1000);
+	struct tm local;
+	size_t len = 0;
+	int rc = 0;
+
+	localtime_r(&t, &local);
+	if(strftime(name, sizeof(name), s->pattern, &local) == 0)
+	{
+		s->dropped++;
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if((s->fd < 0 || strcmp(name, s->name) != 0) && rotate(s, name, now_ms) < 0)
+		rc = -1;
+	if(s->fd < 0)
+	{
+		s->dropped++;
+		return -1;
+	}
+
+	len = format_line(s, r, device, line, sizeof(line));
+	if(s->used + len > SINK_BUFSIZE || s->lines == SINK_MAXBATCH + 1)
+		rc |= sink_flush(s);
+	queue(s, line, len, now_ms);
+
+	if(s->lines >= s->batch)
+		rc |= sink_flush(s);
+
+	return rc;
+}
+
+// write the buffered lines with one writev(). returns 0 on success, -1 on error (errno set), the lines are dropped either way
+int sink_flush(struct sink_t *s)
+{
+	struct iovec *iov = s->iov;
+	int count = s->lines, rc = 0;
+	ssize_t n = 0;
+
+	if(count == 0)
+		return 0;
+
+	if(s->fd < 0)
+	{
+		s->dropped += count;
+		rc = -1;
+	}
+
+	while(s->fd >= 0 && count > 0)
+	{
+		if((n = writev(s->fd, iov, count)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			s->dropped += count;
+			rc = -1;
+			break;
+		}
+		s->writes++;
+
+		while(count > 0 && (size_t)n >= iov->iov_len) // short write, e.g. a full disk, go on from where it stopped
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+			s->written++;
+		}
+		if(count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	if(rc == 0 && s->fsync_policy == SINK_FSYNC_BATCH && fdatasync(s->fd) < 0)
+		rc = -1;
+
+	s->lines = 0;
+	s->used = 0;
+	s->first_ms = 0;
+
+	return rc;
+}
+
+// CLOCK_MONOTONIC ms the buffered lines have to be written by, 0 when none are buffered
+uint64_t sink_deadline(const struct sink_t *s)
+{
+	return s->lines > 0 ? s->first_ms + s->flush_ms : 0;
+}
+
+void sink_close(struct sink_t *s)
+{
+	sink_flush(s);
+	if(s->fd >= 0)
+	{
+		if(s->fsync_policy != SINK_FSYNC_NONE)
+			fsync(s->fd);
+		close(s->fd);
+	}
+	s->fd = -1;
+	s->name[0] = '\0';
+}
@@ -0,0 +1,68 @@
+/*
+
+	sink.h
+
+	batched output files for consumers other than meteohub: CSV, InfluxDB line protocol and JSON
+	lines. Lines are formatted into a per sink buffer and written with one writev() per batch to a
+	file kept open between batches. File names are strftime() patterns of the reading time, so
+	e.g. snowdepth-%Y%m%d.csv starts a new file every day.
+
+*/
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "tsstore.h"
+
+// defines
+#define SINK_MAXBATCH 64 // lines per writev()
+#define SINK_BUFSIZE (SINK_MAXBATCH * 256)
+#define SINK_MAXLINE 512
+
+// output formats
+#define SINK_CSV 0
+#define SINK_INFLUX 1
+#define SINK_JSONL 2
+
+// fsync policies
+#define SINK_FSYNC_NONE 0	// leave write back to the kernel
+#define SINK_FSYNC_BATCH 1	// fdatasync() after every batch
+#define SINK_FSYNC_ROTATE 2	// fsync() a file when rotating away from it or closing it
+
+// structs
+struct sink_t
+{
+	int format;
+	char pattern[FILENAME_MAX];		// strftime() pattern of the file name
+	char name[FILENAME_MAX];		// file open now
+	int fd;
+	int batch;						// lines buffered before they are written
+	uint32_t flush_ms;				// max ms a line stays buffered
+	int fsync_policy;
+	char buf[SINK_BUFSIZE];
+	size_t used;
+	struct iovec iov[SINK_MAXBATCH + 1];	// one per line, plus the CSV header of a new file
+	int lines;
+	uint64_t first_ms;				// CLOCK_MONOTONIC ms the oldest buffered line was added
+	unsigned long written;			// lines written
+	unsigned long writes;			// writev() calls
+	unsigned long dropped;			// lines lost to write errors
+};
+
+// set up sink s writing format (SINK_CSV, ...) to files named by pattern, no file is opened before the first line
+void sink_init(struct sink_t *s, int format, const char *pattern, int batch, uint32_t flush_ms, int fsync_policy);
+// add the line for record r of the gauge on device, writing the batch when it is full or the file rotates. returns 0 on success, -1 on error (errno set)
+int sink_write(struct sink_t *s, const struct tsstore_record_t *r, const char *device, uint64_t now_ms);
+// write the buffered lines with one writev(). returns 0 on success, -1 on error (errno set), the lines are dropped either way
+int sink_flush(struct sink_t *s);
+// CLOCK_MONOTONIC ms the buffered lines have to be written by, 0 when none are buffered
+uint64_t sink_deadline(const struct sink_t *s);
+void sink_close(struct sink_t *s);
+// SINK_FSYNC_* for a policy name (none, batch, rotate), -1 for an unknown one
+int sink_fsync_policy(const char *name);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+
+	snapshot.c
+
+	versioned, checksummed state files replaced atomically (write temp file, fsync, rename)
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+// CRC-32 (IEEE 802.3) of len bytes continuing from crc, start with 0
+uint32_t snapshot_crc32(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	int bit = 0;
+
+	crc = ~crc;
+	while(len-- > 0)
+	{
+		crc ^= *p++;
+		for(bit = 0; bit < 8; bit++) // bitwise, snapshots are small and written once per poll
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+// write all of len bytes, returns 0 on success, -1 on error
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	ssize_t n = 0;
+
+	while(len > 0)
+	{
+		if((n = write(fd, p, len)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// atomically replace filename with a snapshot of len payload bytes. returns 0 on success, -1 on error (errno set)
+int snapshot_write(const char *filename, uint16_t version, const void *payload, size_t len)
+{
+	struct snapshot_header_t h;
+	char tmpname[FILENAME_MAX];
+	char dirname_buf[FILENAME_MAX];
+	int fd = -1, dirfd = -1;
+	int err = 0;
+
+	if(snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >= (int)sizeof(tmpname))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = version;
+	h.header_size = sizeof(h);
+	h.length = len;
+	h.crc = snapshot_crc32(0, payload, len);
+	h.saved = time(NULL);
+
+	if((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	if(write_all(fd, &h, sizeof(h)) < 0 || write_all(fd, payload, len) < 0 || fsync(fd) < 0)
+	{
+		err = errno;
+		close(fd);
+		unlink(tmpname);
+		errno = err;
+		return -1;
+	}
+	close(fd);
+
+	if(rename(tmpname, filename) < 0)
+	{
+		err = errno;
+		unlink(tmpname);
+		errno = err;
+		return -1;
+	}
+
+	strncpy(dirname_buf, filename, sizeof(dirname_buf) - 1); // make the rename itself durable
+	dirname_buf[sizeof(dirname_buf) - 1] = '\0';
+	if((dirfd = open(dirname(dirname_buf), O_RDONLY | O_CLOEXEC)) >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	return 0;
+}
+
+// read the snapshot in filename into payload (maxlen bytes), sets *len and *saved. returns SNAPSHOT_OK or an error above
+int snapshot_read(const char *filename, uint16_t version, void *payload, size_t maxlen, size_t *len, int64_t *saved)
+{
+	struct snapshot_header_t h;
+	FILE *fp = NULL;
+	int rc = SNAPSHOT_OK;
+
+	if((fp = fopen(filename, "rb")) == NULL)
+		return SNAPSHOT_MISSING;
+
+	if(fread(&h, sizeof(h), 1, fp) != 1 || h.magic != SNAPSHOT_MAGIC || h.header_size != sizeof(h))
+		rc = SNAPSHOT_CORRUPT;
+	else if(h.version != version)
+		rc = SNAPSHOT_VERSION;
+	else if(h.length > maxlen || fread(payload, 1, h.length, fp) != h.length || fgetc(fp) != EOF || snapshot_crc32(0, payload, h.length) != h.crc)
+		rc = SNAPSHOT_CORRUPT;
+	fclose(fp);
+
+	if(rc == SNAPSHOT_OK)
+	{
+		*len = h.length;
+		*saved = h.saved;
+	}
+
+	return rc;
+}
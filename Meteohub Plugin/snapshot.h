@@ -0,0 +1,42 @@
+/*
+
+	snapshot.h
+
+	versioned, checksummed state files replaced atomically (write temp file, fsync, rename)
+	so a crash or power cut while saving leaves either the old or the new state, never a mix
+
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define SNAPSHOT_MAGIC 0x4453484D // "MHSD" little endian
+
+// snapshot_read() results
+#define SNAPSHOT_OK 0
+#define SNAPSHOT_MISSING -1		// no file or unreadable
+#define SNAPSHOT_CORRUPT -2		// bad magic, length or checksum, e.g. a raw readings file from an older version
+#define SNAPSHOT_VERSION -3		// written by a version with another payload layout
+
+// structs
+struct snapshot_header_t
+{
+	uint32_t magic;
+	uint16_t version;		// payload layout
+	uint16_t header_size;
+	uint32_t length;		// payload bytes following the header
+	uint32_t crc;			// CRC-32 of the payload
+	int64_t saved;			// wall clock seconds (time()) when written
+};
+
+// CRC-32 (IEEE 802.3) of len bytes continuing from crc, start with 0
+uint32_t snapshot_crc32(uint32_t crc, const void *data, size_t len);
+// atomically replace filename with a snapshot of len payload bytes. returns 0 on success, -1 on error (errno set)
+int snapshot_write(const char *filename, uint16_t version, const void *payload, size_t len);
+// read the snapshot in filename into payload (maxlen bytes), sets *len and *saved. returns SNAPSHOT_OK or an error above
+int snapshot_read(const char *filename, uint16_t version, void *payload, size_t maxlen, size_t *len, int64_t *saved);
+
+#endif
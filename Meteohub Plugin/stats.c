@@ -0,0 +1,331 @@
+/*
+
+	stats.c
+
+	per command reply latency, retry, timeout and firmware error counters of every gauge, with the
+	poll cycle latency, filter rejections and link I/O counters. Written as a Prometheus text file
+	(STATS_FILE_NAME, e.g. for the node_exporter textfile collector) every STATS_SECONDS, and dumped
+	to stderr by --stats after one poll cycle of every gauge, to find the gauges and links that use
+	up the poll cycle budget.
+
+*/
+
+#include "mhsdpi.h"
+
+static const char stats_commands[NUMCOMMANDS + 1] = "ABCDGNRSTV"; // command letter of each command_stats_t
+static const char *firmware_errors[NUMFIRMWAREERRORS] = {"-1000", "-2000", "-3000", "-4000", "-5000", "other"};
+static const char *attempt_names[STATSATTEMPTS] = {"1", "2", "3", "4+"};
+
+static struct gauge_t *stats_gauges = NULL;
+static int stats_num_gauges = 0;
+static struct config_t *stats_config = NULL;
+static char *stats_myname = NULL;
+static struct evloop_t *stats_loop = NULL;
+static int stats_timerfd = -1;
+static uint64_t stats_once_deadline = 0;	// CLOCK_MONOTONIC ms --stats gives up on gauges that don't answer
+static boolean stats_finished = false;
+
+static void stats_on_timer(int fd, uint32_t events, void *ctx);
+
+static void stats_log(char *message)
+{
+	if(stats_config->write_log)
+		writelog(stats_config->log_file_name, stats_myname, message);
+	else
+		fprintf(stderr, "%s.\n", message);
+}
+
+// set up the stats file timer, or the poll once timer of --stats. returns 0 on success, -1 on error
+int stats_init(struct evloop_t *loop, struct config_t *config, char *myname, struct gauge_t *gauges, int num_gauges)
+{
+	stats_gauges = gauges;
+	stats_num_gauges = num_gauges;
+	stats_config = config;
+	stats_myname = myname;
+	stats_loop = loop;
+
+	if(!config->stats_once && (config->stats_file_name[0] == NUL || config->stats_seconds == 0))
+		return 0;
+
+	if((stats_timerfd = evtimer_create()) < 0 || evloop_add(loop, stats_timerfd, EPOLLIN, stats_on_timer, NULL) < 0)
+		return -1;
+
+	if(config->stats_once)
+	{
+		stats_once_deadline = get_monotonic_ms() + (STATSONCESECONDS * 1000);
+		evtimer_arm_ms(stats_timerfd, STATSONCEINTERVAL);
+	}
+	else
+		evtimer_arm_ms(stats_timerfd, config->stats_seconds * 1000);
+
+	return 0;
+}
+
+// count event of command i of the gauge's current transaction, value is the reply of STATS_REPLY
+void stats_command(struct gauge_t *g, int i, enum stats_event_t event, int value)
+{
+	const char *cmd = strchr(stats_commands, g->txn.cmds[i]);
+	struct command_stats_t *s = NULL;
+	int tries = g->txn.tries[i];
+
+	if(g->txn.cmds[i] == NUL || cmd == NULL)
+		return;
+	s = &g->stats.commands[cmd - stats_commands];
+
+	switch(event)
+	{
+		case STATS_SENT:
+			s->sent++;
+			break;
+		case STATS_REPLY:
+			s->replies++;
+			histogram_add(&s->latency, (double)(get_monotonic_ms() - g->txn.sent_ms[i]));
+			if(value < 0)
+				s->errors[(value % 1000 == 0 && value >= -5000) ? (-value / 1000) - 1 : NUMFIRMWAREERRORS - 1]++;
+			break;
+		case STATS_BADREPLY:
+			s->bad_replies++;
+			break;
+		case STATS_TIMEOUT:
+			s->timeouts++;
+			break;
+		case STATS_RETRY:
+			s->retries++;
+			break;
+		case STATS_FAILED:
+			s->failures++;
+			// fall through
+		case STATS_DONE:
+			if(tries > 0)
+				s->attempts[(tries > STATSATTEMPTS ? STATSATTEMPTS : tries) - 1]++;
+			break;
+	}
+}
+
+// count a poll cycle the gauge emitted, --stats is done once every gauge emitted one
+void stats_polled(struct gauge_t *g)
+{
+	int i = 0;
+
+	g->stats.cycles++;
+	if(g->stats.cycle_ms > 0)
+	{
+		histogram_add(&g->stats.cycle, g->stats.cycle_ms);
+		window_add(&g->stats.recent, g->stats.cycle_ms, get_monotonic_ms());
+		g->stats.cycle_ms = 0;
+	}
+
+	if(!stats_config->stats_once)
+		return;
+
+	for(i = 0; i < stats_num_gauges && stats_gauges[i].stats.cycles > 0; i++)
+		;
+	if(i == stats_num_gauges)
+		stats_finished = true;
+}
+
+// true once --stats has what it waits for
+boolean stats_done(void)
+{
+	return stats_finished;
+}
+
+// labels of gauge g, with command letter cmd unless it is NUL
+static void stats_labels(char *labels, size_t len, const struct gauge_t *g, char cmd)
+{
+	char device[2 * FILENAME_MAX];
+
+	metrics_escape(device, sizeof(device), g->device);
+	if(cmd != NUL)
+		snprintf(labels, len, "device=\"%s\",command=\"%c\"", device, cmd);
+	else
+		snprintf(labels, len, "device=\"%s\"", device);
+}
+
+// write one counter of every command of every gauge that was sent at least once
+static void stats_counter(FILE *f, const char *name, const char *help, size_t offset)
+{
+	char labels[2 * FILENAME_MAX + 64];
+	const struct command_stats_t *s = NULL;
+	int i = 0, c = 0;
+
+	metrics_header(f, name, "counter", help);
+	for(i = 0; i < stats_num_gauges; i++)
+		for(c = 0; c < NUMCOMMANDS; c++)
+			if((s = &stats_gauges[i].stats.commands[c])->sent > 0)
+			{
+				stats_labels(labels, sizeof(labels), &stats_gauges[i], stats_commands[c]);
+				metrics_value(f, name, labels, *(const unsigned long *)((const char *)s + offset));
+			}
+}
+
+// write all stats in Prometheus text format, with a readable latency summary as comments
+void stats_write(FILE *f)
+{
+	char labels[2 * FILENAME_MAX + 96], base[2 * FILENAME_MAX + 64];
+	const struct command_stats_t *s = NULL;
+	const struct gauge_t *g = NULL;
+	int64_t since = (int64_t)get_monotonic_ms() - (int64_t)stats_config->stats_recent_seconds * 1000;
+	int i = 0, c = 0, k = 0;
+
+	for(i = 0; i < stats_num_gauges; i++)
+		for(c = 0; c < NUMCOMMANDS; c++)
+			if((s = &stats_gauges[i].stats.commands[c])->sent > 0)
+				fprintf(f, "# %s %c: %lu sent, p50 %.0f ms, p95 %.0f ms, max %.0f ms, %lu timeouts, %lu retries, %lu failed\n",
+					stats_gauges[i].device, stats_commands[c], s->sent, histogram_quantile(&s->latency, 0.5),
+					histogram_quantile(&s->latency, 0.95), s->latency.max, s->timeouts, s->retries, s->failures);
+
+	metrics_header(f, "mhsdpi_command_latency_seconds", "histogram", "Time from sending a sensor command to its reply.");
+	for(i = 0; i < stats_num_gauges; i++)
+		for(c = 0; c < NUMCOMMANDS; c++)
+			if((s = &stats_gauges[i].stats.commands[c])->sent > 0)
+			{
+				stats_labels(labels, sizeof(labels), &stats_gauges[i], stats_commands[c]);
+				metrics_histogram(f, "mhsdpi_command_latency_seconds", labels, &s->latency);
+			}
+
+	stats_counter(f, "mhsdpi_commands_sent_total", "Sensor commands sent, resends included.", offsetof(struct command_stats_t, sent));
+	stats_counter(f, "mhsdpi_command_replies_total", "Sensor replies received.", offsetof(struct command_stats_t, replies));
+	stats_counter(f, "mhsdpi_command_bad_replies_total", "Sensor replies that didn't parse.", offsetof(struct command_stats_t, bad_replies));
+	stats_counter(f, "mhsdpi_command_timeouts_total", "Sensor commands without a reply before their deadline.", offsetof(struct command_stats_t, timeouts));
+	stats_counter(f, "mhsdpi_command_retries_total", "Sensor commands resent.", offsetof(struct command_stats_t, retries));
+	stats_counter(f, "mhsdpi_command_failures_total", "Sensor commands that used up RETRY_COUNT.", offsetof(struct command_stats_t, failures));
+
+	metrics_header(f, "mhsdpi_command_attempts_total", "counter", "Finished sensor commands by attempts used.");
+	for(i = 0; i < stats_num_gauges; i++)
+		for(c = 0; c < NUMCOMMANDS; c++)
+			if((s = &stats_gauges[i].stats.commands[c])->sent > 0)
+				for(k = 0; k < STATSATTEMPTS; k++)
+				{
+					stats_labels(base, sizeof(base), &stats_gauges[i], stats_commands[c]);
+					snprintf(labels, sizeof(labels), "%s,attempts=\"%s\"", base, attempt_names[k]);
+					metrics_value(f, "mhsdpi_command_attempts_total", labels, s->attempts[k]);
+				}
+
+	metrics_header(f, "mhsdpi_firmware_errors_total", "counter", "Error codes replied by the gauge firmware.");
+	for(i = 0; i < stats_num_gauges; i++)
+		for(c = 0; c < NUMCOMMANDS; c++)
+			for(k = 0; k < NUMFIRMWAREERRORS; k++)
+				if((s = &stats_gauges[i].stats.commands[c])->errors[k] > 0)
+				{
+					stats_labels(base, sizeof(base), &stats_gauges[i], stats_commands[c]);
+					snprintf(labels, sizeof(labels), "%s,code=\"%s\"", base, firmware_errors[k]);
+					metrics_value(f, "mhsdpi_firmware_errors_total", labels, s->errors[k]);
+				}
+
+	metrics_header(f, "mhsdpi_poll_latency_seconds", "histogram", "Time from starting a poll cycle to its last reply or failure.");
+	for(i = 0; i < stats_num_gauges; i++)
+	{
+		stats_labels(labels, sizeof(labels), &stats_gauges[i], NUL);
+		metrics_histogram(f, "mhsdpi_poll_latency_seconds", labels, &stats_gauges[i].stats.cycle);
+	}
+
+	metrics_header(f, "mhsdpi_poll_latency_recent_seconds", "summary", "Poll cycle latency quantiles of the last 256 poll cycles within STATS_RECENT_SECONDS, _sum and _count of all poll cycles.");
+	for(i = 0; i < stats_num_gauges; i++)
+	{
+		stats_labels(labels, sizeof(labels), &stats_gauges[i], NUL);
+		metrics_summary(f, "mhsdpi_poll_latency_recent_seconds", labels, &stats_gauges[i].stats.recent, since);
+	}
+
+	metrics_header(f, "mhsdpi_poll_cycles_total", "counter", "Poll cycles emitted.");
+	for(i = 0; i < stats_num_gauges; i++)
+	{
+		stats_labels(labels, sizeof(labels), &stats_gauges[i], NUL);
+		metrics_value(f, "mhsdpi_poll_cycles_total", labels, stats_gauges[i].stats.cycles);
+	}
+
+	metrics_header(f, "mhsdpi_gauge_health", "gauge", "0 ok, 1 degraded, 2 reconnecting, 3 re-probing.");
+	for(i = 0; i < stats_num_gauges; i++)
+	{
+		stats_labels(labels, sizeof(labels), &stats_gauges[i], NUL);
+		metrics_value(f, "mhsdpi_gauge_health", labels, stats_gauges[i].health);
+	}
+
+	metrics_header(f, "mhsdpi_filter_inputs_total", "counter", "Snow depth readings into each outlier filter stage.");
+	for(i = 0; i < stats_num_gauges; i++)
+		for(k = 0; k < (g = &stats_gauges[i])->filters.num_stages; k++)
+		{
+			stats_labels(base, sizeof(base), g, NUL);
+			snprintf(labels, sizeof(labels), "%s,stage=\"%d\",filter=\"%s\"", base, k, filter_name(g->filters.stages[k].kind));
+			metrics_value(f, "mhsdpi_filter_inputs_total", labels, g->filters.stages[k].inputs);
+		}
+
+	metrics_header(f, "mhsdpi_filter_rejects_total", "counter", "Snow depth readings replaced by each outlier filter stage.");
+	for(i = 0; i < stats_num_gauges; i++)
+		for(k = 0; k < (g = &stats_gauges[i])->filters.num_stages; k++)
+		{
+			stats_labels(base, sizeof(base), g, NUL);
+			snprintf(labels, sizeof(labels), "%s,stage=\"%d\",filter=\"%s\"", base, k, filter_name(g->filters.stages[k].kind));
+			metrics_value(f, "mhsdpi_filter_rejects_total", labels, g->filters.stages[k].rejects);
+		}
+
+	link_write_stats(f);
+
+	metrics_header(f, "mhsdpi_event_loop_wakeups_total", "counter", "epoll_wait() calls of the event loop.");
+	metrics_value(f, "mhsdpi_event_loop_wakeups_total", "", stats_loop != NULL ? stats_loop->wakeups : 0);
+}
+
+// replace the stats file with the current stats
+static void stats_write_file(void)
+{
+	char tmpname[FILENAME_MAX + 8], message_buffer[FILENAME_MAX + 128];
+	FILE *f = NULL;
+	int rc = 0;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", stats_config->stats_file_name);
+	if((f = fopen(tmpname, "w")) == NULL)
+		rc = -1;
+	else
+	{
+		stats_write(f);
+		rc = (ferror(f) || fclose(f) != 0) ? -1 : 0;
+	}
+
+	if(rc == 0 && rename(tmpname, stats_config->stats_file_name) == 0) // scrapers never see a half written file
+		return;
+
+	snprintf(message_buffer, sizeof(message_buffer), "Can't write stats file %s: %s", stats_config->stats_file_name, strerror(errno));
+	stats_log(message_buffer);
+	unlink(tmpname);
+}
+
+// write the stats file, or with --stats start the poll cycle of every gauge that is ready for it
+static void stats_on_timer(int fd, uint32_t events, void *ctx)
+{
+	struct gauge_t *g = NULL;
+	int metrics = METRICBIT(METRIC_DEPTH) | METRICBIT(METRIC_VOLTAGE) | METRICBIT(METRIC_CHARGER);
+	int i = 0;
+
+	evtimer_ack(fd);
+
+	if(!stats_config->stats_once)
+	{
+		stats_write_file();
+		evtimer_arm_ms(fd, stats_config->stats_seconds * 1000);
+		return;
+	}
+
+	if(stats_config->range_seconds > 0)
+		metrics |= METRICBIT(METRIC_RANGE);
+	if(stats_config->rssi_seconds > 0)
+		metrics |= METRICBIT(METRIC_RSSI);
+
+	for(i = 0; i < stats_num_gauges; i++)
+		if((g = &stats_gauges[i])->stats.cycles == 0 && !gauge_busy(g))
+			gauge_poll(g, metrics, get_wall_ms()); // not ready yet when it is still starting up, tried again next time
+
+	if(get_monotonic_ms() >= stats_once_deadline)
+	{
+		stats_log("Not every gauge answered, dumping the stats collected so far");
+		stats_finished = true;
+	}
+	else
+		evtimer_arm_ms(fd, STATSONCEINTERVAL);
+}
+
+// write the stats file a last time
+void stats_close(void)
+{
+	if(stats_config != NULL && !stats_config->stats_once && stats_config->stats_file_name[0] != NUL)
+		stats_write_file();
+}
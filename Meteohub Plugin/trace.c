@@ -0,0 +1,205 @@
+/*
+
+	trace.c
+
+	serial flight recorder ring and its dump files
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+
+// returns CLOCK_MONOTONIC us
+uint64_t trace_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// allocate a ring of size bytes rounded up to a power of 2, 0 leaves recording off. returns 0 on success, -1 on error
+int trace_init(struct trace_t *t, size_t size)
+{
+	size_t n = 256; // room for a few records of the longest API frame
+
+	memset(t, 0, sizeof(*t));
+	if(size == 0)
+		return 0;
+
+	while(n < size)
+		n <<= 1;
+
+	if((t->buf = malloc(n)) == NULL)
+		return -1;
+	t->size = n;
+
+	return 0;
+}
+
+void trace_free(struct trace_t *t)
+{
+	free(t->buf);
+	t->buf = NULL;
+}
+
+// copy len bytes into the ring at free running position pos
+static void ring_put(struct trace_t *t, size_t pos, const void *data, size_t len)
+{
+	size_t at = pos & (t->size - 1);
+	size_t first = at + len > t->size ? t->size - at : len;
+
+	memcpy(&t->buf[at], data, first);
+	memcpy(t->buf, (const uint8_t *)data + first, len - first);
+}
+
+// copy len bytes out of the ring from free running position pos
+static void ring_get(const struct trace_t *t, size_t pos, void *data, size_t len)
+{
+	size_t at = pos & (t->size - 1);
+	size_t first = at + len > t->size ? t->size - at : len;
+
+	memcpy(data, &t->buf[at], first);
+	memcpy((uint8_t *)data + first, t->buf, len - first);
+}
+
+// record len bytes of data of type and channel at now_us, overwriting the oldest records to make room
+void trace_add(struct trace_t *t, int type, int channel, const void *data, size_t len, uint64_t now_us)
+{
+	uint8_t header[TRACE_HEADERSIZE];
+	uint16_t n = 0;
+
+	if(t->buf == NULL)
+		return;
+
+	if(len > t->size - TRACE_HEADERSIZE)
+		len = t->size - TRACE_HEADERSIZE;
+	if(len > TRACE_MAXDATA)
+		len = TRACE_MAXDATA;
+
+	while(t->head + TRACE_HEADERSIZE + len - t->tail > t->size) // drop the oldest records
+	{
+		ring_get(t, t->tail + 8, &n, sizeof(n));
+		t->tail += TRACE_HEADERSIZE + n;
+		t->records--;
+		t->overwritten++;
+	}
+
+	n = (uint16_t)len;
+	memcpy(&header[0], &now_us, 8);
+	memcpy(&header[8], &n, 2);
+	header[10] = (uint8_t)type;
+	header[11] = (uint8_t)channel;
+
+	ring_put(t, t->head, header, TRACE_HEADERSIZE);
+	ring_put(t, t->head + TRACE_HEADERSIZE, data, len);
+	t->head += TRACE_HEADERSIZE + len;
+	t->records++;
+}
+
+// write the ring to file_name through a temporary file. returns 0 on success, -1 on error (errno set)
+int trace_dump(struct trace_t *t, const char *file_name, const char *device, const char *reason, uint64_t now_us)
+{
+	char tmp_name[FILENAME_MAX + 8];
+	struct trace_file_t file;
+	struct iovec iov[3];
+	struct timespec ts;
+	size_t used = t->head - t->tail;
+	size_t at = t->tail & (t->size - 1);
+	ssize_t n = 0;
+	int fd = -1, err = 0;
+
+	if(t->buf == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", file_name) >= (int)sizeof(tmp_name))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&file, 0, sizeof(file));
+	memcpy(file.magic, TRACE_MAGIC, sizeof(file.magic));
+	file.byteorder = TRACE_BYTEORDER;
+	file.version = TRACE_VERSION;
+	file.records = t->records;
+	file.overwritten = (uint32_t)t->overwritten;
+	file.bytes = (uint32_t)used;
+	file.dump_us = now_us;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	file.wall_ms = ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+	strncpy(file.device, device, sizeof(file.device) - 1);
+	strncpy(file.reason, reason, sizeof(file.reason) - 1);
+
+	iov[0].iov_base = &file;
+	iov[0].iov_len = sizeof(file);
+	iov[1].iov_base = &t->buf[at]; // records, in two pieces when they wrap around the end of buf
+	iov[1].iov_len = at + used > t->size ? t->size - at : used;
+	iov[2].iov_base = t->buf;
+	iov[2].iov_len = used - iov[1].iov_len;
+
+	if((fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	if((n = writev(fd, iov, 3)) < 0) // a regular file takes it all or fails
+		err = errno;
+	else if(n != (ssize_t)(sizeof(file) + used))
+		err = ENOSPC;
+	if(close(fd) < 0 && err == 0)
+		err = errno;
+	if(err == 0 && rename(tmp_name, file_name) < 0)
+		err = errno;
+
+	if(err != 0)
+	{
+		unlink(tmp_name);
+		errno = err;
+		return -1;
+	}
+
+	t->dumps++;
+	return 0;
+}
+
+static uint64_t swap64(uint64_t v)
+{
+	return ((uint64_t)__builtin_bswap32((uint32_t)v) << 32) | __builtin_bswap32((uint32_t)(v >> 32));
+}
+
+// decode the record at data[*off] of a dump with len bytes of records, swap when it was written with the other
+// byte order. returns a pointer to its bytes and advances *off, NULL at the end or on a truncated record
+const uint8_t *trace_next(const uint8_t *data, size_t len, size_t *off, int swap, struct trace_record_t *r)
+{
+	const uint8_t *p = data + *off;
+
+	if(*off + TRACE_HEADERSIZE > len)
+		return NULL;
+
+	memcpy(&r->us, &p[0], 8);
+	memcpy(&r->len, &p[8], 2);
+	r->type = p[10];
+	r->channel = p[11];
+	if(swap)
+	{
+		r->us = swap64(r->us);
+		r->len = (uint16_t)((r->len >> 8) | (r->len << 8));
+	}
+
+	if(*off + TRACE_HEADERSIZE + r->len > len)
+		return NULL;
+
+	*off += TRACE_HEADERSIZE + r->len;
+	return p + TRACE_HEADERSIZE;
+}
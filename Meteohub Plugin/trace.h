@@ -0,0 +1,83 @@
+/*
+
+	trace.h
+
+	serial flight recorder: a fixed size in-memory ring of the chunks written to and read from a
+	link, plus short text notes, each with its CLOCK_MONOTONIC time in microseconds. Recording is a
+	memcpy into the ring, the oldest records are overwritten when it is full. The ring is dumped to a
+	file when something goes wrong and mhsdtrace prints the dump.
+
+	A record in the ring and in a dump is a 12 byte header (us: uint64, len: uint16, type: uint8,
+	channel: uint8, native byte order) followed by len bytes. A dump is a struct trace_file_t
+	followed by the records, oldest first. byteorder tells a reader on another machine to swap.
+
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define TRACE_MAGIC "MHTR"
+#define TRACE_VERSION 1
+#define TRACE_BYTEORDER 0x01020304u
+#define TRACE_HEADERSIZE 12		// record header in the ring and in dumps
+#define TRACE_MAXDATA 65535		// bytes per record, longer chunks are cut
+
+// record types
+#define TRACE_TX 0				// bytes written to the link
+#define TRACE_RX 1				// bytes read from the link
+#define TRACE_NOTE 2			// text, e.g. a log message or why the link went down
+
+#define TRACE_NOCHANNEL 0xff	// record isn't for one gauge
+
+// structs
+struct trace_record_t
+{
+	uint64_t us;					// CLOCK_MONOTONIC us
+	uint16_t len;
+	uint8_t type;					// TRACE_*
+	uint8_t channel;				// gauge index on the link, TRACE_NOCHANNEL for none
+};
+
+// header of a dump file
+struct trace_file_t
+{
+	char magic[4];					// TRACE_MAGIC
+	uint32_t byteorder;				// TRACE_BYTEORDER as written by the dumping machine
+	uint32_t version;
+	uint32_t records;				// in the dump
+	uint32_t overwritten;			// records lost to the ring wrapping since it was started
+	uint32_t bytes;					// of records following the header
+	uint64_t dump_us;				// CLOCK_MONOTONIC us of the dump
+	int64_t wall_ms;				// wall clock ms of the dump, record times are placed relative to it
+	char device[128];
+	char reason[128];
+};
+
+struct trace_t
+{
+	uint8_t *buf;					// NULL = recording off
+	size_t size;					// power of 2
+	size_t head;					// end of the newest record, free running counters masked on use
+	size_t tail;					// start of the oldest record
+	uint32_t records;				// in the ring
+	unsigned long overwritten;
+	unsigned long dumps;
+};
+
+// returns CLOCK_MONOTONIC us
+uint64_t trace_now_us(void);
+// allocate a ring of size bytes rounded up to a power of 2, 0 leaves recording off. returns 0 on success, -1 on error
+int trace_init(struct trace_t *t, size_t size);
+void trace_free(struct trace_t *t);
+// record len bytes of data of type and channel at now_us, overwriting the oldest records to make room
+void trace_add(struct trace_t *t, int type, int channel, const void *data, size_t len, uint64_t now_us);
+// write the ring to file_name through a temporary file. returns 0 on success, -1 on error (errno set)
+int trace_dump(struct trace_t *t, const char *file_name, const char *device, const char *reason, uint64_t now_us);
+// decode the record at data[*off] of a dump with len bytes of records, swap when it was written with the other
+// byte order. returns a pointer to its bytes and advances *off, NULL at the end or on a truncated record
+const uint8_t *trace_next(const uint8_t *data, size_t len, size_t *off, int swap, struct trace_record_t *r);
+
+#endif
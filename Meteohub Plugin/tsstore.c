@@ -0,0 +1,443 @@
+/*
+
+	tsstore.c
+
+	append-only time series store of fixed size records in memory mapped segment files
+
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "tsstore.h"
+
+#define RECORD_CRC_BYTES offsetof(struct tsstore_record_t, crc)
+#define HEADER_CRC_BYTES offsetof(struct tsstore_header_t, crc)
+
+static const struct tsstore_record_t empty_record;
+
+// fill name with the file name of segment number segment of base. returns 0 on success, -1 when it doesn't fit
+int tsstore_segment_name(char *name, size_t len, const char *base, uint32_t segment)
+{
+	if(snprintf(name, len, "%s.%06u.tss", base, segment) >= (int)len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int compare_segment(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// numbers of the existing segments of base in ascending order, *list is malloc()ed. returns the count, -1 on error
+static int list_segments(const char *base, uint32_t **list)
+{
+	char dir_buf[FILENAME_MAX], name_buf[FILENAME_MAX], suffix[8];
+	const char *name = NULL;
+	size_t namelen = 0;
+	struct dirent *de = NULL;
+	DIR *dir = NULL;
+	uint32_t *segments = NULL, *grown = NULL, segment = 0;
+	int count = 0, size = 0;
+
+	strncpy(dir_buf, base, sizeof(dir_buf) - 1);
+	dir_buf[sizeof(dir_buf) - 1] = '\0';
+	strncpy(name_buf, base, sizeof(name_buf) - 1);
+	name_buf[sizeof(name_buf) - 1] = '\0';
+	name = basename(name_buf);
+	namelen = strlen(name);
+
+	*list = NULL;
+	if((dir = opendir(dirname(dir_buf))) == NULL)
+		return -1;
+
+	while((de = readdir(dir)) != NULL)
+	{
+		if(strncmp(de->d_name, name, namelen) != 0 || de->d_name[namelen] != '.' ||
+			sscanf(&de->d_name[namelen + 1], "%u%7s", &segment, suffix) != 2 || strcmp(suffix, ".tss") != 0 || segment == 0)
+			continue;
+
+		if(count == size)
+		{
+			size = size == 0 ? 16 : size * 2;
+			if((grown = (uint32_t *)realloc(segments, size * sizeof(uint32_t))) == NULL)
+			{
+				free(segments);
+				closedir(dir);
+				return -1;
+			}
+			segments = grown;
+		}
+		segments[count++] = segment;
+	}
+	closedir(dir);
+
+	qsort(segments, count, sizeof(uint32_t), compare_segment);
+	*list = segments;
+
+	return count;
+}
+
+// map segment file name, returns the mapping and sets *len, NULL when missing or not a segment (errno set)
+static uint8_t *map_segment(const char *name, int writable, int *fd, size_t *len)
+{
+	const struct tsstore_header_t *h = NULL;
+	struct stat st;
+	uint8_t *map = NULL;
+
+	if((*fd = open(name, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if(fstat(*fd, &st) < 0 || st.st_size < TSSTORE_HEADERSIZE ||
+		(map = (uint8_t *)mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, *fd, 0)) == MAP_FAILED)
+	{
+		close(*fd);
+		errno = errno == 0 ? EINVAL : errno;
+		return NULL;
+	}
+
+	h = (const struct tsstore_header_t *)map;
+	if(h->magic != TSSTORE_MAGIC || h->version != TSSTORE_VERSION || h->record_size != sizeof(struct tsstore_record_t) ||
+		h->capacity == 0 || h->capacity > TSSTORE_MAXRECORDS || (size_t)st.st_size < TSSTORE_HEADERSIZE + ((size_t)h->capacity * h->record_size))
+	{
+		munmap(map, st.st_size);
+		close(*fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return map;
+}
+
+static int record_valid(const struct tsstore_record_t *r)
+{
+	return memcmp(r, &empty_record, sizeof(*r)) != 0 && snapshot_crc32(0, r, RECORD_CRC_BYTES) == r->crc;
+}
+
+// number of good records at the start of a segment. records up to the header count were synced and are
+// trusted, the tail after them is checked record by record and ends at the first torn or out of order one
+static uint32_t recover_count(const struct tsstore_header_t *h, const struct tsstore_record_t *records)
+{
+	uint32_t count = 0;
+
+	if(snapshot_crc32(0, h, HEADER_CRC_BYTES) == h->crc && h->count <= h->capacity)
+		count = h->count;
+
+	while(count < h->capacity && record_valid(&records[count]) && (count == 0 || records[count].time >= records[count - 1].time))
+		count++;
+
+	return count;
+}
+
+// create and map segment number segment, deleting segments older than the keep limit
+static int create_segment(struct tsstore_t *s, uint32_t segment)
+{
+	char name[FILENAME_MAX];
+	char dir_buf[FILENAME_MAX];
+	size_t len = TSSTORE_HEADERSIZE + ((size_t)s->capacity * sizeof(struct tsstore_record_t));
+	struct tsstore_header_t *h = NULL;
+	int dirfd = -1, err = 0;
+	uint32_t old = 0;
+
+	if(tsstore_segment_name(name, sizeof(name), s->base, segment) < 0 || (s->fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	// blocks are reserved up front, a store on a full card fails here with ENOSPC instead of SIGBUS on a later write
+	if((err = posix_fallocate(s->fd, 0, len)) != 0 ||
+		(s->map = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0)) == MAP_FAILED)
+	{
+		err = err != 0 ? err : errno;
+		close(s->fd);
+		unlink(name);
+		s->fd = -1;
+		s->map = NULL;
+		errno = err;
+		return -1;
+	}
+
+	s->map_len = len;
+	s->segment = segment;
+	s->header = h = (struct tsstore_header_t *)s->map;
+	s->records = (struct tsstore_record_t *)(s->map + TSSTORE_HEADERSIZE);
+	s->count = s->synced = 0;
+
+	h->magic = TSSTORE_MAGIC;
+	h->version = TSSTORE_VERSION;
+	h->record_size = sizeof(struct tsstore_record_t);
+	h->capacity = s->capacity;
+	h->segment = segment;
+	h->created = time(NULL);
+	h->count = 0;
+	h->crc = snapshot_crc32(0, h, HEADER_CRC_BYTES);
+	msync(s->map, TSSTORE_HEADERSIZE, MS_SYNC);
+
+	strncpy(dir_buf, name, sizeof(dir_buf) - 1); // make the new file name durable
+	dir_buf[sizeof(dir_buf) - 1] = '\0';
+	if((dirfd = open(dirname(dir_buf), O_RDONLY | O_CLOEXEC)) >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	if(s->keep > 0 && segment > s->keep)
+		for(old = segment - s->keep; old > 0; old--)
+		{
+			if(tsstore_segment_name(name, sizeof(name), s->base, old) < 0 || (unlink(name) < 0 && errno == ENOENT))
+				break;
+		}
+
+	return 0;
+}
+
+static void unmap_segment(struct tsstore_t *s)
+{
+	if(s->map != NULL)
+		munmap(s->map, s->map_len);
+	if(s->fd >= 0)
+		close(s->fd);
+	s->map = NULL;
+	s->header = NULL;
+	s->records = NULL;
+	s->fd = -1;
+}
+
+// open the newest segment of base for appending, recovering its tail, or create the first one. returns 0 on success, -1 on error (errno set)
+int tsstore_open(struct tsstore_t *s, const char *base, uint32_t capacity, uint32_t keep, uint32_t sync_every)
+{
+	char name[FILENAME_MAX];
+	uint32_t *segments = NULL, newest = 0, i = 0;
+	int count = 0, err = 0;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	strncpy(s->base, base, sizeof(s->base) - 1);
+	s->capacity = capacity == 0 ? 1 : (capacity > TSSTORE_MAXRECORDS ? TSSTORE_MAXRECORDS : capacity);
+	s->keep = keep;
+	s->sync_every = sync_every;
+
+	if((count = list_segments(base, &segments)) < 0)
+		return -1;
+	if(count > 0)
+		newest = segments[count - 1];
+	free(segments);
+
+	if(newest == 0)
+		return create_segment(s, 1);
+
+	if(tsstore_segment_name(name, sizeof(name), base, newest) < 0)
+		return -1;
+	if((s->map = map_segment(name, 1, &s->fd, &s->map_len)) == NULL) // not ours or damaged header, left alone
+	{
+		s->fd = -1;
+		return create_segment(s, newest + 1);
+	}
+
+	if((err = posix_fallocate(s->fd, 0, s->map_len)) != 0) // segments of older versions are sparse
+	{
+		unmap_segment(s);
+		errno = err;
+		return -1;
+	}
+
+	s->segment = newest;
+	s->header = (struct tsstore_header_t *)s->map;
+	s->records = (struct tsstore_record_t *)(s->map + TSSTORE_HEADERSIZE);
+	s->count = s->synced = recover_count(s->header, s->records);
+
+	for(i = s->count; i < s->header->capacity && memcmp(&s->records[i], &empty_record, sizeof(empty_record)) != 0; i++) // clear the torn tail
+	{
+		memset(&s->records[i], 0, sizeof(s->records[i]));
+		s->dropped++;
+	}
+
+	if(s->count > 0)
+		s->last_time = s->records[s->count - 1].time;
+
+	if(s->count == s->header->capacity)
+	{
+		unmap_segment(s);
+		return create_segment(s, newest + 1);
+	}
+
+	return 0;
+}
+
+// append one record, its crc is filled in. rotates to a new segment when the open one is full. returns 0 on success, -1 on error (errno set)
+int tsstore_append(struct tsstore_t *s, struct tsstore_record_t *r)
+{
+	if(s->map == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	if(r->time < s->last_time) // scans binary search on time, callers keep a clock set back from reaching here
+	{
+		errno = ERANGE;
+		return -1;
+	}
+
+	if(s->count == s->header->capacity)
+	{
+		tsstore_sync(s);
+		unmap_segment(s);
+		if(create_segment(s, s->segment + 1) < 0)
+			return -1;
+	}
+
+	r->crc = snapshot_crc32(0, r, RECORD_CRC_BYTES);
+	memcpy(&s->records[s->count++], r, sizeof(*r));
+	s->last_time = r->time;
+
+	if(s->sync_every > 0 && s->count - s->synced >= s->sync_every)
+		return tsstore_sync(s);
+
+	return 0;
+}
+
+// write appended records and the header back to disk. returns 0 on success, -1 on error
+int tsstore_sync(struct tsstore_t *s)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t from = 0, to = 0;
+
+	if(s->map == NULL || s->count == s->synced)
+		return 0;
+
+	// records first, the header count must never cover records that are not on disk
+	from = (TSSTORE_HEADERSIZE + ((size_t)s->synced * sizeof(struct tsstore_record_t))) & ~(page - 1);
+	to = TSSTORE_HEADERSIZE + ((size_t)s->count * sizeof(struct tsstore_record_t));
+	if(msync(s->map + from, to - from, MS_SYNC) < 0)
+		return -1;
+
+	s->header->count = s->count;
+	s->header->crc = snapshot_crc32(0, s->header, HEADER_CRC_BYTES);
+	if(msync(s->map, TSSTORE_HEADERSIZE, MS_SYNC) < 0)
+		return -1;
+
+	s->synced = s->count;
+	return 0;
+}
+
+void tsstore_close(struct tsstore_t *s)
+{
+	tsstore_sync(s);
+	unmap_segment(s);
+}
+
+// index of the first of count records with time >= from
+static uint32_t lower_bound(const struct tsstore_record_t *records, uint32_t count, int64_t from)
+{
+	uint32_t lo = 0, hi = count, mid = 0;
+
+	while(lo < hi)
+	{
+		mid = lo + ((hi - lo) / 2);
+		if(records[mid].time < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// same as tsstore_scan() passing fn one run of records per segment, for column kernels
+long tsstore_scan_blocks(const char *base, int64_t from, int64_t to, tsstore_block_fn fn, void *ctx)
+{
+	char name[FILENAME_MAX];
+	const struct tsstore_header_t *h = NULL;
+	const struct tsstore_record_t *records = NULL;
+	uint32_t *segments = NULL, count = 0, first = 0, last = 0;
+	uint8_t *map = NULL;
+	size_t len = 0;
+	long visited = 0;
+	int num_segments = 0, n = 0, fd = -1;
+	int done = 0;
+
+	if((num_segments = list_segments(base, &segments)) < 0)
+		return -1;
+
+	for(n = 0; n < num_segments && !done; n++)
+	{
+		if(tsstore_segment_name(name, sizeof(name), base, segments[n]) < 0 || (map = map_segment(name, 0, &fd, &len)) == NULL) // damaged or deleted while scanning
+			continue;
+
+		h = (const struct tsstore_header_t *)map;
+		records = (const struct tsstore_record_t *)(map + TSSTORE_HEADERSIZE);
+		count = recover_count(h, records);
+
+		if(count > 0 && records[0].time > to)
+			done = 1;
+		else if(count > 0 && records[count - 1].time >= from)
+		{
+			first = lower_bound(records, count, from);
+			last = to == INT64_MAX ? count : lower_bound(records, count, to + 1);
+			done = last < count;
+			if(last > first)
+			{
+				madvise(map, len, MADV_SEQUENTIAL);
+				visited += last - first;
+				done |= fn(&records[first], last - first, ctx) != 0;
+			}
+		}
+
+		munmap(map, len);
+		close(fd);
+	}
+	free(segments);
+
+	return visited;
+}
+
+struct record_scan_t
+{
+	tsstore_scan_fn fn;
+	void *ctx;
+	long visited;
+};
+
+static int scan_records(const struct tsstore_record_t *records, size_t n, void *ctx)
+{
+	struct record_scan_t *scan = (struct record_scan_t *)ctx;
+	size_t i = 0;
+
+	for(i = 0; i < n; i++)
+	{
+		scan->visited++;
+		if(scan->fn(&records[i], scan->ctx) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+// call fn for each record of base with from <= time <= to (wall clock ms) oldest first, without parsing or copying.
+// returns the number of records passed to fn, -1 on error (errno set)
+long tsstore_scan(const char *base, int64_t from, int64_t to, tsstore_scan_fn fn, void *ctx)
+{
+	struct record_scan_t scan;
+
+	scan.fn = fn;
+	scan.ctx = ctx;
+	scan.visited = 0;
+
+	return tsstore_scan_blocks(base, from, to, scan_records, &scan) < 0 ? -1 : scan.visited;
+}
@@ -0,0 +1,100 @@
+/*
+
+	tsstore.h
+
+	append-only time series store of fixed size records in memory mapped segment files
+	base.000001.tss, base.000002.tss, ... Each segment is a one page header followed by a
+	preallocated array of records, appends are a 32 byte store into the mapping. Every record
+	carries its own CRC so a crash or power cut leaves at most a torn tail record, which is
+	dropped when the segment is opened again.
+
+*/
+#ifndef TSSTORE_H
+#define TSSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// defines
+#define TSSTORE_MAGIC 0x5354534D // "MSTS" little endian
+#define TSSTORE_VERSION 1
+#define TSSTORE_HEADERSIZE 4096 // records start page aligned
+#define TSSTORE_MAXRECORDS (1 << 24) // upper bound for records per segment, 512 MB
+#define TSSTORE_NOVALUE -1 // reading not taken or failed
+
+// metrics bits, the plug-in's METRICBIT() of each reading
+#define TSSTORE_HAS_DEPTH 0x01
+#define TSSTORE_HAS_VOLTS 0x02
+#define TSSTORE_HAS_CHARGER 0x04
+
+// structs
+// one poll cycle of one gauge, readings not taken in the cycle (see metrics) hold their last value
+struct tsstore_record_t
+{
+	int64_t time;			// wall clock ms of the poll boundary
+	int32_t raw;			// snow depth from the sensor before filtering, mm
+	int32_t filtered;		// snow depth after the outlier filters, mm
+	int32_t smoothed;		// readings window average output to meteohub, mm
+	int16_t volts;			// battery volts * 100
+	int8_t charger;			// 0 = not charging, 1 = charging, 2 = done
+	uint8_t retries;		// commands resent in the poll cycle
+	int8_t error;			// poll cycle result, 0 = ok, < 0 = first failed reading
+	uint8_t gauge;			// gauge number
+	uint8_t metrics;		// bit mask of the readings taken in the poll cycle
+	uint8_t flags;			// reserved, 0
+	uint32_t crc;			// CRC-32 of the bytes above
+};
+
+struct tsstore_header_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t capacity;		// records
+	uint32_t segment;		// segment number
+	int64_t created;		// wall clock seconds
+	uint32_t count;			// records known to be on disk at the last sync, tail recovery starts here
+	uint32_t crc;			// CRC-32 of the bytes above
+};
+
+// writer side of a store
+struct tsstore_t
+{
+	char base[FILENAME_MAX];
+	uint32_t capacity;		// records per new segment
+	uint32_t keep;			// segments kept, older ones are deleted, 0 = keep all
+	uint32_t sync_every;	// appends between msync() calls, 0 = leave write back to the kernel
+	uint32_t segment;		// open segment number
+	int fd;
+	uint8_t *map;
+	size_t map_len;
+	struct tsstore_header_t *header;
+	struct tsstore_record_t *records;
+	uint32_t count;			// records in the open segment
+	uint32_t synced;		// count at the last sync
+	int64_t last_time;
+	unsigned long dropped;	// torn tail records dropped when the segment was opened
+};
+
+// called for each record of a scan, returns 0 to go on, anything else stops the scan
+typedef int (*tsstore_scan_fn)(const struct tsstore_record_t *r, void *ctx);
+// called for each run of n consecutive records of a block scan, straight out of the mapping
+typedef int (*tsstore_block_fn)(const struct tsstore_record_t *records, size_t n, void *ctx);
+
+// open the newest segment of base for appending, recovering its tail, or create the first one. returns 0 on success, -1 on error (errno set)
+int tsstore_open(struct tsstore_t *s, const char *base, uint32_t capacity, uint32_t keep, uint32_t sync_every);
+// append one record, its crc is filled in. rotates to a new segment when the open one is full. returns 0 on success, -1 on error (errno set)
+int tsstore_append(struct tsstore_t *s, struct tsstore_record_t *r);
+// write appended records and the header back to disk. returns 0 on success, -1 on error
+int tsstore_sync(struct tsstore_t *s);
+void tsstore_close(struct tsstore_t *s);
+// call fn for each record of base with from <= time <= to (wall clock ms) oldest first, without parsing or copying.
+// returns the number of records passed to fn, -1 on error (errno set)
+long tsstore_scan(const char *base, int64_t from, int64_t to, tsstore_scan_fn fn, void *ctx);
+// same as tsstore_scan() passing fn one run of records per segment, for column kernels
+long tsstore_scan_blocks(const char *base, int64_t from, int64_t to, tsstore_block_fn fn, void *ctx);
+// fill name with the file name of segment number segment of base. returns 0 on success, -1 when it doesn't fit
+int tsstore_segment_name(char *name, size_t len, const char *base, uint32_t segment);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+
+	xbee.c
+
+	XBee Series 1 (802.15.4) API mode frames, escaped framing (AP=2)
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "xbee.h"
+
+// parser states
+#define XBEE_WAIT_START 0
+#define XBEE_LEN_MSB 1
+#define XBEE_LEN_LSB 2
+#define XBEE_DATA 3
+#define XBEE_CHECKSUM 4
+
+// parse a 16-bit (up to 4 hex digits) or 64-bit (16 hex digits) address. returns 0 on success, -1 on error
+int xbee_parse_addr(const char *s, struct xbee_addr_t *addr)
+{
+	size_t digits = 0;
+	char *end = NULL;
+
+	if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		s += 2;
+
+	for(digits = 0; isxdigit((unsigned char)s[digits]); digits++)
+		;
+
+	if(digits == 0 || s[digits] != '\0' || (digits > 4 && digits != 16))
+		return -1;
+
+	addr->is64 = digits == 16;
+	addr->addr = strtoull(s, &end, 16);
+
+	return 0;
+}
+
+int xbee_addr_equal(const struct xbee_addr_t *a, const struct xbee_addr_t *b)
+{
+	return a->is64 == b->is64 && a->addr == b->addr;
+}
+
+// store c into out escaping it when needed, returns bytes stored
+static size_t xbee_put(uint8_t *out, uint8_t c)
+{
+	if(c == XBEE_START || c == XBEE_ESCAPE || c == XBEE_XON || c == XBEE_XOFF)
+	{
+		out[0] = XBEE_ESCAPE;
+		out[1] = c ^ XBEE_ESCAPE_XOR;
+		return 2;
+	}
+
+	out[0] = c;
+	return 1;
+}
+
+// encode arbitrary frame data (API id + data) into out. returns encoded length
+size_t xbee_encode_frame(uint8_t *out, const uint8_t *frame, size_t len)
+{
+	size_t n = 0, i = 0;
+	uint8_t sum = 0;
+
+	out[n++] = XBEE_START;
+	n += xbee_put(&out[n], (len >> 8) & 0xff);
+	n += xbee_put(&out[n], len & 0xff);
+	for(i = 0; i < len; i++)
+	{
+		sum += frame[i];
+		n += xbee_put(&out[n], frame[i]);
+	}
+	n += xbee_put(&out[n], 0xff - sum);
+
+	return n;
+}
+
+// append the address in network byte order, returns bytes stored
+static size_t xbee_put_addr(uint8_t *frame, const struct xbee_addr_t *addr)
+{
+	int bytes = addr->is64 ? 8 : 2;
+	int i = 0;
+
+	for(i = 0; i < bytes; i++)
+		frame[i] = (addr->addr >> (8 * (bytes - 1 - i))) & 0xff;
+
+	return bytes;
+}
+
+// encode a TX request of len payload bytes to dest into out. returns encoded length, 0 when the payload is too long
+size_t xbee_encode_tx(uint8_t *out, uint8_t frame_id, const struct xbee_addr_t *dest, const uint8_t *data, size_t len)
+{
+	uint8_t frame[XBEE_MAXFRAME];
+	size_t n = 0;
+
+	if(len > XBEE_MAXPAYLOAD)
+		return 0;
+
+	frame[n++] = dest->is64 ? XBEE_TX64 : XBEE_TX16;
+	frame[n++] = frame_id;
+	n += xbee_put_addr(&frame[n], dest);
+	frame[n++] = 0; // options, ack requested
+	memcpy(&frame[n], data, len);
+
+	return xbee_encode_frame(out, frame, n + len);
+}
+
+// encode an RX packet from src into out (used by simulators). returns encoded length, 0 when the payload is too long
+size_t xbee_encode_rx(uint8_t *out, const struct xbee_addr_t *src, uint8_t rssi, const uint8_t *data, size_t len)
+{
+	uint8_t frame[XBEE_MAXFRAME];
+	size_t n = 0;
+
+	if(len > XBEE_MAXPAYLOAD)
+		return 0;
+
+	frame[n++] = src->is64 ? XBEE_RX64 : XBEE_RX16;
+	n += xbee_put_addr(&frame[n], src);
+	frame[n++] = rssi;
+	frame[n++] = 0; // options
+	memcpy(&frame[n], data, len);
+
+	return xbee_encode_frame(out, frame, n + len);
+}
+
+void xbee_parser_init(struct xbee_parser_t *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->state = XBEE_WAIT_START;
+}
+
+// feed one byte, returns 1 when a frame with a good checksum is complete, -1 on a framing error, 0 otherwise
+int xbee_parse_byte(struct xbee_parser_t *p, uint8_t c)
+{
+	if(c == XBEE_START) // an unescaped start delimiter always begins a new frame
+	{
+		int lost = p->state != XBEE_WAIT_START;
+		p->state = XBEE_LEN_MSB;
+		p->escaped = 0;
+		if(lost)
+		{
+			p->errors++;
+			return -1;
+		}
+		return 0;
+	}
+
+	if(p->state == XBEE_WAIT_START)
+		return 0;
+
+	if(c == XBEE_ESCAPE)
+	{
+		p->escaped = 1;
+		return 0;
+	}
+
+	if(p->escaped)
+	{
+		c ^= XBEE_ESCAPE_XOR;
+		p->escaped = 0;
+	}
+
+	switch(p->state)
+	{
+		case XBEE_LEN_MSB:
+			p->len = c << 8;
+			p->state = XBEE_LEN_LSB;
+			break;
+
+		case XBEE_LEN_LSB:
+			p->len |= c;
+			p->pos = 0;
+			p->sum = 0;
+			if(p->len == 0 || p->len > XBEE_MAXFRAME)
+			{
+				p->state = XBEE_WAIT_START;
+				p->errors++;
+				return -1;
+			}
+			p->state = XBEE_DATA;
+			break;
+
+		case XBEE_DATA:
+			p->buf[p->pos++] = c;
+			p->sum += c;
+			if(p->pos == p->len)
+				p->state = XBEE_CHECKSUM;
+			break;
+
+		case XBEE_CHECKSUM:
+			p->state = XBEE_WAIT_START;
+			if((uint8_t)(p->sum + c) != 0xff)
+			{
+				p->errors++;
+				return -1;
+			}
+			p->frames++;
+			return 1;
+	}
+
+	return 0;
+}
+
+// read a big endian address of bytes length
+static uint64_t xbee_get_addr(const uint8_t *p, int bytes)
+{
+	uint64_t addr = 0;
+	int i = 0;
+
+	for(i = 0; i < bytes; i++)
+		addr = (addr << 8) | p[i];
+
+	return addr;
+}
+
+// decode the completed RX, TX or TX status frame in the parser. returns 0 on success, -1 for unknown or short frames
+int xbee_decode(const struct xbee_parser_t *p, struct xbee_frame_t *frame)
+{
+	const uint8_t *b = p->buf;
+	int bytes = 0;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->api_id = b[0];
+
+	switch(b[0])
+	{
+		case XBEE_RX64:
+		case XBEE_RX16:
+			bytes = b[0] == XBEE_RX64 ? 8 : 2;
+			if(p->len < (size_t)(1 + bytes + 2))
+				return -1;
+			frame->addr.is64 = b[0] == XBEE_RX64;
+			frame->addr.addr = xbee_get_addr(&b[1], bytes);
+			frame->rssi = b[1 + bytes];
+			frame->options = b[2 + bytes];
+			frame->data = &b[3 + bytes];
+			frame->len = p->len - (3 + bytes);
+			return 0;
+
+		case XBEE_TX64:
+		case XBEE_TX16:
+			bytes = b[0] == XBEE_TX64 ? 8 : 2;
+			if(p->len < (size_t)(2 + bytes + 1))
+				return -1;
+			frame->frame_id = b[1];
+			frame->addr.is64 = b[0] == XBEE_TX64;
+			frame->addr.addr = xbee_get_addr(&b[2], bytes);
+			frame->options = b[2 + bytes];
+			frame->data = &b[3 + bytes];
+			frame->len = p->len - (3 + bytes);
+			return 0;
+
+		case XBEE_TXSTATUS:
+			if(p->len < 3)
+				return -1;
+			frame->frame_id = b[1];
+			frame->status = b[2];
+			return 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,87 @@
+/*
+
+	xbee.h
+
+	XBee Series 1 (802.15.4) API mode frames, escaped framing (AP=2)
+
+*/
+#ifndef XBEE_H
+#define XBEE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// defines
+#define XBEE_START 0x7E
+#define XBEE_ESCAPE 0x7D
+#define XBEE_XON 0x11
+#define XBEE_XOFF 0x13
+#define XBEE_ESCAPE_XOR 0x20
+
+#define XBEE_MAXFRAME 128 // max frame data length (API id + data), Series 1 payloads are at most 100 bytes
+#define XBEE_MAXPAYLOAD 100
+#define XBEE_MAXENCODED ((XBEE_MAXFRAME + 4) * 2) // start delimiter, length, frame data and checksum, all but the start escaped
+
+// API ids
+#define XBEE_TX64 0x00 // TX request, 64-bit address
+#define XBEE_TX16 0x01 // TX request, 16-bit address
+#define XBEE_RX64 0x80 // RX packet, 64-bit address
+#define XBEE_RX16 0x81 // RX packet, 16-bit address
+#define XBEE_TXSTATUS 0x89
+
+// TX status values
+#define XBEE_TX_SUCCESS 0
+#define XBEE_TX_NOACK 1
+#define XBEE_TX_CCAFAIL 2
+#define XBEE_TX_PURGED 3
+
+// structs
+struct xbee_addr_t
+{
+	int is64;			// true for 64-bit serial number addresses, false for 16-bit MY addresses
+	uint64_t addr;
+};
+
+// received frame
+struct xbee_frame_t
+{
+	uint8_t api_id;
+	struct xbee_addr_t addr;	// source of RX packets, destination of TX requests
+	uint8_t rssi;			// RX packets, -dBm
+	uint8_t options;		// RX packets
+	uint8_t frame_id;		// TX requests and TX status
+	uint8_t status;			// TX status
+	const uint8_t *data;	// RX packet or TX request payload, points into the parser buffer
+	size_t len;
+};
+
+// streaming frame decoder, fed one byte at a time
+struct xbee_parser_t
+{
+	int state;
+	int escaped;
+	size_t len;			// frame data length from the header
+	size_t pos;
+	uint8_t sum;
+	uint8_t buf[XBEE_MAXFRAME];
+	unsigned long frames;
+	unsigned long errors;	// bad checksums and oversized frames
+};
+
+// parse a 16-bit (up to 4 hex digits) or 64-bit (16 hex digits) address. returns 0 on success, -1 on error
+int xbee_parse_addr(const char *s, struct xbee_addr_t *addr);
+int xbee_addr_equal(const struct xbee_addr_t *a, const struct xbee_addr_t *b);
+// encode a TX request of len payload bytes to dest into out. returns encoded length, 0 when the payload is too long
+size_t xbee_encode_tx(uint8_t *out, uint8_t frame_id, const struct xbee_addr_t *dest, const uint8_t *data, size_t len);
+// encode an RX packet from src into out (used by simulators). returns encoded length, 0 when the payload is too long
+size_t xbee_encode_rx(uint8_t *out, const struct xbee_addr_t *src, uint8_t rssi, const uint8_t *data, size_t len);
+// encode arbitrary frame data (API id + data) into out. returns encoded length
+size_t xbee_encode_frame(uint8_t *out, const uint8_t *frame, size_t len);
+
+void xbee_parser_init(struct xbee_parser_t *p);
+// feed one byte, returns 1 when a frame with a good checksum is complete, -1 on a framing error, 0 otherwise
+int xbee_parse_byte(struct xbee_parser_t *p, uint8_t c);
+// decode the completed RX, TX or TX status frame in the parser. returns 0 on success, -1 for unknown or short frames
+int xbee_decode(const struct xbee_parser_t *p, struct xbee_frame_t *frame);
+
+#endif
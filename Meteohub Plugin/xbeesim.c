@@ -0,0 +1,304 @@
+/*
+
+	xbeesim.c
+
+	coordinator XBee simulator for testing the plug-in in API mode without radios. Creates a pty,
+	links it to a device name, decodes TX request frames written to it and answers each command
+	with an RX packet from the addressed gauge the way the sensor firmware does.
+
+	usage: xbeesim [-l link_name] [-r reply_ms] [-t] address [address ...]
+	  -l link_name  name of the symlink to the pty slave, default /tmp/ttyXBee
+	  -r reply_ms   sensor reply delay in milliseconds, default 200
+	  -t            run frame encode/decode self test and exit
+	  address       XBee address of each simulated gauge, 16-bit (e.g. 1234) or 64-bit (e.g. 0013A200406B1234)
+
+*/
+
+#define _GNU_SOURCE // posix_openpt(), ptsname(), cfmakeraw()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "xbee.h"
+
+#define MAXSIMGAUGES 16
+#define MAXREPLIES 64
+
+struct reply_t
+{
+	int64_t due;					// ms, CLOCK_MONOTONIC
+	struct xbee_addr_t src;
+	char text[256];
+};
+
+static struct xbee_addr_t gauges[MAXSIMGAUGES];
+static int depth[MAXSIMGAUGES];
+static int num_gauges = 0;
+static struct reply_t replies[MAXREPLIES];
+static int num_replies = 0;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// reply line of gauge g to command c, empty for commands the firmware does not answer
+static void sensor_reply(int g, char c, int arg, char *out)
+{
+	out[0] = '\0';
+	switch(c)
+	{
+		case 'A':
+			sprintf(out, "Trimble Ultrasonic Wireless Snow Depth Gauge - Ver 2D-1.7a (simulated gauge %d)\n", g);
+			break;
+		case 'C':
+		case 'G':
+			sprintf(out, "%c%04d\n", c, 5000);
+			break;
+		case 'D':
+			depth[g] += (rand() % 7) - 3;
+			sprintf(out, "D%04d\n", depth[g]);
+			break;
+		case 'R':
+			sprintf(out, "R%04d\n", 5000 - depth[g]);
+			break;
+		case 'S':
+			sprintf(out, "S%04d\n", arg);
+			break;
+		case 'T':
+			sprintf(out, "T%04d\n", 1);
+			break;
+		case 'V':
+			sprintf(out, "V%04d\n", 412 - g);
+			break;
+	}
+}
+
+static void queue_reply(const struct xbee_addr_t *src, int64_t due, const char *text)
+{
+	if(num_replies == MAXREPLIES || text[0] == '\0')
+		return;
+
+	replies[num_replies].due = due;
+	replies[num_replies].src = *src;
+	snprintf(replies[num_replies].text, sizeof(replies[num_replies].text), "%s", text);
+	num_replies++;
+}
+
+static void write_frame(int fd, const uint8_t *out, size_t n)
+{
+	if(write(fd, out, n) != (ssize_t)n)
+		perror("write");
+}
+
+// answer one TX request frame
+static void handle_tx(int fd, const struct xbee_frame_t *frame, int reply_ms)
+{
+	uint8_t out[XBEE_MAXENCODED];
+	uint8_t status[3] = {XBEE_TXSTATUS, frame->frame_id, XBEE_TX_NOACK};
+	char text[256];
+	int64_t due = now_ms();
+	size_t i = 0;
+	int g = 0;
+
+	for(g = 0; g < num_gauges; g++)
+		if(xbee_addr_equal(&gauges[g], &frame->addr))
+			break;
+
+	if(g < num_gauges)
+		status[2] = XBEE_TX_SUCCESS;
+	if(frame->frame_id != 0)
+		write_frame(fd, out, xbee_encode_frame(out, status, sizeof(status)));
+	if(g == num_gauges)
+		return;
+
+	for(i = 0; i < frame->len; i++)
+	{
+		char c = frame->data[i];
+		char digits[5] = "";
+		int arg = 0;
+
+		if(c == 'S' && i + 4 < frame->len) // S is followed by 4 digits and a newline
+		{
+			memcpy(digits, &frame->data[i + 1], 4);
+			arg = atoi(digits);
+			i += 5;
+		}
+		sensor_reply(g, c, arg, text);
+		if(c == 'A' && text[0] != '\0')
+		{
+			int line = 0;
+
+			queue_reply(&frame->addr, due += reply_ms, text);
+			for(line = 0; line < 6; line++)
+			{
+				sprintf(text, "Sensor info line %d\n", line + 1);
+				queue_reply(&frame->addr, due, text);
+			}
+		}
+		else
+			queue_reply(&frame->addr, due += reply_ms, text);
+	}
+}
+
+// send the replies that are due, returns ms until the next one, -1 when none are queued
+static int send_replies(int fd)
+{
+	uint8_t out[XBEE_MAXENCODED];
+	int64_t now = now_ms();
+	int64_t next = -1;
+	int i = 0, j = 0;
+
+	for(i = 0; i < num_replies; i++)
+	{
+		if(replies[i].due <= now)
+			write_frame(fd, out, xbee_encode_rx(out, &replies[i].src, 40, (const uint8_t *)replies[i].text, strlen(replies[i].text)));
+		else
+		{
+			if(next < 0 || replies[i].due - now < next)
+				next = replies[i].due - now;
+			replies[j++] = replies[i];
+		}
+	}
+	num_replies = j;
+
+	return (int)next;
+}
+
+// encode frames with bytes that need escaping and decode them back
+static int self_test(void)
+{
+	struct xbee_parser_t p;
+	struct xbee_frame_t frame;
+	struct xbee_addr_t a16, a64;
+	uint8_t out[XBEE_MAXENCODED];
+	const uint8_t payload[] = {'D', 0x7E, 0x7D, 0x11, 0x13, '\n'};
+	size_t n = 0, i = 0;
+	int frames = 0, failed = 0;
+
+	xbee_parse_addr("7D11", &a16);
+	xbee_parse_addr("0013A200407E7D13", &a64);
+
+	xbee_parser_init(&p);
+	n = xbee_encode_tx(out, 0x7E, &a64, payload, sizeof(payload));
+	n += xbee_encode_rx(&out[n], &a16, 0x13, payload, sizeof(payload));
+	n += xbee_encode_rx(&out[n], &a64, 40, payload, sizeof(payload));
+
+	for(i = 0; i < n; i++)
+	{
+		if(xbee_parse_byte(&p, out[i]) != 1)
+			continue;
+		frames++;
+		if(xbee_decode(&p, &frame) != 0 || frame.len != sizeof(payload) || memcmp(frame.data, payload, sizeof(payload)) != 0)
+			failed++;
+		else if(frames == 1 && (frame.api_id != XBEE_TX64 || frame.frame_id != 0x7E || !xbee_addr_equal(&frame.addr, &a64)))
+			failed++;
+		else if(frames == 2 && (frame.api_id != XBEE_RX16 || frame.rssi != 0x13 || !xbee_addr_equal(&frame.addr, &a16)))
+			failed++;
+		else if(frames == 3 && (frame.api_id != XBEE_RX64 || !xbee_addr_equal(&frame.addr, &a64)))
+			failed++;
+	}
+
+	if(n > 0)
+		out[n - 1] ^= 1; // corrupt the checksum of the last frame
+	xbee_parser_init(&p);
+	for(i = 0; i < n; i++)
+		xbee_parse_byte(&p, out[i]);
+	if(p.frames != 2 || p.errors != 1)
+		failed++;
+
+	if(xbee_encode_tx(out, 1, &a16, payload, XBEE_MAXPAYLOAD + 1) != 0)
+		failed++;
+
+	printf("xbee self test: %d frames, %s\n", frames, (frames == 3 && failed == 0) ? "ok" : "FAILED");
+
+	return (frames == 3 && failed == 0) ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct xbee_parser_t parser;
+	struct xbee_frame_t frame;
+	struct termios tio;
+	struct pollfd pfd;
+	const char *link_name = "/tmp/ttyXBee";
+	uint8_t buf[512];
+	int reply_ms = 200;
+	int master = -1, slave = -1;
+	int opt = 0, timeout = -1;
+	ssize_t n = 0, i = 0;
+
+	while((opt = getopt(argc, argv, "l:r:t")) != -1)
+	{
+		switch(opt)
+		{
+			case 'l':
+				link_name = optarg;
+				break;
+			case 'r':
+				reply_ms = atoi(optarg);
+				break;
+			case 't':
+				return self_test();
+			default:
+				fprintf(stderr, "usage: %s [-l link_name] [-r reply_ms] [-t] address [address ...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	for(; optind < argc && num_gauges < MAXSIMGAUGES; optind++)
+	{
+		if(xbee_parse_addr(argv[optind], &gauges[num_gauges]) < 0)
+		{
+			fprintf(stderr, "bad XBee address %s\n", argv[optind]);
+			return 1;
+		}
+		depth[num_gauges++] = 800;
+	}
+
+	if((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+	{
+		perror("posix_openpt");
+		return 1;
+	}
+
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY); // kept open so the master does not see a hang-up between plug-in runs
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	unlink(link_name);
+	if(symlink(ptsname(master), link_name) < 0)
+	{
+		perror("symlink");
+		return 1;
+	}
+	fprintf(stderr, "%s -> %s, %d simulated gauges\n", link_name, ptsname(master), num_gauges);
+
+	xbee_parser_init(&parser);
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	for(;;)
+	{
+		if(poll(&pfd, 1, timeout) > 0 && (n = read(master, buf, sizeof(buf))) > 0)
+		{
+			for(i = 0; i < n; i++)
+				if(xbee_parse_byte(&parser, buf[i]) == 1 && xbee_decode(&parser, &frame) == 0 && (frame.api_id == XBEE_TX64 || frame.api_id == XBEE_TX16))
+					handle_tx(master, &frame, reply_ms);
+		}
+		timeout = send_replies(master);
+	}
+
+	close(slave);
+	return 0;
+}